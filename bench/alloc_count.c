@@ -0,0 +1,146 @@
+#include <dlfcn.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * Counts heap allocations of a process it is preloaded into:
+ * @code
+ * LD_PRELOAD=./liballoc-count.so ./cache-proxy 8080 &
+ * # run the load
+ * kill -USR2 $!
+ * @endcode
+ * `SIGUSR2` prints the counters to stderr and resets them, so a warm-up
+ * can be excluded. Calls per request are the difference divided by the
+ * number of requests of the load
+ */
+
+/**
+ * `dlsym` may allocate before the real allocator is known, such requests
+ * are served from here and never freed
+ */
+#define ALLOC_COUNT_BOOTSTRAP_SIZE 4096
+
+static void *(*realMalloc)(size_t size);
+static void *(*realCalloc)(size_t count, size_t size);
+static void *(*realRealloc)(void *ptr, size_t size);
+static void  (*realFree)(void *ptr);
+
+static atomic_size_t allocsQ;
+static atomic_size_t freesQ;
+static atomic_size_t allocatedBytes;
+
+static char          bootstrap[ALLOC_COUNT_BOOTSTRAP_SIZE]
+  __attribute__((aligned(16)));
+static atomic_size_t bootstrapUsed;
+static atomic_bool   resolving;
+
+static void *bootstrapAlloc(const size_t size) {
+  const size_t aligned = (size + 15) & ~(size_t) 15;
+  const size_t offset  = atomic_fetch_add(&bootstrapUsed, aligned);
+  return offset + aligned <= sizeof(bootstrap) ? bootstrap + offset : NULL;
+}
+
+static bool isBootstrap(const void *ptr) {
+  return (const char *) ptr >= bootstrap
+         && (const char *) ptr < bootstrap + sizeof(bootstrap);
+}
+
+/**
+ * appends @code label and @code value in decimal to @code line,
+ * async-signal-safe
+ * @return new end of @code line
+ */
+static char *formatNumber(char *line, const char *label, size_t value) {
+  const size_t labelLen = strlen(label);
+  memcpy(line, label, labelLen);
+  line += labelLen;
+
+  char   digits[24];
+  size_t pos = sizeof(digits);
+  do {
+    digits[--pos] = (char) ('0' + value % 10);
+    value /= 10;
+  } while (value > 0);
+  memcpy(line, digits + pos, sizeof(digits) - pos);
+  return line + sizeof(digits) - pos;
+}
+
+static void onReport(const int signal) {
+  (void) signal;
+  char  line[128];
+  char *end = formatNumber(line, "allocs ", atomic_exchange(&allocsQ, 0));
+  end       = formatNumber(end, " frees ", atomic_exchange(&freesQ, 0));
+  end       = formatNumber(
+    end, " bytes ", atomic_exchange(&allocatedBytes, 0)
+  );
+  *end++ = '\n';
+  if (write(STDERR_FILENO, line, end - line) < 0) {
+    return;
+  }
+}
+
+static void resolve(void) {
+  atomic_store(&resolving, true);
+  *(void **) &realMalloc  = dlsym(RTLD_NEXT, "malloc");
+  *(void **) &realCalloc  = dlsym(RTLD_NEXT, "calloc");
+  *(void **) &realRealloc = dlsym(RTLD_NEXT, "realloc");
+  *(void **) &realFree    = dlsym(RTLD_NEXT, "free");
+  atomic_store(&resolving, false);
+}
+
+__attribute__((constructor)) static void init(void) {
+  if (realMalloc == NULL) resolve();
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = onReport;
+  action.sa_flags   = SA_RESTART;
+  sigaction(SIGUSR2, &action, NULL);
+}
+
+static void countAlloc(const size_t size) {
+  atomic_fetch_add_explicit(&allocsQ, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&allocatedBytes, size, memory_order_relaxed);
+}
+
+void *malloc(const size_t size) {
+  if (atomic_load(&resolving)) return bootstrapAlloc(size);
+  if (realMalloc == NULL) resolve();
+  countAlloc(size);
+  return realMalloc(size);
+}
+
+void *calloc(const size_t count, const size_t size) {
+  if (atomic_load(&resolving)) {
+    /*
+     * static storage is zeroed and never reused
+     */
+    return bootstrapAlloc(count * size);
+  }
+  if (realCalloc == NULL) resolve();
+  countAlloc(count * size);
+  return realCalloc(count, size);
+}
+
+void *realloc(void *ptr, const size_t size) {
+  if (realRealloc == NULL) resolve();
+  if (isBootstrap(ptr)) {
+    void *moved = malloc(size);
+    if (moved != NULL) {
+      const size_t left = bootstrap + sizeof(bootstrap) - (char *) ptr;
+      memcpy(moved, ptr, size < left ? size : left);
+    }
+    return moved;
+  }
+  countAlloc(size);
+  return realRealloc(ptr, size);
+}
+
+void free(void *ptr) {
+  if (ptr == NULL || isBootstrap(ptr)) return;
+  if (realFree == NULL) resolve();
+  atomic_fetch_add_explicit(&freesQ, 1, memory_order_relaxed);
+  realFree(ptr);
+}
@@ -0,0 +1,130 @@
+#include "../src/cache/cache.h"
+#include "../src/utils/log.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * Hit lookup throughput of `CacheManagerT` shared by a growing number of
+ * threads, like workers share it. Locks are per shard, so the total of
+ * random lookups should grow with threads up to the number of cores. A
+ * second pass has all threads look up one hot url, which contends on its
+ * shard lock and the policy lock
+ */
+
+#define BENCH_ENTRIES            100000
+#define BENCH_LOOKUPS_PER_THREAD 250000
+#define BENCH_MAX_THREADS        64
+#define BENCH_URL_FORMAT         "http://bench.example/objects/%zu"
+#define BENCH_URL_MAX_LEN        64
+
+typedef struct BenchThread {
+  pthread_t      thread;
+  CacheManagerT *cache;
+  uint64_t       seed;
+  /**
+   * every lookup is for the first url
+   */
+  bool           hot;
+} BenchThreadT;
+
+static double nowSeconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double) now.tv_sec + (double) now.tv_nsec / 1e9;
+}
+
+static uint64_t nextRandom(uint64_t *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+static CacheEntryT *lookup(CacheManagerT *cache, const char *url) {
+  bool         created = false;
+  CacheEntryT *refresh = NULL;
+  CacheEntryT *entry   = CacheManagerT_getOrCreate_CacheEntryT(
+    cache, url, &created, &refresh
+  );
+  if (entry == NULL) {
+    fprintf(stderr, "lookup of %s failed\n", url);
+    exit(EXIT_FAILURE);
+  }
+  return entry;
+}
+
+static void *runThread(void *arg) {
+  BenchThreadT *bench = arg;
+  uint64_t      state = bench->seed;
+  char          url[BENCH_URL_MAX_LEN];
+  for (size_t i = 0; i < BENCH_LOOKUPS_PER_THREAD; ++i) {
+    const size_t index = nextRandom(&state) % BENCH_ENTRIES;
+    snprintf(url, sizeof(url), BENCH_URL_FORMAT, bench->hot ? 0 : index);
+    CacheEntryT *entry = lookup(bench->cache, url);
+    if (CacheEntryT_release(entry)) {
+      CacheEntryT_delete(entry);
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @return millions of lookups per second of @code threadsQ threads
+ */
+static double runPass(
+  CacheManagerT *cache, const int threadsQ, const bool hot
+) {
+  BenchThreadT threads[BENCH_MAX_THREADS];
+  const double start = nowSeconds();
+  for (int i = 0; i < threadsQ; ++i) {
+    threads[i].cache = cache;
+    threads[i].seed  = 88172645463325252ULL + (uint64_t) i * 7919;
+    threads[i].hot   = hot;
+    const int ret    = pthread_create(
+      &threads[i].thread, NULL, runThread, &threads[i]
+    );
+    if (ret != 0) {
+      fprintf(stderr, "pthread_create %s\n", strerror(ret));
+      exit(EXIT_FAILURE);
+    }
+  }
+  for (int i = 0; i < threadsQ; ++i) {
+    pthread_join(threads[i].thread, NULL);
+  }
+  const double elapsed = nowSeconds() - start;
+  return (double) threadsQ * BENCH_LOOKUPS_PER_THREAD / elapsed / 1e6;
+}
+
+int main(void) {
+  logSetLevel(LOG_ERROR_LEVEL);
+  CacheConfigT config = {
+    .sizeLimit       = SIZE_MAX,
+    .objectSizeLimit = SIZE_MAX,
+    .policy          = CachePolicyLru,
+    .entryThreshold  = 0,
+  };
+  CacheManagerT *cache = CacheManagerT_new(&config);
+  if (cache == NULL) {
+    fprintf(stderr, "CacheManagerT_new failed\n");
+    return EXIT_FAILURE;
+  }
+  char url[BENCH_URL_MAX_LEN];
+  for (size_t i = 0; i < BENCH_ENTRIES; ++i) {
+    snprintf(url, sizeof(url), BENCH_URL_FORMAT, i);
+    CacheEntryT *entry = lookup(cache, url);
+    CacheEntryT_updateStatus(entry, Success);
+    CacheEntryT_release(entry);
+  }
+
+  for (int threadsQ = 1; threadsQ <= BENCH_MAX_THREADS; threadsQ *= 2) {
+    printf("%2d threads: %6.2f M random, %6.2f M hot hit lookups/s, "
+           "%d shards\n",
+           threadsQ, runPass(cache, threadsQ, false),
+           runPass(cache, threadsQ, true), CACHE_SHARDS);
+  }
+  return 0;
+}
@@ -0,0 +1,92 @@
+#include "../src/cache/cache.h"
+#include "../src/server/proxy.h"
+#include "../src/utils/log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * Hit lookup latency of `CacheManagerT` for growing numbers of entries,
+ * the url of every lookup is formatted like a request does
+ */
+
+#define BENCH_LOOKUPS 1000000
+#define BENCH_URL_FORMAT "http://bench.example/objects/%zu"
+#define BENCH_URL_MAX_LEN 64
+
+static double nowSeconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double) now.tv_sec + (double) now.tv_nsec / 1e9;
+}
+
+/**
+ * xorshift keeps the lookup order out of the hardware prefetcher's reach
+ * without the cost of `rand`
+ */
+static uint64_t nextRandom(uint64_t *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+static CacheEntryT *lookup(CacheManagerT *cache, const char *url) {
+  bool         created = false;
+  CacheEntryT *refresh = NULL;
+  CacheEntryT *entry   = CacheManagerT_getOrCreate_CacheEntryT(
+    cache, url, &created, &refresh
+  );
+  if (entry == NULL) {
+    fprintf(stderr, "lookup of %s failed\n", url);
+    exit(EXIT_FAILURE);
+  }
+  return entry;
+}
+
+static void runSize(const size_t entriesQ) {
+  CacheConfigT config = {
+    .sizeLimit       = SIZE_MAX,
+    .objectSizeLimit = SIZE_MAX,
+    .policy          = CachePolicyLru,
+    .entryThreshold  = 0,
+  };
+  CacheManagerT *cache = CacheManagerT_new(&config);
+  if (cache == NULL) {
+    fprintf(stderr, "CacheManagerT_new failed\n");
+    exit(EXIT_FAILURE);
+  }
+
+  char url[BENCH_URL_MAX_LEN];
+  for (size_t i = 0; i < entriesQ; ++i) {
+    snprintf(url, sizeof(url), BENCH_URL_FORMAT, i);
+    CacheEntryT *entry = lookup(cache, url);
+    CacheEntryT_updateStatus(entry, Success);
+    CacheEntryT_release(entry);
+  }
+
+  uint64_t     state = 88172645463325252ULL;
+  const double start = nowSeconds();
+  for (size_t i = 0; i < BENCH_LOOKUPS; ++i) {
+    snprintf(url, sizeof(url), BENCH_URL_FORMAT,
+             (size_t) (nextRandom(&state) % entriesQ));
+    CacheEntryT *entry = lookup(cache, url);
+    if (CacheEntryT_release(entry)) {
+      CacheEntryT_delete(entry);
+    }
+  }
+  const double elapsed = nowSeconds() - start;
+  printf("%8zu entries: %6.3f us per hit lookup\n",
+         entriesQ, elapsed * 1e6 / BENCH_LOOKUPS);
+}
+
+int main(void) {
+  logSetLevel(LOG_ERROR_LEVEL);
+  const size_t sizes[] = {1000, 100000, 1000000};
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(*sizes); ++i) {
+    runSize(sizes[i]);
+  }
+  return 0;
+}
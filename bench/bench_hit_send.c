@@ -0,0 +1,149 @@
+#include "../src/cache/cache.h"
+#include "../src/server/proxy.h"
+#include "../src/utils/log.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+/**
+ * CPU spent per GB of cache hits sent to a loopback client, with
+ * `sendfile` from a memfd slot and with the `sendmsg` copy which serves
+ * heap chunks and short runs. The client discards data in the kernel, so
+ * the receiving side costs as little as possible
+ */
+
+#define BENCH_BYTES      (4ULL * 1024 * 1024 * 1024)
+#define BENCH_DRAIN_SIZE (1024 * 1024)
+
+typedef enum BenchMode {
+  BenchSendfile,
+  BenchSendmsg,
+} BenchModeT;
+
+static double nowSeconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double) now.tv_sec + (double) now.tv_nsec / 1e9;
+}
+
+static double cpuSeconds(const int who) {
+  struct rusage usage;
+  getrusage(who, &usage);
+  return (double) (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec)
+         + (double) (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static void *drain(void *arg) {
+  const int fd = *(const int *) arg;
+  /*
+   * `MSG_TRUNC` makes TCP drop the data without copying it out
+   */
+  while (recv(fd, NULL, BENCH_DRAIN_SIZE, MSG_TRUNC) > 0) {}
+  close(fd);
+  return NULL;
+}
+
+/**
+ * @return connected loopback TCP pair, the accepted end in @code peer
+ */
+static int connectPair(int *peer) {
+  struct sockaddr_in address = {0};
+  socklen_t          len     = sizeof(address);
+  address.sin_family      = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  const int listener = socket(AF_INET, SOCK_STREAM, 0);
+  const int fd       = socket(AF_INET, SOCK_STREAM, 0);
+  if (listener < 0 || fd < 0
+      || bind(listener, (struct sockaddr *) &address, len) != 0
+      || listen(listener, 1) != 0
+      || getsockname(listener, (struct sockaddr *) &address, &len) != 0
+      || connect(fd, (struct sockaddr *) &address, len) != 0) {
+    perror("loopback pair");
+    exit(EXIT_FAILURE);
+  }
+  *peer = accept(listener, NULL, NULL);
+  close(listener);
+  return fd;
+}
+
+static ssize_t sendRun(
+  const BenchModeT        mode,
+  const CacheEntryChunkT *chunk,
+  const int               fd,
+  const size_t            offset,
+  const size_t            size
+) {
+  if (mode == BenchSendfile) {
+    return CacheEntryChunkT_send(chunk, fd, offset, size);
+  }
+  OutputVectorT out;
+  OutputVectorT_reset(&out);
+  OutputVectorT_add(&out, chunk->data + offset, size);
+  return OutputVectorT_send(&out, fd);
+}
+
+static void runMode(
+  const BenchModeT mode, const char *name, const CacheEntryChunkT *chunk
+) {
+  int       peer = 0;
+  const int fd   = connectPair(&peer);
+  pthread_t drainer;
+  if (pthread_create(&drainer, NULL, drain, &peer) != 0) {
+    perror("pthread_create");
+    exit(EXIT_FAILURE);
+  }
+
+  const double start     = nowSeconds();
+  const double threadCpu = cpuSeconds(RUSAGE_THREAD);
+  const double totalCpu  = cpuSeconds(RUSAGE_SELF);
+  const size_t size      = chunk->maxDataSize;
+  size_t       offset    = 0;
+  for (unsigned long long sent = 0; sent < BENCH_BYTES;) {
+    const ssize_t written = sendRun(mode, chunk, fd, offset, size - offset);
+    if (written < 0) {
+      perror(name);
+      exit(EXIT_FAILURE);
+    }
+    sent   += written;
+    offset  = (offset + written) % size;
+  }
+  const double senderCpu = cpuSeconds(RUSAGE_THREAD) - threadCpu;
+  shutdown(fd, SHUT_WR);
+  pthread_join(drainer, NULL);
+  close(fd);
+  const double processCpu = cpuSeconds(RUSAGE_SELF) - totalCpu;
+  const double elapsed    = nowSeconds() - start;
+  const double gigabytes  = (double) BENCH_BYTES / 1e9;
+  printf("%-8s: %5.3f CPU s/GB sender, %5.3f CPU s/GB total, %6.2f GB/s\n",
+         name, senderCpu / gigabytes, processCpu / gigabytes,
+         gigabytes / elapsed);
+}
+
+int main(void) {
+  logSetLevel(LOG_ERROR_LEVEL);
+  CacheEntryChunkT *chunk = CacheEntryChunkT_new(kDefCacheChunkSize);
+  if (chunk == NULL) {
+    fprintf(stderr, "CacheEntryChunkT_new failed\n");
+    return EXIT_FAILURE;
+  }
+  if (chunk->fd < 0) {
+    fprintf(stderr, "memfd store is unavailable, sendfile is not used\n");
+  }
+  for (size_t i = 0; i < chunk->maxDataSize; ++i) {
+    chunk->data[i] = (char) ('a' + i % 26);
+  }
+  atomic_store(&chunk->curDataSize, chunk->maxDataSize);
+
+  runMode(BenchSendfile, "sendfile", chunk);
+  runMode(BenchSendmsg, "sendmsg", chunk);
+  CacheEntryChunkT_delete(chunk);
+  return 0;
+}
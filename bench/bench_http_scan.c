@@ -0,0 +1,131 @@
+/*
+ * the scanner variants are static, the benchmark builds its own copy
+ */
+#include "../src/server/http_scan.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/**
+ * Times the scalar, SSE2 and AVX2 variants of the head scanners on a
+ * browser-like request head and checks that they agree
+ */
+
+#define BENCH_ROUNDS 200000
+
+typedef const char *(*ScanFn)(const char *cur, const char *end);
+
+typedef struct ScanVariant {
+  const char *name;
+  ScanFn      headEnd;
+  ScanFn      token;
+  ScanFn      value;
+} ScanVariantT;
+
+static const char Head[] =
+  "GET http://www.example.com/static/scripts/application.bundle.js?v=42 "
+  "HTTP/1.1\r\n"
+  "Host: www.example.com\r\n"
+  "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 "
+  "Firefox/128.0\r\n"
+  "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8"
+  "\r\n"
+  "Accept-Language: en-US,en;q=0.5\r\n"
+  "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+  "Referer: http://www.example.com/articles/2026/10/some-long-article\r\n"
+  "Cookie: session=4f1c2a9e8b7d6c5e4f3a2b1c0d9e8f7a; theme=dark; "
+  "consent=analytics,ads\r\n"
+  "Upgrade-Insecure-Requests: 1\r\n"
+  "Sec-Fetch-Dest: script\r\n"
+  "Sec-Fetch-Mode: no-cors\r\n"
+  "Sec-Fetch-Site: same-origin\r\n"
+  "If-None-Match: \"5e1f-62a9c3b1d4e00\"\r\n"
+  "Priority: u=2\r\n"
+  "Proxy-Connection: keep-alive\r\n"
+  "\r\n";
+
+static const char *headEndScalar(const char *cur, const char *end) {
+  return findHeadEndScalar(cur, end);
+}
+
+#ifdef HTTP_SCAN_X86
+
+static const char *valueSse2(const char *cur, const char *end) {
+  return skipValueScalar(skipSse2(cur, end, 0x1f, '\t'), end);
+}
+
+static const char *tokenSse2(const char *cur, const char *end) {
+  return skipTokenScalar(skipTokenSse2(cur, end), end);
+}
+
+__attribute__((target("avx2")))
+static const char *valueAvx2(const char *cur, const char *end) {
+  return skipValueScalar(skipAvx2(cur, end, 0x1f, '\t'), end);
+}
+
+__attribute__((target("avx2")))
+static const char *tokenAvx2(const char *cur, const char *end) {
+  return skipTokenScalar(skipTokenAvx2(cur, end), end);
+}
+
+#endif
+
+static double nowSeconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double) now.tv_sec + (double) now.tv_nsec / 1e9;
+}
+
+/**
+ * the work of a request parser: the head end, then every header name up
+ * to its colon and every value up to its CR
+ * @return sum of the stop offsets, which the variants have to agree on
+ */
+static size_t scanHead(const ScanVariantT *variant) {
+  const char *end     = Head + sizeof(Head) - 1;
+  const char *headEnd = variant->headEnd(Head, end);
+  size_t      sum     = headEnd - Head;
+  const char *cur     = (const char *) memchr(Head, '\n', end - Head) + 1;
+  while (cur < headEnd) {
+    const char *nameEnd  = variant->token(cur, end);
+    const char *valueEnd = variant->value(nameEnd + 1, end);
+    sum += (nameEnd - Head) + (valueEnd - Head);
+    cur  = valueEnd + 2;
+  }
+  return sum;
+}
+
+int main(void) {
+  ScanVariantT variants[3] = {
+    {"scalar", headEndScalar, skipTokenScalar, skipValueScalar},
+  };
+  int variantsQ = 1;
+#ifdef HTTP_SCAN_X86
+  variants[variantsQ++] = (ScanVariantT) {
+    "sse2", findHeadEndSse2, tokenSse2, valueSse2
+  };
+  if (hasAvx2()) {
+    variants[variantsQ++] = (ScanVariantT) {
+      "avx2", findHeadEndAvx2, tokenAvx2, valueAvx2
+    };
+  }
+#endif
+
+  const size_t expected = scanHead(&variants[0]);
+  for (int i = 0; i < variantsQ; ++i) {
+    if (scanHead(&variants[i]) != expected) {
+      fprintf(stderr, "%s disagrees with scalar\n", variants[i].name);
+      return EXIT_FAILURE;
+    }
+    volatile size_t sink  = 0;
+    const double    start = nowSeconds();
+    for (int round = 0; round < BENCH_ROUNDS; ++round) {
+      sink += scanHead(&variants[i]);
+    }
+    const double elapsed = nowSeconds() - start;
+    printf("%-6s %7.1f ns per %zu byte head\n", variants[i].name,
+           elapsed * 1e9 / BENCH_ROUNDS, sizeof(Head) - 1);
+  }
+  return 0;
+}
@@ -0,0 +1,36 @@
+#include "../src/server/proxy.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FUZZ_MAX_RANGES 8
+
+/**
+ * The first bytes of the input are the representation length, the rest is
+ * the `Range` value
+ */
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  size_t length = 0;
+  if (size < sizeof(length)) return 0;
+  memcpy(&length, data, sizeof(length));
+  data += sizeof(length);
+  size -= sizeof(length);
+
+  char *input = malloc(size > 0 ? size : 1);
+  if (input == NULL) return 0;
+  memcpy(input, data, size);
+
+  const HttpSliceT value = {input, size};
+  HttpByteRangeT   ranges[FUZZ_MAX_RANGES];
+  const int        rangesQ = parseByteRanges(
+    &value, length, ranges, FUZZ_MAX_RANGES
+  );
+  assert(rangesQ == ERROR || (rangesQ >= 0 && rangesQ <= FUZZ_MAX_RANGES));
+  for (int i = 0; i < rangesQ; ++i) {
+    assert(ranges[i].first <= ranges[i].last && ranges[i].last < length);
+  }
+  free(input);
+  return 0;
+}
@@ -0,0 +1,38 @@
+#include "../src/server/proxy.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * Consumes the input as a chunked body at once and split in two, the
+ * decoder keeps its state across calls so both have to find the same end
+ */
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  static const char head[] = "HTTP/1.1 200 OK\r\n"
+                             "Transfer-Encoding: chunked\r\n\r\n";
+  const char *body = (const char *) data;
+
+  BodyFramingT whole;
+  BodyFramingT_init(&whole, head, sizeof(head) - 1, 200);
+  assert(whole.kind == BodyFramingChunked);
+  const ssize_t wholeLen = BodyFramingT_consume(&whole, body, size);
+  assert(wholeLen == ERROR || (size_t) wholeLen <= size);
+  assert(wholeLen == ERROR || whole.done || (size_t) wholeLen == size);
+
+  BodyFramingT parts;
+  BodyFramingT_init(&parts, head, sizeof(head) - 1, 200);
+  const size_t split    = size > 0 ? data[0] % (size + 1) : 0;
+  ssize_t      partsLen = BodyFramingT_consume(&parts, body, split);
+  if (partsLen != ERROR && !parts.done) {
+    const ssize_t rest = BodyFramingT_consume(
+      &parts, body + split, size - split
+    );
+    partsLen = rest == ERROR ? ERROR : partsLen + rest;
+  }
+  assert(partsLen == wholeLen);
+  if (parts.done) {
+    assert(BodyFramingT_consume(&parts, body, size) == 0);
+  }
+  return 0;
+}
@@ -0,0 +1,49 @@
+#include "../src/server/proxy.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Parses the input as a request head at once and in two parts, like it
+ * arrives from a socket, both have to agree
+ */
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  /*
+   * an exact copy lets the sanitizer catch reads past the input
+   */
+  char *input = malloc(size > 0 ? size : 1);
+  if (input == NULL) return 0;
+  memcpy(input, data, size);
+
+  HttpRequestT  whole;
+  size_t        scanned = 0;
+  const ssize_t headLen = HttpRequestT_parse(&whole, input, size, &scanned);
+  assert(scanned <= size);
+  assert(headLen == ERROR || headLen == HTTP_PARSE_INCOMPLETE
+         || (headLen > 0 && (size_t) headLen <= size));
+
+  HttpRequestT  parts;
+  size_t        partsScanned = 0;
+  const size_t  split        = size > 0 ? data[0] % (size + 1) : 0;
+  ssize_t       partsLen     = HttpRequestT_parse(
+    &parts, input, split, &partsScanned
+  );
+  if (partsLen == HTTP_PARSE_INCOMPLETE) {
+    partsLen = HttpRequestT_parse(&parts, input, size, &partsScanned);
+  }
+  assert(partsLen == headLen);
+
+  if (headLen > 0) {
+    assert(whole.headersQ <= HTTP_MAX_HEADERS);
+    for (size_t i = 0; i < whole.headersQ; ++i) {
+      const HttpHeaderT *header = &whole.headers[i];
+      assert(header->name.data >= input
+             && header->value.data + header->value.len <= input + headLen);
+    }
+    HttpRequestT_header(&whole, "Host");
+  }
+  free(input);
+  return 0;
+}
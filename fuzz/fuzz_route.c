@@ -0,0 +1,37 @@
+#include "../src/server/proxy.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Routes request heads which parse, the input is prefixed with a request
+ * line so the target and `Host` get most of the mutations
+ */
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  static const char method[] = "GET ";
+  char *input = malloc(sizeof(method) - 1 + size);
+  if (input == NULL) return 0;
+  memcpy(input, method, sizeof(method) - 1);
+  memcpy(input + sizeof(method) - 1, data, size);
+  size += sizeof(method) - 1;
+
+  HttpRequestT request;
+  size_t       scanned = 0;
+  if (HttpRequestT_parse(&request, input, size, &scanned) > 0) {
+    char host[HOST_MAX_LEN];
+    char path[PATH_MAX_LEN];
+    int  port = 0;
+    if (HttpRequestT_route(&request, host, &port, path) == SUCCESS) {
+      assert(strlen(host) > 0 && strlen(host) < HOST_MAX_LEN);
+      assert(strlen(path) < PATH_MAX_LEN);
+      assert(port > 0 && port <= 65535);
+    }
+    if (HttpRequestT_tunnelTarget(&request, host, &port) == SUCCESS) {
+      assert(strlen(host) > 0 && port > 0 && port <= 65535);
+    }
+  }
+  free(input);
+  return 0;
+}
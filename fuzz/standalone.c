@@ -0,0 +1,48 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/**
+ * Replays inputs through a libFuzzer style target without libFuzzer: every
+ * argument is a file, no arguments read one input from stdin, which is
+ * also how AFL runs a target
+ */
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+static int runFile(FILE *file) {
+  size_t   capacity = 4096;
+  size_t   size     = 0;
+  uint8_t *data     = malloc(capacity);
+  if (data == NULL) return 1;
+  size_t readed;
+  while ((readed = fread(data + size, 1, capacity - size, file)) > 0) {
+    size += readed;
+    if (size == capacity) {
+      capacity *= 2;
+      uint8_t *grown = realloc(data, capacity);
+      if (grown == NULL) {
+        free(data);
+        return 1;
+      }
+      data = grown;
+    }
+  }
+  LLVMFuzzerTestOneInput(data, size);
+  free(data);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) return runFile(stdin);
+  for (int i = 1; i < argc; ++i) {
+    FILE *file = fopen(argv[i], "rb");
+    if (file == NULL) {
+      perror(argv[i]);
+      return 1;
+    }
+    const int ret = runFile(file);
+    fclose(file);
+    if (ret != 0) return ret;
+  }
+  return 0;
+}
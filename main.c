@@ -1,23 +1,115 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "src/server/proxy.h"
 
 // #define ERROR -1;
 // #define SUCCESS 0
 
+static void printUsage(const char *name) {
+  fprintf(
+    stderr,
+    "Usage: %s <port> [-w workers] [-b backlog] [-r] [-a]"
+    " [-m bytes] [-o bytes] [-e lru|clock] [-t ms] [-u conns]"
+    " [-k requests] [-c ms]\n"
+    "  -w  number of event loop workers, default is online cpus count\n"
+    "  -b  listen backlog\n"
+    "  -r  per-worker SO_REUSEPORT listeners instead of a shared one\n"
+    "  -a  pin every worker to its own cpu\n"
+    "  -m  cache memory budget in bytes\n"
+    "  -o  max cached object size in bytes, bigger ones are not cached\n"
+    "  -e  eviction policy\n"
+    "  -t  ttl of responses without Cache-Control or Expires, in ms\n"
+    "  -u  idle keep-alive origin connections per host and worker,"
+    " 0 disables pooling\n"
+    "  -k  requests per client connection, 1 disables keep-alive\n"
+    "  -c  origin connect timeout in ms\n",
+    name
+  );
+}
+
 int main(int argc, char **argv) {
-  if (argc < 2) {
-    fprintf(stderr, "Usage: %s <port>\n", argv[0]);
+  ProxyConfigT config;
+  ProxyConfigT_init(&config);
+
+  int opt;
+  while ((opt = getopt(argc, argv, "w:b:ram:o:e:t:u:k:c:")) != -1) {
+    switch (opt) {
+      case 'w':
+        config.workersQ = atoi(optarg);
+        break;
+      case 'b':
+        config.backlog = atoi(optarg);
+        break;
+      case 'r':
+        config.reusePort = true;
+        break;
+      case 'a':
+        config.pinCpu = true;
+        break;
+      case 'm':
+        config.cache.sizeLimit = strtoull(optarg, NULL, 10);
+        break;
+      case 'o':
+        config.cache.objectSizeLimit = strtoull(optarg, NULL, 10);
+        break;
+      case 't':
+        config.cache.entryThreshold = strtod(optarg, NULL);
+        break;
+      case 'u':
+        config.upstreamMaxIdle = atoi(optarg);
+        break;
+      case 'k':
+        config.clientMaxRequests = atoi(optarg);
+        break;
+      case 'c':
+        config.connectTimeout = atol(optarg);
+        break;
+      case 'e':
+        if (strcmp(optarg, "lru") == 0) {
+          config.cache.policy = CachePolicyLru;
+        } else if (strcmp(optarg, "clock") == 0) {
+          config.cache.policy = CachePolicyClock;
+        } else {
+          printUsage(argv[0]);
+          return ERROR;
+        }
+        break;
+      default:
+        printUsage(argv[0]);
+        return ERROR;
+    }
+  }
+  if (optind >= argc) {
+    printUsage(argv[0]);
     return ERROR;
   }
 
-	const int port = atoi(argv[1]);
+  const int port = atoi(argv[optind]);
   if (port <= 0 || port > 65535) {
-    fprintf(stderr, "Invalid port number: %s\n", argv[1]);
+    fprintf(stderr, "Invalid port number: %s\n", argv[optind]);
+    return ERROR;
+  }
+  if (config.workersQ <= 0 || config.backlog <= 0) {
+    fprintf(stderr, "Workers count and backlog must be positive\n");
+    return ERROR;
+  }
+  if (config.clientMaxRequests <= 0) {
+    fprintf(stderr, "Requests per connection must be positive\n");
+    return ERROR;
+  }
+  if (config.connectTimeout <= 0) {
+    fprintf(stderr, "Connect timeout must be positive\n");
+    return ERROR;
+  }
+  if (config.upstreamMaxIdle < 0) {
+    fprintf(stderr, "Idle connections limit must not be negative\n");
     return ERROR;
   }
-  startServer(port);
+  config.port = port;
+  startServer(&config);
 
   return 0;
 }
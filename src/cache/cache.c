@@ -9,86 +9,396 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <bits/pthreadtypes.h>
 #include <sys/time.h>
 
 #define SUCCESS 0
 #define FAILURE -1
 
-static bool isCacheNodeValid(
-  const CacheManagerT *manager, CacheEntryT *entry, const struct timeval now
-) {
-  const long elapsedMs = (now.tv_sec - entry->lastUpdate.tv_sec) * 1000
-                         + (now.tv_usec - entry->lastUpdate.tv_usec) / 1000;
-  entry->lastUpdate.tv_sec = now.tv_sec;
-  return elapsedMs <= manager->entryThreshold;
+int64_t CacheT_nowMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-CacheManagerT *CacheManagerT_new() {
-  CacheManagerT *tmp = malloc(sizeof(*tmp));
-  if (tmp == NULL) {
-    return NULL;
-  }
+/**
+ * entries still being downloaded are fresh until their headers set
+ * `expiresAt`
+ */
+static bool isCacheEntryFresh(const CacheEntryT *entry, const int64_t nowMs) {
+  return entry->expiresAt == 0 || entry->expiresAt > nowMs;
+}
 
-  tmp->nodes = NULL;
-  pthread_mutexattr_t attr;
+static void initShardLock(CacheShardT *shard) {
+  pthread_rwlockattr_t attr;
 
-  int ret = pthread_mutexattr_init(&attr);
+  int ret = pthread_rwlockattr_init(&attr);
   if (ret != 0) {
     logFatal(
-      "[CacheT] pthread_mutexattr_init failed %s", strerror(errno)
+      "[CacheT] pthread_rwlockattr_init failed %s", strerror(ret)
     );
     abort();
   }
 
-  ret = pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ERRORCHECK);
+  ret = pthread_rwlockattr_setkind_np(
+    &attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP
+  );
   if (ret != 0) {
     logFatal(
-      "[CacheT] pthread_mutexattr_settype failed %s", strerror(errno)
+      "[CacheT] pthread_rwlockattr_setkind_np failed %s", strerror(ret)
     );
     abort();
   }
-  ret = pthread_mutex_init(&tmp->entriesMutex, &attr);
+  ret = pthread_rwlock_init(&shard->entriesLock, &attr);
   if (ret != 0) {
     logFatal(
-      "[CacheT] pthread_mutex_init failed %s", strerror(errno)
+      "[CacheT] pthread_rwlock_init failed %s", strerror(ret)
     );
     abort();
   }
+  pthread_rwlockattr_destroy(&attr);
+}
+
+CacheManagerT *CacheManagerT_new(const CacheConfigT *config) {
+  CacheManagerT *tmp = malloc(sizeof(*tmp));
+  if (tmp == NULL) {
+    return NULL;
+  }
+  tmp->entryThreshold  = config->entryThreshold;
+  tmp->sizeLimit       = config->sizeLimit;
+  tmp->objectSizeLimit = config->objectSizeLimit;
+  atomic_init(&tmp->usedSize, 0);
+
+  int initedQ = 0;
+  for (; initedQ < CACHE_SHARDS; ++initedQ) {
+    CacheShardT *shard = &tmp->shards[initedQ];
+    shard->sizeLimit   = config->sizeLimit / CACHE_SHARDS;
+    atomic_init(&shard->usedSize, 0);
+    if (CacheTableT_init(&shard->table, CACHE_TABLE_INITIAL_BUCKETS)
+        != SUCCESS) {
+      goto destroyShards;
+    }
+    shard->policy = CachePolicyT_new(config->policy);
+    if (shard->policy == NULL) {
+      CacheTableT_destroy(&shard->table);
+      goto destroyShards;
+    }
+    initShardLock(shard);
+  }
   return tmp;
+
+destroyShards:
+  while (initedQ-- > 0) {
+    CacheShardT *shard = &tmp->shards[initedQ];
+    shard->policy->destroy(shard->policy);
+    CacheTableT_destroy(&shard->table);
+    pthread_rwlock_destroy(&shard->entriesLock);
+  }
+  free(tmp);
+  return NULL;
 }
 
 /**
- * use under `CacheManagerT->entriesMutex`
+ * high bits of the hash, the low ones pick buckets of the shard table
+ */
+CacheShardT *CacheManagerT_shardOf(
+  CacheManagerT *cache, const uint64_t urlHash
+) {
+  return &cache->shards[(urlHash >> 32) % CACHE_SHARDS];
+}
+
+/**
+ * use under `CacheShardT->entriesLock` of the url shard
  * @param cache
  * @param url cache url
  * @return `CacheNodeT *` if contains else `null`
  */
 CacheNodeT *CacheManagerT_get_CacheNodeT(
-  const CacheManagerT *cache, const char *url
+  CacheManagerT *cache, const char *url
 ) {
-  for (
-    CacheNodeT *node = cache->nodes;
-    node != NULL;
-    node = node->next
-  ) {
-    if (strcmp(node->entry->url, url) == 0) {
-      return node;
-    }
-  }
-  return NULL;
+  const uint64_t hash = CacheT_hashUrl(url);
+  return CacheTableT_find(
+    &CacheManagerT_shardOf(cache, hash)->table, hash, url
+  );
+}
+
+/**
+ * brings the charge of @code entry to its node, url and chunk capacity
+ */
+static void charge(
+  CacheManagerT *cache, CacheShardT *shard, CacheEntryT *entry
+) {
+  const size_t size  = sizeof(*entry) + sizeof(CacheNodeT)
+                       + strlen(entry->url) + entry->storedSize;
+  const size_t bytes = size - entry->chargedSize;
+  entry->chargedSize = size;
+  atomic_fetch_add(&shard->usedSize, bytes);
+  atomic_fetch_add(&cache->usedSize, bytes);
 }
 
+/**
+ * use under write locked `CacheShardT->entriesLock` of the entry shard
+ */
 void CacheManagerT_put_CacheNodeT(CacheManagerT *cache, CacheNodeT *node) {
   if (node == NULL) return;
+  CacheEntryT *entry = node->entry;
+  CacheShardT *shard = CacheManagerT_shardOf(cache, entry->urlHash);
+  CacheTableT_insert(&shard->table, node);
+  shard->policy->onInsert(shard->policy, node);
+
+  entry->chargedSize = 0;
+  charge(cache, shard, entry);
+}
+
+/**
+ * Unlinks @code node, which is already removed from the table, from the
+ * policy and the budget and drops the index reference. Readers streaming
+ * the entry keep it alive, the last of them frees it. Use under write
+ * locked `CacheShardT->entriesLock`
+ * @return `true` if the entry has no users, caller has to delete it
+ */
+static bool detachNode(
+  CacheManagerT *cache, CacheShardT *shard, CacheNodeT *node
+) {
+  CacheEntryT *entry = node->entry;
+  shard->policy->onRemove(shard->policy, node);
+  atomic_fetch_sub(&shard->usedSize, entry->chargedSize);
+  atomic_fetch_sub(&cache->usedSize, entry->chargedSize);
+  entry->chargedSize = 0;
+  atomic_store(&entry->inCache, false);
+  CacheNodeT_delete(node);
+  return CacheEntryT_release(entry);
+}
+
+static bool isOverLimit(const CacheManagerT *cache, CacheShardT *shard) {
+  return atomic_load(&cache->usedSize) > cache->sizeLimit
+         && atomic_load(&shard->usedSize) > shard->sizeLimit;
+}
+
+/**
+ * evicts unused entries of @code shard while the cache exceeds the budget
+ * and the shard its share
+ * @return number of evicted entries
+ */
+static size_t evictShard(CacheManagerT *cache, CacheShardT *shard) {
+  if (!isOverLimit(cache, shard)) return 0;
+
+  int ret = pthread_rwlock_wrlock(&shard->entriesLock);
+  CHECK_RET("pthread_rwlock_wrlock", ret);
+
+  size_t evictedQ = 0;
+  while (isOverLimit(cache, shard)) {
+    CacheNodeT *node = shard->policy->victim(shard->policy);
+    if (node == NULL) break;
+
+    CacheEntryT *entry = node->entry;
+    CacheTableT_remove(&shard->table, entry);
+    if (detachNode(cache, shard, node)) {
+      CacheEntryT_delete(entry);
+    }
+    ++evictedQ;
+  }
+
+  ret = pthread_rwlock_unlock(&shard->entriesLock);
+  CHECK_RET("pthread_rwlock_unlock", ret);
+  return evictedQ;
+}
+
+/**
+ * Evicts while the budget is exceeded, starting with @code shard. Shares
+ * sum up to the budget, so some shard is over its share until the budget
+ * is met, only such shards lose entries
+ */
+static void evictIfNeeded(CacheManagerT *cache, const CacheShardT *shard) {
+  if (atomic_load(&cache->usedSize) <= cache->sizeLimit) return;
+
+  const size_t first    = shard - cache->shards;
+  size_t       evictedQ = 0;
+  for (size_t i = 0; i < CACHE_SHARDS
+                     && atomic_load(&cache->usedSize) > cache->sizeLimit;
+       ++i) {
+    evictedQ += evictShard(cache, &cache->shards[(first + i) % CACHE_SHARDS]);
+  }
+  if (evictedQ > 0) {
+    logDebug("%s:%d evicted %zu entries, %zu bytes used",
+             __FILE__, __LINE__, evictedQ, atomic_load(&cache->usedSize));
+  }
+}
+
+/**
+ * a stale entry is served while its background refresh runs
+ */
+static bool isServable(const CacheEntryT *entry, const int64_t nowMs) {
+  return isCacheEntryFresh(entry, nowMs)
+         || (atomic_load(&entry->revalidating)
+             && CacheEntryT_canServeWhileRevalidating(entry, nowMs));
+}
+
+CacheEntryT *CacheManagerT_getOrCreate_CacheEntryT(
+  CacheManagerT *cache, const char *url, bool *created, CacheEntryT **refresh
+) {
+  const uint64_t hash  = CacheT_hashUrl(url);
+  CacheShardT *  shard = CacheManagerT_shardOf(cache, hash);
+  *created             = false;
+  *refresh             = NULL;
 
-  if (cache->nodes == NULL) {
-    cache->nodes    = node;
-    cache->lastNode = node;
+  CacheEntryT *entry = NULL;
+  int          ret   = pthread_rwlock_rdlock(&shard->entriesLock);
+  CHECK_RET("pthread_rwlock_rdlock", ret);
+  CacheNodeT *node = CacheTableT_find(&shard->table, hash, url);
+  if (node != NULL && isServable(node->entry, CacheT_nowMs())) {
+    entry = node->entry;
+    CacheEntryT_acquire(entry);
+    shard->policy->onAccess(shard->policy, node);
+  }
+  ret = pthread_rwlock_unlock(&shard->entriesLock);
+  CHECK_RET("pthread_rwlock_unlock", ret);
+  if (entry != NULL) {
+    return entry;
+  }
+
+  CacheNodeT * newNode  = CacheNodeT_new();
+  CacheEntryT *newEntry = CacheEntryT_new_withUrl(url);
+  if (newNode == NULL || newEntry == NULL) {
+    logError("%s:%d placeholder allocation %s",
+             __FILE__, __LINE__, strerror(errno));
+    CacheNodeT_delete(newNode);
+    CacheEntryT_delete(newEntry);
+    return NULL;
+  }
+
+  ret = pthread_rwlock_wrlock(&shard->entriesLock);
+  CHECK_RET("pthread_rwlock_wrlock", ret);
+  const int64_t now = CacheT_nowMs();
+  node = CacheTableT_find(&shard->table, hash, url);
+  if (node != NULL && !isServable(node->entry, now)) {
+    CacheEntryT *stale = node->entry;
+    if (CacheEntryT_canRevalidate(stale, now)
+        && CacheEntryT_canServeWhileRevalidating(stale, now)) {
+      /*
+       * the stale entry stays cached, the refresh replaces it later
+       */
+      atomic_store(&stale->revalidating, true);
+      CacheEntryT_acquire(stale);
+      atomic_store(&newEntry->usersQ, 1);
+      newEntry->revalidates = stale;
+      *refresh              = newEntry;
+      newEntry              = NULL;
+    } else {
+      CacheTableT_remove(&shard->table, stale);
+      if (CacheEntryT_canRevalidate(stale, now)) {
+        CacheEntryT_acquire(stale);
+        newEntry->revalidates = stale;
+      }
+      if (detachNode(cache, shard, node)) {
+        CacheEntryT_delete(stale);
+      }
+      node = NULL;
+    }
+  }
+  if (node != NULL) {
+    entry = node->entry;
+    CacheEntryT_acquire(entry);
+    shard->policy->onAccess(shard->policy, node);
   } else {
-    cache->lastNode->next = node;
-    cache->lastNode       = node;
+    /*
+     * referenced by the index and the caller
+     */
+    newNode->entry = newEntry;
+    atomic_store(&newEntry->inCache, true);
+    atomic_store(&newEntry->usersQ, 2);
+    CacheManagerT_put_CacheNodeT(cache, newNode);
+    entry    = newEntry;
+    newNode  = NULL;
+    newEntry = NULL;
+    *created = true;
+  }
+  ret = pthread_rwlock_unlock(&shard->entriesLock);
+  CHECK_RET("pthread_rwlock_unlock", ret);
+
+  CacheNodeT_delete(newNode);
+  CacheEntryT_delete(newEntry);
+  if (*created) {
+    evictIfNeeded(cache, shard);
+  }
+  return entry;
+}
+
+void CacheManagerT_remove_CacheEntryT(
+  CacheManagerT *cache, CacheEntryT *entry
+) {
+  CacheShardT *shard = CacheManagerT_shardOf(cache, entry->urlHash);
+  int          ret   = pthread_rwlock_wrlock(&shard->entriesLock);
+  CHECK_RET("pthread_rwlock_wrlock", ret);
+
+  CacheNodeT *node = CacheTableT_remove(&shard->table, entry);
+  if (node != NULL && detachNode(cache, shard, node)) {
+    CacheEntryT_delete(entry);
+  }
+
+  ret = pthread_rwlock_unlock(&shard->entriesLock);
+  CHECK_RET("pthread_rwlock_unlock", ret);
+}
+
+void CacheManagerT_replace_CacheEntryT(
+  CacheManagerT *cache, CacheEntryT *old, CacheEntryT *entry
+) {
+  CacheShardT *shard   = CacheManagerT_shardOf(cache, old->urlHash);
+  CacheNodeT * newNode = CacheNodeT_new();
+  if (newNode == NULL) {
+    CacheManagerT_remove_CacheEntryT(cache, old);
+    return;
   }
+  int ret = pthread_rwlock_wrlock(&shard->entriesLock);
+  CHECK_RET("pthread_rwlock_wrlock", ret);
+
+  CacheNodeT *node = CacheTableT_remove(&shard->table, old);
+  if (node != NULL) {
+    /*
+     * the caller holds both entries, detaching never frees @code old
+     */
+    detachNode(cache, shard, node);
+    CacheEntryT_acquire(entry);
+    atomic_store(&entry->inCache, true);
+    newNode->entry = entry;
+    CacheManagerT_put_CacheNodeT(cache, newNode);
+    newNode = NULL;
+  }
+
+  ret = pthread_rwlock_unlock(&shard->entriesLock);
+  CHECK_RET("pthread_rwlock_unlock", ret);
+  CacheNodeT_delete(newNode);
+  evictIfNeeded(cache, shard);
+}
+
+void CacheManagerT_account_CacheEntryT(
+  CacheManagerT *cache, CacheEntryT *entry
+) {
+  CacheShardT *shard = CacheManagerT_shardOf(cache, entry->urlHash);
+  int          ret   = pthread_rwlock_rdlock(&shard->entriesLock);
+  CHECK_RET("pthread_rwlock_rdlock", ret);
+
+  /*
+   * only the uploader of the entry changes its charge under read lock,
+   * removal under write lock can not interleave
+   */
+  const bool inCache = atomic_load(&entry->inCache);
+  if (inCache) {
+    charge(cache, shard, entry);
+  }
+
+  ret = pthread_rwlock_unlock(&shard->entriesLock);
+  CHECK_RET("pthread_rwlock_unlock", ret);
+  if (!inCache) return;
+
+  if (atomic_load(&entry->downloadedSize) > cache->objectSizeLimit) {
+    logInfo("%s:%d %s exceeds %zu bytes, streaming it without caching",
+            __FILE__, __LINE__, entry->url, cache->objectSizeLimit);
+    CacheManagerT_remove_CacheEntryT(cache, entry);
+    return;
+  }
+  evictIfNeeded(cache, shard);
 }
 
 void CacheEntryT_append_CacheEntryChunkT(
@@ -96,46 +406,63 @@ void CacheEntryT_append_CacheEntryChunkT(
 ) {
   if (chunk == NULL) return;
 
-  if (entry->dataChunks == NULL) {
-    entry->lastChunk  = chunk;
-    entry->dataChunks = chunk;
+  /*
+   * linked with release, so a reader following the link sees the chunk
+   * initialized
+   */
+  entry->storedSize += chunk->maxDataSize;
+  if (entry->lastChunk == NULL) {
+    entry->lastChunk = chunk;
+    atomic_store_explicit(&entry->dataChunks, chunk, memory_order_release);
     return;
   }
 
-  entry->lastChunk->next = chunk;
-  entry->lastChunk       = chunk;
-  entry->downloadedSize += chunk->maxDataSize;
+  atomic_store_explicit(&entry->lastChunk->next, chunk, memory_order_release);
+  entry->lastChunk = chunk;
   gettimeofday(&entry->lastUpdate, NULL);
 }
 
-void CacheManagerT_checkAndRemoveExpired_CacheNodeT(CacheManagerT *manager) {
-  int ret = pthread_mutex_lock(&manager->entriesMutex);
-  CHECK_RET("pthread_mutex_lock", ret);
-
-  struct timeval checkStart;
-  gettimeofday(&checkStart, NULL);
+size_t CacheManagerT_checkAndRemoveExpired_CacheNodeT(
+  CacheManagerT *manager, CacheShardT *shard, size_t *cursor,
+  const size_t   bucketsBatch
+) {
+  int ret = pthread_rwlock_wrlock(&shard->entriesLock);
+  CHECK_RET("pthread_rwlock_wrlock", ret);
 
-  for (CacheNodeT **current = &manager->nodes; (*current) != NULL;) {
-    CacheNodeT *node = *current;
-    ret              = pthread_mutex_trylock(&node->entry->dataMutex);
-    if (ret == EBUSY) continue;
-    CHECK_RET("pthread_mutex_trylock", ret);
+  const int64_t now     = CacheT_nowMs();
+  CacheTableT * table   = &shard->table;
+  size_t        removed = 0;
+  /*
+   * the batch walks the current buckets only, a resize in progress moves
+   * on with it so every node gets there within a sweep and a half
+   */
+  CacheTableT_migrate(table, bucketsBatch);
+  size_t        end     = *cursor + bucketsBatch;
+  if (end > table->bucketsQ) {
+    end = table->bucketsQ;
+  }
 
-    if (
-      !isCacheNodeValid(manager, node->entry, checkStart)
-      && node->entry->usersQ == 0
-    ) {
-      *current = node->next;
-      CacheNodeT_delete(node);
-    } else {
-      current = &node->next;
+  for (size_t i = *cursor; i < end; ++i) {
+    for (CacheNodeT **current = &table->buckets[i]; (*current) != NULL;) {
+      CacheNodeT * node  = *current;
+      CacheEntryT *entry = node->entry;
+      if (isCacheEntryFresh(entry, now)
+          || CacheEntryT_canRevalidate(entry, now)) {
+        current = &node->next;
+        continue;
+      }
+      CacheTableT_unlink(table, current);
+      if (detachNode(manager, shard, node)) {
+        CacheEntryT_delete(entry);
+      }
+      ++removed;
     }
-    ret = pthread_mutex_unlock(&node->entry->dataMutex);
-    CHECK_RET("pthread_mutex_unlock", ret);
   }
+  *cursor = end < table->bucketsQ ? end : 0;
 
-  ret = pthread_mutex_unlock(&manager->entriesMutex);
-  CHECK_RET("pthread_mutex_unlock", ret);
+  ret = pthread_rwlock_unlock(&shard->entriesLock);
+  CHECK_RET("pthread_rwlock_unlock", ret);
+  return removed;
 }
 
 CacheEntryT *CacheEntryT_new_withUrl(const char *url) {
@@ -146,7 +473,8 @@ CacheEntryT *CacheEntryT_new_withUrl(const char *url) {
     );
     return NULL;
   }
-  entry->url = strdup(url);
+  entry->url     = strdup(url);
+  entry->urlHash = CacheT_hashUrl(url);
   if (entry->url == NULL) {
     logError(
       "[handleConnection] strdup failed : %s", strerror(errno)
@@ -2,19 +2,68 @@
 #define CACHE_H
 
 #include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
 
-#define CHECK_RET(description, ret) \
-  do { \
-    if (ret != 0) { \
-      logFatal( "%s:%d %s : %s", __FILE__, __LINE__, description, strerror(ret)); \
-      abort(); \
-    } \
-  } while (0)
+/**
+ * independently locked parts of the cache, selected by the high bits of
+ * the url hash
+ */
+#define CACHE_SHARDS                16
+#define CACHE_TABLE_INITIAL_BUCKETS 128
+/**
+ * buckets moved from the old array on every insert/remove during resize
+ */
+#define CACHE_TABLE_MIGRATE_STEP    8
+/**
+ * expired entries are swept in batches of buckets, so the index write lock
+ * is never held for a whole table walk
+ */
+#define CACHE_JANITOR_INTERVAL_MS   1000
+#define CACHE_JANITOR_BUCKETS_BATCH 256
+/**
+ * chunk size classes of the memfd backed store grow 4 times from 4 KiB up
+ * to 1 MiB, every class maps segments of the same size
+ */
+#define CACHE_CHUNK_MIN_SIZE        4096
+#define CACHE_STORE_CLASSES         5
+#define CACHE_STORE_SEGMENT_SIZE    (16 * 1048576)
+/**
+ * without a known response size every next chunk of an entry is this
+ * many times bigger than the previous one
+ */
+#define CACHE_CHUNK_GROWTH          4
+/**
+ * committed bytes between wakeups of entry readers while the upload runs
+ * without pauses
+ */
+#define CACHE_NOTIFY_BYTES          (64 * 1024)
+/**
+ * an entry out of the index stops taking data from origin while its
+ * slowest reader is this far behind, more than the biggest chunk so a
+ * reader waiting for data never stops the upload
+ */
+#define CACHE_STREAM_WINDOW         (8 * 1048576)
+/**
+ * stale entries with validators stay in the index at least this long
+ * after they expire, so the next request revalidates them instead of
+ * refetching
+ */
+#define CACHE_STALE_RETENTION_MS    (60 * 60 * 1000)
 
 typedef struct CacheEntry      CacheEntryT;
 typedef struct CacheNode       CacheNodeT;
 typedef struct CacheManager    CacheManagerT;
+typedef struct CacheShard      CacheShardT;
+typedef struct CacheTable      CacheTableT;
 typedef struct CacheEntryChunk CacheEntryChunkT;
+typedef struct CacheEntryWaiter CacheEntryWaiterT;
+typedef struct CacheEntryReader CacheEntryReaderT;
+typedef struct CachePolicy     CachePolicyT;
+typedef struct CacheConfig     CacheConfigT;
+typedef struct CacheStoreStats CacheStoreStatsT;
 
 typedef enum CacheStatus {
   InProcess,
@@ -22,37 +71,278 @@ typedef enum CacheStatus {
   Failed,
 } CacheStatusT;
 
+typedef enum BodyFramingKind {
+  BodyFramingLength,
+  BodyFramingChunked,
+  /**
+   * body ends when origin closes the connection
+   */
+  BodyFramingClose,
+} BodyFramingKindT;
+
+typedef enum CachePolicyKind {
+  CachePolicyLru,
+  CachePolicyClock,
+} CachePolicyKindT;
+
+struct CacheConfig {
+  /**
+   * total bytes charged to cached entries before eviction starts
+   */
+  size_t           sizeLimit;
+  /**
+   * bigger responses are streamed to their readers without caching
+   */
+  size_t           objectSizeLimit;
+  CachePolicyKindT policy;
+  /**
+   * ttl in ms of responses without freshness information
+   */
+  double           entryThreshold;
+};
+
+/**
+ * Subscriber which is notified once when `CACHE_NOTIFY_BYTES` more are
+ * committed, the upload pauses or the status changes. @code notify is
+ * called under `CacheEntryT->dataMutex` and must not block
+ */
+struct CacheEntryWaiter {
+  void (*notify)(CacheEntryWaiterT *waiter);
+  CacheEntryWaiterT *next;
+  bool               subscribed;
+};
+
+/**
+ * Position of a client streaming an entry: chunks before
+ * @code keepOffset are passed and never read again
+ */
+struct CacheEntryReader {
+  atomic_size_t      keepOffset;
+  CacheEntryReaderT *next;
+};
+
+/**
+ * Data is published without locks by the only writer, the uploader: bytes
+ * are copied first, then chunk `curDataSize`, `next` and
+ * @code downloadedSize are stored with release semantics, so a reader
+ * which acquires them sees the bytes. A reader loads @code status before
+ * the sizes, then a final status guarantees it sees all data.
+ * `dataMutex` guards only waiters and readers.
+ * Once the entry leaves the index nobody new reads it from the start, so
+ * the uploader frees chunks which every reader has passed. The first
+ * chunk, holding the head, always stays
+ */
 struct CacheEntry {
-  char *                              url;
-  struct timeval                      lastUpdate;
-  volatile CacheEntryChunkT *volatile dataChunks;
-  volatile CacheEntryChunkT *volatile lastChunk;
-  volatile size_t                     downloadedSize;
-  volatile CacheStatusT               status;
-  volatile int                        usersQ;
-  volatile int                        httpStatusCode;
-  pthread_mutex_t                     dataMutex;
-  pthread_cond_t                      dataCond;
+  char *                      url;
+  uint64_t                    urlHash;
+  struct timeval              lastUpdate;
+  /**
+   * wall clock ms after which the entry is stale, `0` until the response
+   * head is parsed
+   */
+  _Atomic int64_t             expiresAt;
+  _Atomic(CacheEntryChunkT *) dataChunks;
+  /**
+   * used by the writer only
+   */
+  CacheEntryChunkT *          lastChunk;
+  /**
+   * committed bytes
+   */
+  atomic_size_t               downloadedSize;
+  /**
+   * committed bytes readers were last notified about, writer only
+   */
+  size_t                      notifiedSize;
+  /**
+   * length of the stored response head including the empty line, the
+   * body starts right after it. Set before the first append, `0` if the
+   * head was not recognized
+   */
+  size_t                      headLen;
+  /**
+   * how the stored body is delimited, set with @code headLen
+   */
+  BodyFramingKindT            bodyFraming;
+  /**
+   * stored body bytes including chunked encoding, set before the status
+   * becomes `Success`
+   */
+  size_t                      bodyLen;
+  /**
+   * head and body length announced by `Content-Length`, `0` if unknown,
+   * sizes chunks to the response
+   */
+  size_t                      expectedSize;
+  /**
+   * capacity of the appended chunks, a slot takes its whole class whatever
+   * is written to it, writer only
+   */
+  size_t                      storedSize;
+  /**
+   * bytes accounted in `CacheShardT->usedSize`, changed under
+   * `CacheShardT->entriesLock`
+   */
+  size_t                      chargedSize;
+  _Atomic CacheStatusT        status;
+  /**
+   * references of users plus one of the cache index while
+   * @code inCache is set, the one dropping the last frees the entry
+   */
+  atomic_int                  usersQ;
+  /**
+   * set before the first append like @code headLen
+   */
+  int                         httpStatusCode;
+  atomic_bool                 inCache;
+  /**
+   * response turned out to be not cacheable, only the client which started
+   * the upload may read it, others have to fetch it themselves
+   */
+  atomic_bool                 notCacheable;
+  /**
+   * validators of a stored `200` response, set with @code headLen, `NULL`
+   * if origin sent none
+   */
+  char *                      etag;
+  char *                      lastModified;
+  /**
+   * `stale-while-revalidate` and `stale-if-error` windows after
+   * @code expiresAt in ms, set with @code headLen
+   */
+  int64_t                     staleWhileRevalidate;
+  int64_t                     staleIfError;
+  /**
+   * stale entry this one revalidates with a conditional request, holds a
+   * reference. Set at creation, dropped by the uploader once the origin
+   * sent a new response
+   */
+  CacheEntryT *               revalidates;
+  /**
+   * readers move to @code revalidates, which origin confirmed or failed to
+   * replace within its `stale-if-error` window. Set before the final
+   * status
+   */
+  atomic_bool                 servesStale;
+  /**
+   * a refresh of this stale entry runs in the background while it is
+   * served, cleared once the refresh is over
+   */
+  atomic_bool                 revalidating;
+  CacheEntryWaiterT *         waiters;
+  /**
+   * clients streaming the entry, users which are not among them keep the
+   * chunks from being freed
+   */
+  CacheEntryReaderT *         readers;
+  int                         readersQ;
+  /**
+   * the uploader paused by `CacheEntryT_throttle`, notified when a reader
+   * advances or leaves
+   */
+  CacheEntryWaiterT *         producer;
+  /**
+   * bytes of freed chunks, writer only
+   */
+  size_t                      trimmedSize;
+  pthread_mutex_t             dataMutex;
 };
 
+/**
+ * Chunks up to `kDefCacheChunkSize` live in mapped memfd slots, @code fd
+ * and @code offset locate @code data in the file. Heap ones have
+ * `fd == -1`
+ */
 struct CacheEntryChunk {
-  size_t                     curDataSize;
-  size_t                     maxDataSize;
-  volatile CacheEntryChunkT *next;
-  char *                     data;
+  atomic_size_t               curDataSize;
+  size_t                      maxDataSize;
+  _Atomic(CacheEntryChunkT *) next;
+  char *                      data;
+  int                         fd;
+  off_t                       offset;
+};
+
+/**
+ * Occupancy of the chunk store, @code usedBytes above the bytes charged
+ * to the cache are held by entries streamed past it
+ */
+struct CacheStoreStats {
+  size_t classSize[CACHE_STORE_CLASSES];
+  size_t slotsQ[CACHE_STORE_CLASSES];
+  size_t usedSlotsQ[CACHE_STORE_CLASSES];
+  size_t mappedBytes;
+  size_t usedBytes;
+  size_t heapBytes;
 };
 
 struct CacheNode {
   CacheEntryT *     entry;
   struct CacheNode *next;
+  /**
+   * eviction order, owned by `CachePolicyT`
+   */
+  struct CacheNode *policyPrev;
+  struct CacheNode *policyNext;
+  atomic_bool       referenced;
+};
+
+/**
+ * Eviction policy over the nodes of one `CacheShardT`. @code onAccess
+ * runs under read locked `entriesLock`, everything else under write lock.
+ * @code victim returns a node whose entry is referenced only by the index
+ * or `NULL`
+ */
+struct CachePolicy {
+  void (*onInsert)(CachePolicyT *policy, CacheNodeT *node);
+  void (*onAccess)(CachePolicyT *policy, CacheNodeT *node);
+  void (*onRemove)(CachePolicyT *policy, CacheNodeT *node);
+  CacheNodeT *(*victim)(CachePolicyT *policy);
+  void (*destroy)(CachePolicyT *policy);
+};
+
+/**
+ * Chained hash index of `CacheNodeT` by `CacheEntryT->urlHash`. Grows
+ * incrementally: while @code oldBuckets is set, buckets below
+ * @code migratedQ are already moved to @code buckets
+ */
+struct CacheTable {
+  CacheNodeT **buckets;
+  size_t       bucketsQ;
+  CacheNodeT **oldBuckets;
+  size_t       oldBucketsQ;
+  size_t       migratedQ;
+  size_t       size;
+};
+
+/**
+ * Part of the cache with own index, eviction order and an equal share of
+ * the byte budget in @code sizeLimit
+ */
+struct CacheShard {
+  /**
+   * read locked for lookups, write locked for index modifications
+   */
+  pthread_rwlock_t entriesLock;
+  CacheTableT      table;
+  CachePolicyT *   policy;
+  size_t           sizeLimit;
+  atomic_size_t    usedSize;
 };
 
 struct CacheManager {
   double entryThreshold;
+  size_t sizeLimit;
+  size_t objectSizeLimit;
+
+  CacheShardT   shards[CACHE_SHARDS];
+  /**
+   * sum of shard `usedSize`, eviction starts when it exceeds
+   * @code sizeLimit
+   */
+  atomic_size_t usedSize;
 
-  pthread_mutex_t entriesMutex;
-  CacheNodeT *    nodes;
-  CacheNodeT *    lastNode;
+  pthread_t     janitor;
+  volatile bool janitorStopped;
 };
 
 
@@ -62,38 +352,239 @@ void CacheNodeT_delete(CacheNodeT *node);
 
 CacheEntryT *CacheEntryT_new();
 
+/**
+ * adds a reference, the caller must already hold one or find the entry in
+ * the locked cache index
+ */
 void CacheEntryT_acquire(CacheEntryT *entry);
 
 void CacheEntryT_delete(CacheEntryT *entry);
 
-void CacheEntryT_release(CacheEntryT *entry);
+/**
+ * drops a reference without locking
+ * @return `true` if it was the last one, caller has to delete the entry
+ */
+bool CacheEntryT_release(CacheEntryT *entry);
+
+/**
+ * Subscribes @code waiter unless the entry moved on since the reader saw
+ * @code seenSize committed bytes and @code seenStatus
+ * @return `false` if there is something new to read right away
+ */
+bool CacheEntryT_subscribe(
+  CacheEntryT *      entry,
+  CacheEntryWaiterT *waiter,
+  size_t             seenSize,
+  CacheStatusT       seenStatus
+);
+
+void CacheEntryT_unsubscribe(CacheEntryT *entry, CacheEntryWaiterT *waiter);
+
+/**
+ * registers a client which reads @code entry from its first chunk, a
+ * user holding the entry has to attach before it reads
+ */
+void CacheEntryT_attach(CacheEntryT *entry, CacheEntryReaderT *reader);
+
+void CacheEntryT_detach(CacheEntryT *entry, CacheEntryReaderT *reader);
+
+/**
+ * publishes that @code reader moved to the chunk starting at
+ * @code keepOffset and reads nothing before it anymore
+ */
+void CacheEntryT_advance(
+  CacheEntryT *entry, CacheEntryReaderT *reader, size_t keepOffset
+);
+
+/**
+ * Subscribes @code producer when the entry is out of the index and its
+ * slowest reader lags more than `CACHE_STREAM_WINDOW` behind
+ * @return `true` if the writer has to wait for the notification
+ */
+bool CacheEntryT_throttle(CacheEntryT *entry, CacheEntryWaiterT *producer);
+
+void CacheEntryT_unthrottle(CacheEntryT *entry, CacheEntryWaiterT *producer);
 
 void CacheEntryT_updateStatus(CacheEntryT *entry,
                               CacheStatusT status);
 
+void CacheEntryT_markNotCacheable(CacheEntryT *entry);
+
+/**
+ * @return `true` if stale @code entry is a complete `200` response which
+ * is still worth keeping at @code nowMs: a conditional request can refresh
+ * it or one of its stale windows is open
+ */
+bool CacheEntryT_canRevalidate(const CacheEntryT *entry, int64_t nowMs);
+
+/**
+ * @return `true` if stale @code entry may be served while a refresh runs
+ */
+bool CacheEntryT_canServeWhileRevalidating(
+  const CacheEntryT *entry, int64_t nowMs
+);
+
+/**
+ * @return `true` if stale @code entry may be served instead of an origin
+ * failure
+ */
+bool CacheEntryT_canServeOnError(const CacheEntryT *entry, int64_t nowMs);
+
 void CacheEntryChunkT_delete(CacheEntryChunkT *chunk);
 
+/**
+ * @return chunk from the smallest store class fitting @code dataSize, its
+ * `maxDataSize` may be bigger, or a heap one
+ */
 CacheEntryChunkT *CacheEntryChunkT_new(size_t dataSize);
 
+void CacheStoreT_stats(CacheStoreStatsT *stats);
+
+/**
+ * Sends @code size bytes of @code chunk data from @code offset to socket
+ * @code fd, with `sendfile` for memfd backed chunks
+ * @return result of `send`/`sendfile`
+ */
+ssize_t CacheEntryChunkT_send(
+  const CacheEntryChunkT *chunk, int fd, size_t offset, size_t size
+);
+
 void CacheEntryT_append_CacheEntryChunkT(
   CacheEntryT *entry, CacheEntryChunkT *chunk
 );
 
 
-CacheManagerT *CacheManagerT_new();
+uint64_t CacheT_hashUrl(const char *url);
+
+/**
+ * @return `CLOCK_REALTIME` in ms, the clock of `CacheEntryT->expiresAt`
+ */
+int64_t CacheT_nowMs();
+
+int CacheTableT_init(CacheTableT *table, size_t bucketsQ);
+
+void CacheTableT_destroy(CacheTableT *table);
+
+CacheNodeT *CacheTableT_find(
+  const CacheTableT *table, uint64_t hash, const char *url
+);
+
+void CacheTableT_insert(CacheTableT *table, CacheNodeT *node);
+
+/**
+ * @return unlinked node of @code entry or `NULL`
+ */
+CacheNodeT *CacheTableT_remove(CacheTableT *table, const CacheEntryT *entry);
+
+/**
+ * unlinks the node @code link of a bucket chain points to
+ * @return the unlinked node
+ */
+CacheNodeT *CacheTableT_unlink(CacheTableT *table, CacheNodeT **link);
+
+/**
+ * moves up to @code steps buckets of a resize in progress, walks over
+ * @code buckets do not see nodes still in @code oldBuckets
+ */
+void CacheTableT_migrate(CacheTableT *table, size_t steps);
+
+void CacheTableT_finishResize(CacheTableT *table);
+
+CachePolicyT *CachePolicyT_new(CachePolicyKindT kind);
+
+CacheManagerT *CacheManagerT_new(const CacheConfigT *config);
+
+/**
+ * Charges chunks appended to @code entry since the last call to the cache
+ * budget by their capacity. Drops the entry from the cache when it
+ * outgrows `objectSizeLimit` and evicts unused entries while the budget
+ * is exceeded
+ */
+void CacheManagerT_account_CacheEntryT(
+  CacheManagerT *cache, CacheEntryT *entry
+);
+
+CacheShardT *CacheManagerT_shardOf(CacheManagerT *cache, uint64_t urlHash);
 
 void CacheManagerT_put_CacheNodeT(CacheManagerT *cache, CacheNodeT *node);
 
 CacheNodeT *CacheManagerT_get_CacheNodeT(
-  const CacheManagerT *cache, const char *url
+  CacheManagerT *cache, const char *url
+);
+
+/**
+ * Looks @code url up and acquires the entry. On miss publishes an empty
+ * `InProcess` placeholder, so concurrent requests attach to it while the
+ * caller (@code *created is set) fetches the data outside of the lock.
+ * A stale entry which `CacheEntryT_canRevalidate` is not dropped but
+ * becomes `revalidates` of the placeholder. Within its
+ * `stale-while-revalidate` window the stale entry itself is returned, the
+ * first such caller gets in @code refresh an acquired private placeholder
+ * to fill in the background
+ * @return acquired entry or `NULL` on allocation failure
+ */
+CacheEntryT *CacheManagerT_getOrCreate_CacheEntryT(
+  CacheManagerT *cache, const char *url, bool *created, CacheEntryT **refresh
+);
+
+/**
+ * makes @code entry invisible for new lookups, current users keep it alive
+ */
+void CacheManagerT_remove_CacheEntryT(CacheManagerT *cache, CacheEntryT *entry);
+
+/**
+ * puts @code entry to the index in place of @code old, one of them
+ * revalidated the other, unless @code old is not cached anymore
+ */
+void CacheManagerT_replace_CacheEntryT(
+  CacheManagerT *cache, CacheEntryT *old, CacheEntryT *entry
 );
 
 CacheEntryT *CacheEntryT_new_withUrl(const char *url);
 
-void CacheManagerT_checkAndRemoveExpired_CacheNodeT(CacheManagerT *manager);
+/**
+ * Drops stale entries from up to @code bucketsBatch buckets of
+ * @code shard starting at @code *cursor and advances it, wrapping to `0`
+ * at the end of the table. Entries which `CacheEntryT_canRevalidate` are
+ * kept
+ * @return number of removed entries
+ */
+size_t CacheManagerT_checkAndRemoveExpired_CacheNodeT(
+  CacheManagerT *manager, CacheShardT *shard, size_t *cursor,
+  size_t         bucketsBatch
+);
+
+/**
+ * starts a thread which sweeps stale entries every
+ * `CACHE_JANITOR_INTERVAL_MS`
+ * @return `0` or error number
+ */
+int CacheManagerT_startJanitor(CacheManagerT *manager);
 
 CacheEntryChunkT *CacheEntryT_appendData(
   CacheEntryT *entry, const char *data, size_t dataSize, CacheStatusT status
 );
+
+/**
+ * wakes readers waiting for bytes committed since the last notification,
+ * called by the uploader before it waits for more data
+ */
+void CacheEntryT_flush(CacheEntryT *entry);
+
+/**
+ * Lets the uploader receive straight into the tail of the last chunk, a
+ * new chunk is appended when it is full. Readers do not see the bytes
+ * until `CacheEntryT_commitData`
+ * @return free space of at least one byte, its size in @code space, or
+ * `NULL` on allocation failure
+ */
+char *CacheEntryT_reserveData(CacheEntryT *entry, size_t *space);
+
+/**
+ * publishes @code dataSize bytes written to the reserved space
+ */
+void CacheEntryT_commitData(
+  CacheEntryT *entry, size_t dataSize, CacheStatusT status
+);
 #undef URL_MAX_LENGTH
 #endif
@@ -1,23 +1,199 @@
 #include "cache.h"
+#include "../utils/log.h"
+#include "../server/proxy.h"
 
+#include <errno.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
 
+/**
+ * Process wide store of chunks backed by mapped memfd segments, so cached
+ * bodies can leave through `sendfile` without copying to user space.
+ * Every size class carves own segments into slots, released slots give
+ * their pages back and wait in @code freeSlots for reuse. Segments are
+ * never unmapped
+ */
+static struct {
+  pthread_mutex_t   mutex;
+  CacheEntryChunkT *freeSlots[CACHE_STORE_CLASSES];
+  size_t            slotsQ[CACHE_STORE_CLASSES];
+  size_t            usedSlotsQ[CACHE_STORE_CLASSES];
+  size_t            heapBytes;
+  bool              disabled;
+} Store = {
+  .mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static size_t classSize(const int sizeClass) {
+  return (size_t) CACHE_CHUNK_MIN_SIZE << (2 * sizeClass);
+}
+
+/**
+ * @return the smallest class fitting @code dataSize or `-1`
+ */
+static int classOf(const size_t dataSize) {
+  for (int sizeClass = 0; sizeClass < CACHE_STORE_CLASSES; ++sizeClass) {
+    if (dataSize <= classSize(sizeClass)) return sizeClass;
+  }
+  return -1;
+}
+
+/**
+ * maps one more segment of @code sizeClass and puts its slots to the free
+ * list, disables the store if memfd is not available. Use under
+ * `Store.mutex`
+ */
+static void addSegment(const int sizeClass) {
+  const size_t slotSize = classSize(sizeClass);
+  const size_t slotsQ   = CACHE_STORE_SEGMENT_SIZE / slotSize;
+  const int    fd       = memfd_create("cache-store", MFD_CLOEXEC);
+  char *       mapping  = MAP_FAILED;
+  if (fd < 0 || ftruncate(fd, CACHE_STORE_SEGMENT_SIZE) != 0) {
+    goto storeFailed;
+  }
+  mapping = mmap(
+    NULL, CACHE_STORE_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0
+  );
+  if (mapping == MAP_FAILED) {
+    goto storeFailed;
+  }
+  CacheEntryChunkT *slots = calloc(slotsQ, sizeof(*slots));
+  if (slots == NULL) {
+    munmap(mapping, CACHE_STORE_SEGMENT_SIZE);
+    close(fd);
+    return;
+  }
+
+  for (size_t i = 0; i < slotsQ; ++i) {
+    CacheEntryChunkT *slot = &slots[i];
+    slot->fd                   = fd;
+    slot->offset               = (off_t) (i * slotSize);
+    slot->data                 = mapping + i * slotSize;
+    slot->maxDataSize          = slotSize;
+    atomic_init(&slot->next, Store.freeSlots[sizeClass]);
+    Store.freeSlots[sizeClass] = slot;
+  }
+  Store.slotsQ[sizeClass] += slotsQ;
+  return;
+
+storeFailed:
+  logWarning("%s:%d memfd cache store is unavailable, using heap : %s",
+             __FILE__, __LINE__, strerror(errno));
+  if (fd >= 0) close(fd);
+  Store.disabled = true;
+}
+
+/**
+ * @return free slot of the store or `NULL` if it is disabled
+ */
+static CacheEntryChunkT *takeSlot(const int sizeClass) {
+  int ret = pthread_mutex_lock(&Store.mutex);
+  CHECK_RET("pthread_mutex_lock", ret);
+
+  if (Store.freeSlots[sizeClass] == NULL && !Store.disabled) {
+    addSegment(sizeClass);
+  }
+  CacheEntryChunkT *slot = Store.freeSlots[sizeClass];
+  if (slot != NULL) {
+    Store.freeSlots[sizeClass] = atomic_load(&slot->next);
+    ++Store.usedSlotsQ[sizeClass];
+  }
+
+  ret = pthread_mutex_unlock(&Store.mutex);
+  CHECK_RET("pthread_mutex_unlock", ret);
+  return slot;
+}
+
+static void addHeapBytes(const size_t added, const size_t removed) {
+  int ret = pthread_mutex_lock(&Store.mutex);
+  CHECK_RET("pthread_mutex_lock", ret);
+  Store.heapBytes = Store.heapBytes + added - removed;
+  ret = pthread_mutex_unlock(&Store.mutex);
+  CHECK_RET("pthread_mutex_unlock", ret);
+}
 
 CacheEntryChunkT *CacheEntryChunkT_new(const size_t dataSize) {
-  CacheEntryChunkT *tmp = malloc(sizeof(*tmp));
+  const int         sizeClass = classOf(dataSize);
+  CacheEntryChunkT *tmp       = NULL;
+  if (sizeClass >= 0) {
+    tmp = takeSlot(sizeClass);
+  }
   if (tmp == NULL) {
-    return NULL;
+    tmp = malloc(sizeof(*tmp));
+    if (tmp == NULL) {
+      return NULL;
+    }
+    tmp->data = malloc(dataSize * sizeof(*tmp->data));
+    if (tmp->data == NULL) {
+      free(tmp);
+      return NULL;
+    }
+    tmp->fd          = -1;
+    tmp->offset      = 0;
+    tmp->maxDataSize = dataSize;
+    addHeapBytes(dataSize, 0);
   }
-  tmp->data = malloc(dataSize * sizeof(*tmp->data));
-  tmp->maxDataSize = dataSize;
-  tmp->curDataSize = 0;
-  tmp->next = NULL;
+  atomic_init(&tmp->curDataSize, 0);
+  atomic_init(&tmp->next, NULL);
   return tmp;
 }
 
 void CacheEntryChunkT_delete(CacheEntryChunkT *chunk) {
   if (chunk == NULL) return;
 
-  free(chunk->data);
-  free(chunk);
+  if (chunk->fd < 0) {
+    addHeapBytes(0, chunk->maxDataSize);
+    free(chunk->data);
+    free(chunk);
+    return;
+  }
+  /*
+   * pages still referenced by socket buffers of `sendfile` stay intact,
+   * the slot gets fresh ones on reuse
+   */
+  madvise(chunk->data, chunk->maxDataSize, MADV_REMOVE);
+
+  const int sizeClass = classOf(chunk->maxDataSize);
+  int       ret       = pthread_mutex_lock(&Store.mutex);
+  CHECK_RET("pthread_mutex_lock", ret);
+  atomic_store(&chunk->next, Store.freeSlots[sizeClass]);
+  Store.freeSlots[sizeClass] = chunk;
+  --Store.usedSlotsQ[sizeClass];
+  ret = pthread_mutex_unlock(&Store.mutex);
+  CHECK_RET("pthread_mutex_unlock", ret);
+}
+
+void CacheStoreT_stats(CacheStoreStatsT *stats) {
+  memset(stats, 0, sizeof(*stats));
+  int ret = pthread_mutex_lock(&Store.mutex);
+  CHECK_RET("pthread_mutex_lock", ret);
+
+  for (int sizeClass = 0; sizeClass < CACHE_STORE_CLASSES; ++sizeClass) {
+    stats->classSize[sizeClass]  = classSize(sizeClass);
+    stats->slotsQ[sizeClass]     = Store.slotsQ[sizeClass];
+    stats->usedSlotsQ[sizeClass] = Store.usedSlotsQ[sizeClass];
+    stats->mappedBytes += Store.slotsQ[sizeClass] * classSize(sizeClass);
+    stats->usedBytes   += Store.usedSlotsQ[sizeClass] * classSize(sizeClass);
+  }
+  stats->heapBytes = Store.heapBytes;
+
+  ret = pthread_mutex_unlock(&Store.mutex);
+  CHECK_RET("pthread_mutex_unlock", ret);
+}
+
+ssize_t CacheEntryChunkT_send(
+  const CacheEntryChunkT *chunk,
+  const int               fd,
+  const size_t            offset,
+  const size_t            size
+) {
+  if (chunk->fd < 0) {
+    return send(fd, chunk->data + offset, size, MSG_NOSIGNAL);
+  }
+  off_t fileOffset = chunk->offset + (off_t) offset;
+  return sendfile(fd, chunk->fd, &fileOffset, size);
 }
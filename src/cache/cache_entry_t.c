@@ -4,6 +4,7 @@
 #include "../utils/log.h"
 
 #include <errno.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
@@ -15,21 +16,19 @@ CacheEntryT *CacheEntryT_new() {
   if (tmp == NULL) {
     return NULL;
   }
-  tmp->status = InProcess;
-  tmp->dataChunks = NULL;
+  memset(tmp, 0, sizeof(*tmp));
+  atomic_init(&tmp->status, InProcess);
+  atomic_init(&tmp->dataChunks, NULL);
+  atomic_init(&tmp->downloadedSize, 0);
   tmp->lastChunk = NULL;
-  tmp->downloadedSize = 0;
+  tmp->waiters = NULL;
 
   pthread_mutexattr_t attr;
-  if (pthread_cond_init(&tmp->dataCond, NULL) != 0) {
-    logFatal("[CacheEntryT_new] pthread_cond_init", strerror(errno));
-    goto destroyAtMalloc;;
-  }
   if (pthread_mutexattr_init(&attr) != 0) {
     logFatal(
       "[CacheEntryT_new] pthread_mutexattr_init failed %s", strerror(errno)
     );
-    goto destroyAtCond;
+    goto destroyAtMalloc;
   }
   if (pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ERRORCHECK) != 0) {
     logFatal(
@@ -48,48 +47,257 @@ CacheEntryT *CacheEntryT_new() {
 
 destroyAtMutexAtrs:
   pthread_mutexattr_destroy(&attr);
-destroyAtCond:
-  pthread_cond_destroy(&tmp->dataCond);
 destroyAtMalloc:
   free(tmp);
   tmp = NULL;
   return tmp;
 }
 
-void CacheEntryT_release(CacheEntryT *entry) {
+bool CacheEntryT_release(CacheEntryT *entry) {
+  /*
+   * release orders own accesses before the free, acquire makes the last
+   * user see accesses of all others
+   */
+  return atomic_fetch_sub_explicit(
+           &entry->usersQ, 1, memory_order_acq_rel
+         ) == 1;
+}
+
+void CacheEntryT_acquire(CacheEntryT *entry) {
+  atomic_fetch_add_explicit(&entry->usersQ, 1, memory_order_relaxed);
+}
+
+void CacheEntryT_delete(CacheEntryT *entry) {
+  if (entry == NULL) return;
+  for (CacheEntryChunkT *cur = atomic_load(&entry->dataChunks);
+       cur != NULL;) {
+    CacheEntryChunkT *tmp = cur;
+    cur = atomic_load(&cur->next);
+    CacheEntryChunkT_delete(tmp);
+  }
+  free(entry->url);
+  free(entry->etag);
+  free(entry->lastModified);
+  CacheEntryT *stale = entry->revalidates;
+  if (stale != NULL) {
+    atomic_store(&stale->revalidating, false);
+    if (CacheEntryT_release(stale)) {
+      CacheEntryT_delete(stale);
+    }
+  }
+  if (pthread_mutex_destroy(&entry->dataMutex) != 0) abort();
+  free(entry);
+}
+
+bool CacheEntryT_subscribe(
+  CacheEntryT *      entry,
+  CacheEntryWaiterT *waiter,
+  const size_t       seenSize,
+  const CacheStatusT seenStatus
+) {
   int ret = pthread_mutex_lock(&entry->dataMutex);
-  CHECK_ERROR("pthread_mutex_lock", ret);
+  CHECK_RET("pthread_mutex_lock", ret);
 
-  entry->usersQ--;
-  gettimeofday(&entry->lastUpdate, NULL);
+  /*
+   * the writer commits before it locks to notify, so a commit missed here
+   * is followed by a notification. An entry is marked not cacheable before
+   * its head is committed, so a reader which missed the mark sees the size
+   * moved on
+   */
+  const bool unchanged = atomic_load(&entry->downloadedSize) == seenSize
+                         && atomic_load(&entry->status) == seenStatus;
+  if (unchanged && !waiter->subscribed) {
+    waiter->subscribed = true;
+    waiter->next       = entry->waiters;
+    entry->waiters     = waiter;
+  }
 
   ret = pthread_mutex_unlock(&entry->dataMutex);
-  CHECK_RET(pthread_mutex_unlock, ret);
+  CHECK_RET("pthread_mutex_unlock", ret);
+  return unchanged;
 }
 
-void CacheEntryT_acquire(CacheEntryT *entry) {
+void CacheEntryT_unsubscribe(CacheEntryT *entry, CacheEntryWaiterT *waiter) {
   int ret = pthread_mutex_lock(&entry->dataMutex);
   CHECK_RET("pthread_mutex_lock", ret);
 
-  entry->usersQ++;
-  gettimeofday(&entry->lastUpdate, NULL);
+  if (waiter->subscribed) {
+    for (CacheEntryWaiterT **cur = &entry->waiters; *cur != NULL;
+         cur                     = &(*cur)->next) {
+      if (*cur == waiter) {
+        *cur = waiter->next;
+        break;
+      }
+    }
+    waiter->subscribed = false;
+  }
 
   ret = pthread_mutex_unlock(&entry->dataMutex);
   CHECK_RET("pthread_mutex_unlock", ret);
 }
 
-void CacheEntryT_delete(CacheEntryT *entry) {
-  if (entry == NULL) return;
-  free(entry->url);
-  for (volatile CacheEntryChunkT *cur = entry->dataChunks;
-       cur != NULL;) {
-    CacheEntryChunkT *tmp = (CacheEntryChunkT *) cur;
-    CacheEntryChunkT_delete(tmp);
-    cur = cur->next;
+/**
+ * @return `true` if the entry is out of the index and everybody holding it
+ * besides the writer is an attached reader. Use under
+ * `CacheEntryT->dataMutex`
+ */
+static bool onlyReaders(const CacheEntryT *entry) {
+  return !atomic_load(&entry->inCache)
+         && atomic_load(&entry->usersQ) == entry->readersQ + 1;
+}
+
+/**
+ * use under `CacheEntryT->dataMutex`
+ */
+static void notifyProducer(CacheEntryT *entry) {
+  CacheEntryWaiterT *producer = entry->producer;
+  if (producer == NULL) return;
+  entry->producer      = NULL;
+  producer->subscribed = false;
+  producer->notify(producer);
+}
+
+void CacheEntryT_attach(CacheEntryT *entry, CacheEntryReaderT *reader) {
+  int ret = pthread_mutex_lock(&entry->dataMutex);
+  CHECK_RET("pthread_mutex_lock", ret);
+
+  atomic_store(&reader->keepOffset, 0);
+  reader->next   = entry->readers;
+  entry->readers = reader;
+  ++entry->readersQ;
+
+  ret = pthread_mutex_unlock(&entry->dataMutex);
+  CHECK_RET("pthread_mutex_unlock", ret);
+}
+
+void CacheEntryT_detach(CacheEntryT *entry, CacheEntryReaderT *reader) {
+  int ret = pthread_mutex_lock(&entry->dataMutex);
+  CHECK_RET("pthread_mutex_lock", ret);
+
+  for (CacheEntryReaderT **cur = &entry->readers; *cur != NULL;
+       cur                     = &(*cur)->next) {
+    if (*cur == reader) {
+      *cur = reader->next;
+      --entry->readersQ;
+      break;
+    }
+  }
+  notifyProducer(entry);
+
+  ret = pthread_mutex_unlock(&entry->dataMutex);
+  CHECK_RET("pthread_mutex_unlock", ret);
+}
+
+void CacheEntryT_advance(
+  CacheEntryT *entry, CacheEntryReaderT *reader, const size_t keepOffset
+) {
+  int ret = pthread_mutex_lock(&entry->dataMutex);
+  CHECK_RET("pthread_mutex_lock", ret);
+
+  /*
+   * release orders the reads of passed chunks before their free
+   */
+  atomic_store_explicit(&reader->keepOffset, keepOffset, memory_order_release);
+  notifyProducer(entry);
+
+  ret = pthread_mutex_unlock(&entry->dataMutex);
+  CHECK_RET("pthread_mutex_unlock", ret);
+}
+
+/**
+ * @return the smallest offset some reader still needs, `0` while a user
+ * which may read from the start is not attached. Use under
+ * `CacheEntryT->dataMutex`
+ */
+static size_t keptOffset(const CacheEntryT *entry) {
+  if (!onlyReaders(entry)) return 0;
+  size_t kept = SIZE_MAX;
+  for (const CacheEntryReaderT *cur = entry->readers; cur != NULL;
+       cur                          = cur->next) {
+    const size_t offset = atomic_load_explicit(
+      &cur->keepOffset, memory_order_acquire
+    );
+    if (offset < kept) kept = offset;
+  }
+  return kept;
+}
+
+/**
+ * Frees chunks after the first one which end before every reader of an
+ * entry out of the index, the writer calls it. Only the writer holds a
+ * reference besides the readers, so nobody else can start reading
+ */
+static void trimConsumed(CacheEntryT *entry) {
+  CacheEntryChunkT *first = atomic_load(&entry->dataChunks);
+  if (first == NULL || atomic_load(&entry->inCache)) return;
+
+  int ret = pthread_mutex_lock(&entry->dataMutex);
+  CHECK_RET("pthread_mutex_lock", ret);
+  const size_t kept = keptOffset(entry);
+  ret = pthread_mutex_unlock(&entry->dataMutex);
+  CHECK_RET("pthread_mutex_unlock", ret);
+
+  /*
+   * readers past a chunk never follow the links before theirs, the first
+   * chunk is only read by those which have not passed anything
+   */
+  size_t            offset = atomic_load(&first->curDataSize)
+                             + entry->trimmedSize;
+  CacheEntryChunkT *cur    = atomic_load(&first->next);
+  while (cur != NULL && cur != entry->lastChunk
+         && offset + cur->maxDataSize <= kept) {
+    CacheEntryChunkT *next = atomic_load(&cur->next);
+    atomic_store_explicit(&first->next, next, memory_order_release);
+    offset             += cur->maxDataSize;
+    entry->trimmedSize += cur->maxDataSize;
+    CacheEntryChunkT_delete(cur);
+    cur = next;
+  }
+}
+
+bool CacheEntryT_throttle(CacheEntryT *entry, CacheEntryWaiterT *producer) {
+  int ret = pthread_mutex_lock(&entry->dataMutex);
+  CHECK_RET("pthread_mutex_lock", ret);
+
+  const size_t downloaded = atomic_load(&entry->downloadedSize);
+  const size_t kept       = keptOffset(entry);
+  const bool   throttled  = onlyReaders(entry) && kept < downloaded
+                            && downloaded - kept > CACHE_STREAM_WINDOW;
+  if (throttled) {
+    producer->subscribed = true;
+    entry->producer      = producer;
+  }
+
+  ret = pthread_mutex_unlock(&entry->dataMutex);
+  CHECK_RET("pthread_mutex_unlock", ret);
+  return throttled;
+}
+
+void CacheEntryT_unthrottle(CacheEntryT *entry, CacheEntryWaiterT *producer) {
+  int ret = pthread_mutex_lock(&entry->dataMutex);
+  CHECK_RET("pthread_mutex_lock", ret);
+
+  if (entry->producer == producer) {
+    entry->producer = NULL;
+  }
+  producer->subscribed = false;
+
+  ret = pthread_mutex_unlock(&entry->dataMutex);
+  CHECK_RET("pthread_mutex_unlock", ret);
+}
+
+/**
+ * use under `CacheEntryT->dataMutex`
+ */
+static void notifyWaiters(CacheEntryT *entry) {
+  CacheEntryWaiterT *waiter = entry->waiters;
+  entry->waiters            = NULL;
+  while (waiter != NULL) {
+    CacheEntryWaiterT *next = waiter->next;
+    waiter->subscribed      = false;
+    waiter->notify(waiter);
+    waiter = next;
   }
-  free(entry->url);
-  if (pthread_mutex_destroy(&entry->dataMutex) != 0) abort();
-  if (pthread_cond_destroy(&entry->dataCond) != 0)abort();
 }
 
 void CacheEntryT_updateStatus(CacheEntryT *      entry,
@@ -98,12 +306,114 @@ void CacheEntryT_updateStatus(CacheEntryT *      entry,
   int ret = pthread_mutex_lock(&entry->dataMutex);
   CHECK_RET("pthread_mutex_lock", ret);
 
-  entry->status = status;
+  atomic_store_explicit(&entry->status, status, memory_order_release);
   gettimeofday(&entry->lastUpdate, NULL);
-  ret = pthread_cond_broadcast(&entry->dataCond);
+  notifyWaiters(entry);
+
+  ret = pthread_mutex_unlock(&entry->dataMutex);
+  CHECK_RET("pthread_mutex_unlock", ret);
+}
+
+void CacheEntryT_markNotCacheable(CacheEntryT *entry) {
+  int ret = pthread_mutex_lock(&entry->dataMutex);
+  CHECK_RET("pthread_mutex_lock", ret);
+
+  atomic_store(&entry->notCacheable, true);
+  notifyWaiters(entry);
+
+  ret = pthread_mutex_unlock(&entry->dataMutex);
+  CHECK_RET("pthread_mutex_unlock", ret);
+}
+
+bool CacheEntryT_canRevalidate(const CacheEntryT *entry, const int64_t nowMs) {
+  if (atomic_load(&entry->status) != Success
+      || atomic_load(&entry->notCacheable)
+      || entry->httpStatusCode != 200) {
+    return false;
+  }
+  const bool validated = entry->etag != NULL || entry->lastModified != NULL;
+  return (validated && nowMs - entry->expiresAt < CACHE_STALE_RETENTION_MS)
+         || CacheEntryT_canServeWhileRevalidating(entry, nowMs)
+         || CacheEntryT_canServeOnError(entry, nowMs);
+}
+
+bool CacheEntryT_canServeWhileRevalidating(
+  const CacheEntryT *entry, const int64_t nowMs
+) {
+  return nowMs - entry->expiresAt < entry->staleWhileRevalidate;
+}
+
+bool CacheEntryT_canServeOnError(
+  const CacheEntryT *entry, const int64_t nowMs
+) {
+  return nowMs - entry->expiresAt < entry->staleIfError;
+}
+
+/**
+ * chunks grow with the entry, or match the rest of the response when its
+ * size is known, and fit at least @code needed bytes up to
+ * `kDefCacheChunkSize`
+ */
+static size_t nextChunkSize(const CacheEntryT *entry, const size_t needed) {
+  const size_t downloadedSize = atomic_load_explicit(
+    &entry->downloadedSize, memory_order_relaxed
+  );
+  size_t size = CACHE_CHUNK_MIN_SIZE;
+  if (entry->expectedSize > downloadedSize) {
+    size = entry->expectedSize - downloadedSize;
+  } else if (entry->lastChunk != NULL) {
+    size = entry->lastChunk->maxDataSize * CACHE_CHUNK_GROWTH;
+  }
+  if (size < needed) {
+    size = needed;
+  }
+  return size < kDefCacheChunkSize ? size : kDefCacheChunkSize;
+}
+
+/**
+ * @return the last chunk if it has free space or a new appended one
+ */
+static CacheEntryChunkT *writableChunk(
+  CacheEntryT *entry, const size_t needed
+) {
+  CacheEntryChunkT *chunk = entry->lastChunk;
+  if (chunk != NULL
+      && atomic_load_explicit(&chunk->curDataSize, memory_order_relaxed)
+           < chunk->maxDataSize) {
+    return chunk;
+  }
+  trimConsumed(entry);
+  chunk = CacheEntryChunkT_new(nextChunkSize(entry, needed));
+  if (chunk == NULL) {
+    logError("%s:%d cache entry chunk allocation failed: %s",
+             __FILE__, __LINE__, strerror(errno));
+    return NULL;
+  }
+  CacheEntryT_append_CacheEntryChunkT(entry, chunk);
+  return chunk;
+}
+
+/**
+ * Makes @code dataSize bytes written to chunks visible to readers and
+ * wakes them once per `CACHE_NOTIFY_BYTES`, finer wakeups come from
+ * `CacheEntryT_flush` and status changes
+ */
+static void publish(CacheEntryT *entry, const size_t dataSize) {
+  const size_t committed = atomic_fetch_add_explicit(
+    &entry->downloadedSize, dataSize, memory_order_release
+  ) + dataSize;
+  if (committed - entry->notifiedSize < CACHE_NOTIFY_BYTES) return;
+  CacheEntryT_flush(entry);
+}
 
-  CHECK_RET("pthread_cond_broadcast", ret);
+void CacheEntryT_flush(CacheEntryT *entry) {
+  const size_t committed = atomic_load(&entry->downloadedSize);
+  if (committed == entry->notifiedSize) return;
 
+  int ret = pthread_mutex_lock(&entry->dataMutex);
+  CHECK_RET("pthread_mutex_lock", ret);
+  entry->notifiedSize = committed;
+  notifyWaiters(entry);
   ret = pthread_mutex_unlock(&entry->dataMutex);
   CHECK_RET("pthread_mutex_unlock", ret);
 }
@@ -114,54 +424,61 @@ CacheEntryChunkT *CacheEntryT_appendData(
   const size_t       dataSize,
   const CacheStatusT status
 ) {
-  if (dataSize <= 0) return (CacheEntryChunkT *) entry->lastChunk;
-  size_t                     added = 0;
-  volatile CacheEntryChunkT *retval = NULL;
-  int                        ret = pthread_mutex_lock(&entry->dataMutex);
-  CHECK_RET("pthread_mutex_lock", ret);
-  if (entry->dataChunks == NULL) {
-    CacheEntryChunkT *iniChunk = CacheEntryChunkT_new(kDefCacheChunkSize);
-    if (iniChunk == NULL) {
-      entry->status = Failed;
-      goto onExit;
-    }
-    CacheEntryT_append_CacheEntryChunkT(entry, iniChunk);
-  }
-
-  retval = entry->lastChunk;
+  if (dataSize <= 0) return entry->lastChunk;
+  size_t            added = 0;
+  CacheEntryChunkT *chunk = NULL;
   while (added < dataSize) {
-    assert(retval->curDataSize <= retval->maxDataSize);
-
-    const size_t freeSpace = retval->maxDataSize - retval->curDataSize;
-    if (freeSpace == 0) {
-      retval = CacheEntryChunkT_new(kDefCacheChunkSize);
-      if (retval == NULL) {
-        logError("%s:%d cache entry chunk allocation failed: %s",
-                 __LINE__, __FILE__, strerror(errno));
-        entry->status = Failed;
-        goto onExit;
-      }
-      CacheEntryT_append_CacheEntryChunkT(entry, (CacheEntryChunkT *) retval);
-    } else {
-      const size_t toCopy = dataSize - added < freeSpace
-                              ? dataSize - added
-                              : freeSpace;
-      void *      dest = retval->data + retval->curDataSize;
-      const void *src = data + added;
-
-      memcpy(dest, src, toCopy);
-
-      retval->curDataSize += toCopy;
-      added += toCopy;
+    chunk = writableChunk(entry, dataSize - added);
+    if (chunk == NULL) {
+      break;
     }
+    const size_t curDataSize = atomic_load_explicit(
+      &chunk->curDataSize, memory_order_relaxed
+    );
+    const size_t freeSpace = chunk->maxDataSize - curDataSize;
+    const size_t toCopy    = dataSize - added < freeSpace
+                               ? dataSize - added
+                               : freeSpace;
+    memcpy(chunk->data + curDataSize, data + added, toCopy);
+    atomic_store_explicit(
+      &chunk->curDataSize, curDataSize + toCopy, memory_order_release
+    );
+    added += toCopy;
   }
-  entry->status = status;
+  publish(entry, added);
+  if (chunk == NULL) {
+    CacheEntryT_updateStatus(entry, Failed);
+  } else if (status != InProcess) {
+    CacheEntryT_updateStatus(entry, status);
+  }
+  return chunk;
+}
 
-onExit:
-  ret = pthread_cond_broadcast(&entry->dataCond);
-  CHECK_RET("pthread_cond_broadcast", ret);
+char *CacheEntryT_reserveData(CacheEntryT *entry, size_t *space) {
+  CacheEntryChunkT *chunk = writableChunk(entry, 1);
+  if (chunk == NULL) {
+    return NULL;
+  }
+  const size_t curDataSize = atomic_load_explicit(
+    &chunk->curDataSize, memory_order_relaxed
+  );
+  *space = chunk->maxDataSize - curDataSize;
+  return chunk->data + curDataSize;
+}
 
-  ret = pthread_mutex_unlock(&entry->dataMutex);
-  CHECK_RET("pthread_mutex_unlock", ret);
-  return (CacheEntryChunkT *) retval;
+void CacheEntryT_commitData(
+  CacheEntryT *entry, const size_t dataSize, const CacheStatusT status
+) {
+  CacheEntryChunkT *chunk       = entry->lastChunk;
+  const size_t      curDataSize = atomic_load_explicit(
+    &chunk->curDataSize, memory_order_relaxed
+  );
+  assert(curDataSize + dataSize <= chunk->maxDataSize);
+  atomic_store_explicit(
+    &chunk->curDataSize, curDataSize + dataSize, memory_order_release
+  );
+  publish(entry, dataSize);
+  if (status != InProcess) {
+    CacheEntryT_updateStatus(entry, status);
+  }
 }
@@ -0,0 +1,56 @@
+#include "cache.h"
+#include "../utils/log.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static void *janitorRoutine(void *arg) {
+  CacheManagerT *manager = arg;
+
+  const struct timespec interval = {
+    .tv_sec  = CACHE_JANITOR_INTERVAL_MS / 1000,
+    .tv_nsec = (CACHE_JANITOR_INTERVAL_MS % 1000) * 1000000L,
+  };
+  while (!manager->janitorStopped) {
+    /*
+     * one full pass over every shard per interval, the lock is released
+     * between batches so lookups are not stalled
+     */
+    size_t removed = 0;
+    for (int i = 0; i < CACHE_SHARDS && !manager->janitorStopped; ++i) {
+      size_t cursor = 0;
+      do {
+        removed += CacheManagerT_checkAndRemoveExpired_CacheNodeT(
+          manager, &manager->shards[i], &cursor, CACHE_JANITOR_BUCKETS_BATCH
+        );
+      } while (cursor != 0 && !manager->janitorStopped);
+    }
+    if (removed > 0) {
+      logInfo("%s:%d janitor removed %zu expired entries",
+              __FILE__, __LINE__, removed);
+    }
+
+    CacheStoreStatsT stats;
+    CacheStoreT_stats(&stats);
+    logDebug("%s:%d chunk store: %zu of %zu mapped bytes in slots, "
+             "%zu heap bytes, %zu bytes charged to cache",
+             __FILE__, __LINE__, stats.usedBytes, stats.mappedBytes,
+             stats.heapBytes, atomic_load(&manager->usedSize));
+    nanosleep(&interval, NULL);
+  }
+  return NULL;
+}
+
+int CacheManagerT_startJanitor(CacheManagerT *manager) {
+  manager->janitorStopped = false;
+  const int ret = pthread_create(
+    &manager->janitor, NULL, janitorRoutine, manager
+  );
+  if (ret != 0) {
+    logError("%s:%d pthread_create %s", __FILE__, __LINE__, strerror(ret));
+    return ret;
+  }
+  pthread_setname_np(manager->janitor, "cache-janitor");
+  return 0;
+}
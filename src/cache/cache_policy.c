@@ -0,0 +1,154 @@
+#include "cache.h"
+#include "../utils/log.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Nodes are kept in a circular list, for LRU @code head is the most
+ * recently used node, for CLOCK it is the hand position
+ */
+typedef struct ListPolicy {
+  CachePolicyT    base;
+  CacheNodeT *    head;
+  pthread_mutex_t accessMutex;
+} ListPolicyT;
+
+/**
+ * entries with readers would stay in memory after eviction, so they are
+ * skipped. New readers need the index lock, the count can not grow here
+ */
+static bool isEvictable(CacheNodeT *node) {
+  return atomic_load(&node->entry->usersQ) == 1;
+}
+
+static void listInsertBefore(ListPolicyT *policy, CacheNodeT *node) {
+  if (policy->head == NULL) {
+    node->policyPrev = node;
+    node->policyNext = node;
+    policy->head     = node;
+    return;
+  }
+  CacheNodeT *head       = policy->head;
+  node->policyNext       = head;
+  node->policyPrev       = head->policyPrev;
+  head->policyPrev->policyNext = node;
+  head->policyPrev       = node;
+}
+
+static void listUnlink(ListPolicyT *policy, CacheNodeT *node) {
+  if (node->policyNext == node) {
+    policy->head = NULL;
+  } else {
+    node->policyPrev->policyNext = node->policyNext;
+    node->policyNext->policyPrev = node->policyPrev;
+    if (policy->head == node) {
+      policy->head = node->policyNext;
+    }
+  }
+  node->policyPrev = NULL;
+  node->policyNext = NULL;
+}
+
+static void listDestroy(CachePolicyT *base) {
+  ListPolicyT *policy = (ListPolicyT *) base;
+  pthread_mutex_destroy(&policy->accessMutex);
+  free(policy);
+}
+
+static void lruOnInsert(CachePolicyT *base, CacheNodeT *node) {
+  ListPolicyT *policy = (ListPolicyT *) base;
+  listInsertBefore(policy, node);
+  policy->head = node;
+}
+
+static void lruOnAccess(CachePolicyT *base, CacheNodeT *node) {
+  ListPolicyT *policy = (ListPolicyT *) base;
+  int          ret    = pthread_mutex_lock(&policy->accessMutex);
+  CHECK_RET("pthread_mutex_lock", ret);
+
+  if (policy->head != node && node->policyNext != NULL) {
+    listUnlink(policy, node);
+    listInsertBefore(policy, node);
+    policy->head = node;
+  }
+
+  ret = pthread_mutex_unlock(&policy->accessMutex);
+  CHECK_RET("pthread_mutex_unlock", ret);
+}
+
+static void listOnRemove(CachePolicyT *base, CacheNodeT *node) {
+  ListPolicyT *policy = (ListPolicyT *) base;
+  listUnlink(policy, node);
+}
+
+static CacheNodeT *lruVictim(CachePolicyT *base) {
+  ListPolicyT *policy = (ListPolicyT *) base;
+  if (policy->head == NULL) return NULL;
+
+  CacheNodeT *node = policy->head->policyPrev;
+  do {
+    if (isEvictable(node)) return node;
+    node = node->policyPrev;
+  } while (node != policy->head->policyPrev);
+  return NULL;
+}
+
+static void clockOnInsert(CachePolicyT *base, CacheNodeT *node) {
+  atomic_store_explicit(&node->referenced, false, memory_order_relaxed);
+  listInsertBefore((ListPolicyT *) base, node);
+}
+
+static void clockOnAccess(CachePolicyT *base, CacheNodeT *node) {
+  (void) base;
+  atomic_store_explicit(&node->referenced, true, memory_order_relaxed);
+}
+
+/**
+ * second chance: referenced nodes are skipped once with the bit cleared,
+ * two full turns are enough to visit every node without the bit
+ */
+static CacheNodeT *clockVictim(CachePolicyT *base) {
+  ListPolicyT *policy = (ListPolicyT *) base;
+  if (policy->head == NULL) return NULL;
+
+  CacheNodeT *start = policy->head;
+  for (int turn = 0; turn < 2; ++turn) {
+    do {
+      CacheNodeT *node = policy->head;
+      policy->head     = node->policyNext;
+      const bool referenced = atomic_exchange_explicit(
+        &node->referenced, false, memory_order_relaxed
+      );
+      if (!referenced && isEvictable(node)) return node;
+    } while (policy->head != start);
+  }
+  return NULL;
+}
+
+CachePolicyT *CachePolicyT_new(const CachePolicyKindT kind) {
+  ListPolicyT *policy = malloc(sizeof(*policy));
+  if (policy == NULL) {
+    return NULL;
+  }
+  memset(policy, 0, sizeof(*policy));
+  const int ret = pthread_mutex_init(&policy->accessMutex, NULL);
+  CHECK_RET("pthread_mutex_init", ret);
+
+  policy->base.onRemove = listOnRemove;
+  policy->base.destroy  = listDestroy;
+  switch (kind) {
+    case CachePolicyClock:
+      policy->base.onInsert = clockOnInsert;
+      policy->base.onAccess = clockOnAccess;
+      policy->base.victim   = clockVictim;
+      break;
+    case CachePolicyLru:
+    default:
+      policy->base.onInsert = lruOnInsert;
+      policy->base.onAccess = lruOnAccess;
+      policy->base.victim   = lruVictim;
+      break;
+  }
+  return &policy->base;
+}
@@ -0,0 +1,145 @@
+#include "cache.h"
+#include "../utils/log.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SUCCESS 0
+#define FAILURE -1
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME        1099511628211ULL
+
+uint64_t CacheT_hashUrl(const char *url) {
+  uint64_t hash = FNV_OFFSET_BASIS;
+  for (const unsigned char *cur = (const unsigned char *) url; *cur; ++cur) {
+    hash ^= *cur;
+    hash *= FNV_PRIME;
+  }
+  return hash;
+}
+
+int CacheTableT_init(CacheTableT *table, const size_t bucketsQ) {
+  memset(table, 0, sizeof(*table));
+  table->buckets = calloc(bucketsQ, sizeof(*table->buckets));
+  if (table->buckets == NULL) {
+    return FAILURE;
+  }
+  table->bucketsQ = bucketsQ;
+  return SUCCESS;
+}
+
+/**
+ * moves up to @code steps buckets of the old array into the current one
+ */
+static void migrate(CacheTableT *table, size_t steps) {
+  if (table->oldBuckets == NULL) return;
+
+  for (; steps > 0 && table->migratedQ < table->oldBucketsQ; --steps) {
+    CacheNodeT *node = table->oldBuckets[table->migratedQ++];
+    while (node != NULL) {
+      CacheNodeT * next  = node->next;
+      const size_t index = node->entry->urlHash & (table->bucketsQ - 1);
+      node->next            = table->buckets[index];
+      table->buckets[index] = node;
+      node                  = next;
+    }
+  }
+  if (table->migratedQ == table->oldBucketsQ) {
+    free(table->oldBuckets);
+    table->oldBuckets  = NULL;
+    table->oldBucketsQ = 0;
+    table->migratedQ   = 0;
+  }
+}
+
+static void startResize(CacheTableT *table) {
+  migrate(table, SIZE_MAX);
+
+  const size_t newBucketsQ = table->bucketsQ * 2;
+  CacheNodeT **newBuckets  = calloc(newBucketsQ, sizeof(*newBuckets));
+  if (newBuckets == NULL) {
+    logWarning("%s:%d cache table resize failed %s",
+               __FILE__, __LINE__, strerror(errno));
+    return;
+  }
+  table->oldBuckets  = table->buckets;
+  table->oldBucketsQ = table->bucketsQ;
+  table->migratedQ   = 0;
+  table->buckets     = newBuckets;
+  table->bucketsQ    = newBucketsQ;
+}
+
+/**
+ * @return bucket head where a node with @code hash lives now
+ */
+static CacheNodeT **bucketOf(const CacheTableT *table, const uint64_t hash) {
+  if (table->oldBuckets != NULL) {
+    const size_t oldIndex = hash & (table->oldBucketsQ - 1);
+    if (oldIndex >= table->migratedQ) {
+      return &table->oldBuckets[oldIndex];
+    }
+  }
+  return &table->buckets[hash & (table->bucketsQ - 1)];
+}
+
+CacheNodeT *CacheTableT_find(
+  const CacheTableT *table, const uint64_t hash, const char *url
+) {
+  for (CacheNodeT *node = *bucketOf(table, hash);
+       node != NULL;
+       node = node->next) {
+    if (node->entry->urlHash == hash && strcmp(node->entry->url, url) == 0) {
+      return node;
+    }
+  }
+  return NULL;
+}
+
+void CacheTableT_insert(CacheTableT *table, CacheNodeT *node) {
+  migrate(table, CACHE_TABLE_MIGRATE_STEP);
+  if (table->oldBuckets == NULL && table->size >= table->bucketsQ) {
+    startResize(table);
+  }
+
+  CacheNodeT **bucket = bucketOf(table, node->entry->urlHash);
+  node->next          = *bucket;
+  *bucket             = node;
+  ++table->size;
+}
+
+CacheNodeT *CacheTableT_remove(CacheTableT *table, const CacheEntryT *entry) {
+  migrate(table, CACHE_TABLE_MIGRATE_STEP);
+
+  for (CacheNodeT **cur = bucketOf(table, entry->urlHash);
+       *cur != NULL;
+       cur = &(*cur)->next) {
+    if ((*cur)->entry == entry) {
+      return CacheTableT_unlink(table, cur);
+    }
+  }
+  return NULL;
+}
+
+CacheNodeT *CacheTableT_unlink(CacheTableT *table, CacheNodeT **link) {
+  CacheNodeT *node = *link;
+  *link            = node->next;
+  node->next       = NULL;
+  --table->size;
+  return node;
+}
+
+void CacheTableT_migrate(CacheTableT *table, const size_t steps) {
+  migrate(table, steps);
+}
+
+void CacheTableT_finishResize(CacheTableT *table) {
+  migrate(table, SIZE_MAX);
+}
+
+void CacheTableT_destroy(CacheTableT *table) {
+  free(table->oldBuckets);
+  free(table->buckets);
+  memset(table, 0, sizeof(*table));
+}
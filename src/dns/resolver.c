@@ -0,0 +1,275 @@
+#include "resolver.h"
+#include "../utils/log.h"
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME        1099511628211ULL
+
+typedef enum DnsRecordState {
+  DnsRecordResolving,
+  DnsRecordResolved,
+  DnsRecordFailed,
+} DnsRecordStateT;
+
+/**
+ * Cached result for one host, `DnsRecordResolving` ones are also queued
+ * for a resolver thread through @code nextJob
+ */
+struct DnsRecord {
+  char *          host;
+  uint64_t        hash;
+  DnsRecordStateT state;
+  int64_t         expiresAt;
+  DnsAddressesT   addresses;
+  DnsWaiterT *    waiters;
+  DnsRecordT *    next;
+  DnsRecordT *    nextJob;
+};
+
+static int64_t nowMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t hashHost(const char *host) {
+  uint64_t hash = FNV_OFFSET_BASIS;
+  for (const unsigned char *cur = (const unsigned char *) host; *cur; ++cur) {
+    hash ^= *cur;
+    hash *= FNV_PRIME;
+  }
+  return hash;
+}
+
+static void DnsRecordT_delete(DnsRecordT *record) {
+  free(record->host);
+  free(record);
+}
+
+/**
+ * @code host may be a bracketed IPv6 literal from an url authority
+ */
+static void lookup(const char *host, DnsAddressesT *addresses) {
+  char         literal[INET6_ADDRSTRLEN];
+  const size_t hostLen = strlen(host);
+  if (host[0] == '[' && hostLen - 2 < sizeof(literal)) {
+    memcpy(literal, host + 1, hostLen - 2);
+    literal[hostLen - 2] = '\0';
+    host = literal;
+  }
+
+  struct addrinfo hints = {0};
+  hints.ai_family   = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags    = AI_ADDRCONFIG;
+
+  struct addrinfo *result = NULL;
+  const int        ret    = getaddrinfo(host, NULL, &hints, &result);
+  addresses->count = 0;
+  if (ret != 0) {
+    logError("%s:%d getaddrinfo %s : %s",
+             __FILE__, __LINE__, host, gai_strerror(ret));
+    return;
+  }
+  for (const struct addrinfo *cur = result;
+       cur != NULL && addresses->count < DNS_MAX_ADDRESSES;
+       cur = cur->ai_next) {
+    if (cur->ai_addrlen > sizeof(struct sockaddr_storage)) continue;
+    DnsAddressT *address = &addresses->list[addresses->count++];
+    memcpy(&address->addr, cur->ai_addr, cur->ai_addrlen);
+    address->addrLen = cur->ai_addrlen;
+  }
+  freeaddrinfo(result);
+}
+
+static void *resolverRoutine(void *arg) {
+  DnsResolverT *resolver = arg;
+  int           ret      = pthread_mutex_lock(&resolver->mutex);
+  CHECK_RET("pthread_mutex_lock", ret);
+  while (1) {
+    while (resolver->jobsHead == NULL) {
+      ret = pthread_cond_wait(&resolver->jobsCond, &resolver->mutex);
+      CHECK_RET("pthread_cond_wait", ret);
+    }
+    DnsRecordT *record = resolver->jobsHead;
+    resolver->jobsHead = record->nextJob;
+    if (resolver->jobsHead == NULL) {
+      resolver->jobsTail = NULL;
+    }
+    record->nextJob = NULL;
+
+    /*
+     * a resolving record is never freed, its host stays valid unlocked
+     */
+    DnsAddressesT addresses;
+    ret = pthread_mutex_unlock(&resolver->mutex);
+    CHECK_RET("pthread_mutex_unlock", ret);
+    resolver->lookup(record->host, &addresses);
+    ret = pthread_mutex_lock(&resolver->mutex);
+    CHECK_RET("pthread_mutex_lock", ret);
+
+    record->addresses = addresses;
+    record->state     = addresses.count > 0
+                          ? DnsRecordResolved
+                          : DnsRecordFailed;
+    record->expiresAt = nowMs() + (addresses.count > 0
+                                     ? resolver->positiveTtl
+                                     : resolver->negativeTtl);
+    DnsWaiterT *waiter = record->waiters;
+    record->waiters    = NULL;
+    while (waiter != NULL) {
+      DnsWaiterT *next   = waiter->next;
+      waiter->subscribed = false;
+      waiter->record     = NULL;
+      waiter->notify(waiter);
+      waiter = next;
+    }
+  }
+  return NULL;
+}
+
+DnsResolverT *DnsResolverT_new(const long positiveTtl, const long negativeTtl) {
+  DnsResolverT *resolver = malloc(sizeof(*resolver));
+  if (resolver == NULL) {
+    return NULL;
+  }
+  memset(resolver, 0, sizeof(*resolver));
+  resolver->positiveTtl = positiveTtl;
+  resolver->negativeTtl = negativeTtl;
+  resolver->lookup      = lookup;
+
+  int ret = pthread_mutex_init(&resolver->mutex, NULL);
+  CHECK_RET("pthread_mutex_init", ret);
+  ret = pthread_cond_init(&resolver->jobsCond, NULL);
+  CHECK_RET("pthread_cond_init", ret);
+
+  for (int i = 0; i < DNS_RESOLVER_THREADS; ++i) {
+    ret = pthread_create(
+      &resolver->threads[i], NULL, resolverRoutine, resolver
+    );
+    if (ret != 0) {
+      logFatal("%s:%d pthread_create %s", __FILE__, __LINE__, strerror(ret));
+      abort();
+    }
+    pthread_setname_np(resolver->threads[i], "dns-resolver");
+  }
+  return resolver;
+}
+
+/**
+ * @return record of @code host, expired finished records met on the way
+ * are freed. Use under `DnsResolverT->mutex`
+ */
+static DnsRecordT *findRecord(
+  DnsResolverT *resolver, const char *host, const uint64_t hash,
+  const int64_t now
+) {
+  DnsRecordT **current = &resolver->buckets[hash % DNS_CACHE_BUCKETS];
+  while (*current != NULL) {
+    DnsRecordT *record = *current;
+    if (record->hash == hash && strcmp(record->host, host) == 0) {
+      return record;
+    }
+    if (record->state != DnsRecordResolving && record->expiresAt <= now) {
+      *current = record->next;
+      DnsRecordT_delete(record);
+      continue;
+    }
+    current = &record->next;
+  }
+  return NULL;
+}
+
+static void enqueue(DnsResolverT *resolver, DnsRecordT *record) {
+  record->state   = DnsRecordResolving;
+  record->nextJob = NULL;
+  if (resolver->jobsTail == NULL) {
+    resolver->jobsHead = record;
+  } else {
+    resolver->jobsTail->nextJob = record;
+  }
+  resolver->jobsTail = record;
+  const int ret = pthread_cond_signal(&resolver->jobsCond);
+  CHECK_RET("pthread_cond_signal", ret);
+}
+
+int DnsResolverT_resolve(
+  DnsResolverT * resolver,
+  const char *   host,
+  DnsAddressesT *result,
+  DnsWaiterT *   waiter
+) {
+  const uint64_t hash = hashHost(host);
+  const int64_t  now  = nowMs();
+  int            ret  = pthread_mutex_lock(&resolver->mutex);
+  CHECK_RET("pthread_mutex_lock", ret);
+
+  DnsRecordT *record = findRecord(resolver, host, hash, now);
+  if (record == NULL) {
+    record = malloc(sizeof(*record));
+    if (record == NULL || (record->host = strdup(host)) == NULL) {
+      free(record);
+      ret = pthread_mutex_unlock(&resolver->mutex);
+      CHECK_RET("pthread_mutex_unlock", ret);
+      return DNS_FAILED;
+    }
+    record->hash    = hash;
+    record->waiters = NULL;
+    record->next    = resolver->buckets[hash % DNS_CACHE_BUCKETS];
+    resolver->buckets[hash % DNS_CACHE_BUCKETS] = record;
+    enqueue(resolver, record);
+  } else if (record->state != DnsRecordResolving && record->expiresAt <= now) {
+    enqueue(resolver, record);
+  }
+
+  int status;
+  switch (record->state) {
+    case DnsRecordResolved:
+      *result = record->addresses;
+      status  = DNS_RESOLVED;
+      break;
+    case DnsRecordFailed:
+      status = DNS_FAILED;
+      break;
+    case DnsRecordResolving:
+    default:
+      if (!waiter->subscribed) {
+        waiter->subscribed = true;
+        waiter->record     = record;
+        waiter->next       = record->waiters;
+        record->waiters    = waiter;
+      }
+      status = DNS_PENDING;
+      break;
+  }
+
+  ret = pthread_mutex_unlock(&resolver->mutex);
+  CHECK_RET("pthread_mutex_unlock", ret);
+  return status;
+}
+
+void DnsResolverT_cancel(DnsResolverT *resolver, DnsWaiterT *waiter) {
+  int ret = pthread_mutex_lock(&resolver->mutex);
+  CHECK_RET("pthread_mutex_lock", ret);
+
+  if (waiter->subscribed) {
+    for (DnsWaiterT **cur = &waiter->record->waiters;
+         *cur != NULL;
+         cur = &(*cur)->next) {
+      if (*cur == waiter) {
+        *cur = waiter->next;
+        break;
+      }
+    }
+    waiter->subscribed = false;
+    waiter->record     = NULL;
+  }
+
+  ret = pthread_mutex_unlock(&resolver->mutex);
+  CHECK_RET("pthread_mutex_unlock", ret);
+}
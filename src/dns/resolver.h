@@ -0,0 +1,91 @@
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define DNS_RESOLVED 0
+#define DNS_FAILED   (-1)
+#define DNS_PENDING  1
+
+#define DNS_RESOLVER_THREADS 4
+#define DNS_MAX_ADDRESSES    8
+#define DNS_CACHE_BUCKETS    256
+/**
+ * `getaddrinfo` does not report record ttl, results are kept for a fixed
+ * time instead
+ */
+#define DNS_POSITIVE_TTL 60000
+#define DNS_NEGATIVE_TTL 5000
+
+typedef struct DnsAddress   DnsAddressT;
+typedef struct DnsAddresses DnsAddressesT;
+typedef struct DnsWaiter    DnsWaiterT;
+typedef struct DnsRecord    DnsRecordT;
+typedef struct DnsResolver  DnsResolverT;
+
+struct DnsAddress {
+  struct sockaddr_storage addr;
+  socklen_t               addrLen;
+};
+
+struct DnsAddresses {
+  DnsAddressT list[DNS_MAX_ADDRESSES];
+  int         count;
+};
+
+/**
+ * Notified once when a pending lookup completes. @code notify is called
+ * from a resolver thread under the resolver lock and must not block
+ */
+struct DnsWaiter {
+  void (*notify)(DnsWaiterT *waiter);
+  DnsWaiterT *next;
+  DnsRecordT *record;
+  bool        subscribed;
+};
+
+/**
+ * fills @code addresses for @code host, blocking, `count` stays `0` on
+ * failure
+ */
+typedef void (*DnsLookupT)(const char *host, DnsAddressesT *addresses);
+
+struct DnsResolver {
+  pthread_mutex_t mutex;
+  pthread_cond_t  jobsCond;
+  DnsRecordT *    buckets[DNS_CACHE_BUCKETS];
+  DnsRecordT *    jobsHead;
+  DnsRecordT *    jobsTail;
+  pthread_t       threads[DNS_RESOLVER_THREADS];
+  long            positiveTtl;
+  long            negativeTtl;
+  /**
+   * `getaddrinfo` by default, tests set a stub before the first resolve
+   */
+  DnsLookupT      lookup;
+};
+
+DnsResolverT *DnsResolverT_new(long positiveTtl, long negativeTtl);
+
+/**
+ * Non-blocking lookup of @code host. Concurrent lookups of one host share
+ * a single `getaddrinfo` call
+ * @return `DNS_RESOLVED` with addresses copied to @code result,
+ * `DNS_FAILED` for a (cached) failure or `DNS_PENDING`, then
+ * @code waiter is notified and the call has to be repeated
+ */
+int DnsResolverT_resolve(
+  DnsResolverT * resolver,
+  const char *   host,
+  DnsAddressesT *result,
+  DnsWaiterT *   waiter
+);
+
+/**
+ * must be called before @code waiter is freed
+ */
+void DnsResolverT_cancel(DnsResolverT *resolver, DnsWaiterT *waiter);
+
+#endif //RESOLVER_H
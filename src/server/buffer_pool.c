@@ -0,0 +1,44 @@
+#include "proxy.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+BufferPoolT *BufferPoolT_new(const size_t capacity, const size_t maxFree) {
+  BufferPoolT *pool = malloc(sizeof(*pool));
+  if (pool == NULL) {
+    return NULL;
+  }
+  pool->free = malloc(maxFree * sizeof(*pool->free));
+  if (pool->free == NULL) {
+    free(pool);
+    return NULL;
+  }
+  pool->freeQ    = 0;
+  pool->maxFree  = maxFree;
+  pool->capacity = capacity;
+  return pool;
+}
+
+BufferT *BufferPoolT_acquire(BufferPoolT *pool, const size_t maxSize) {
+  if (maxSize > pool->capacity) {
+    return BufferT_new(maxSize);
+  }
+  BufferT *buffer = pool->freeQ > 0
+                      ? pool->free[--pool->freeQ]
+                      : BufferT_new(pool->capacity);
+  if (buffer == NULL) {
+    return NULL;
+  }
+  buffer->occupancy = 0;
+  buffer->maxSize   = maxSize;
+  return buffer;
+}
+
+void BufferPoolT_release(BufferPoolT *pool, BufferT *buffer) {
+  if (buffer == NULL) return;
+  if (buffer->capacity != pool->capacity || pool->freeQ == pool->maxFree) {
+    BufferT_delete(buffer);
+    return;
+  }
+  pool->free[pool->freeQ++] = buffer;
+}
@@ -1,428 +1,1209 @@
 #include <errno.h>
+#include <inttypes.h>
 #include <netdb.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <netinet/in.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 
 #include "proxy.h"
 #include "../utils/log.h"
 
-#define METHOD_MAX_LEN 16
-#define URL_MAX_LEN 2048
-#define PROTOCOL_MAX_LEN 16
-#define MAX_RESPONSE_LEN 16
-#define SUCCESS_STATUS 200
+#define URL_MAX_LEN (HOST_MAX_LEN + PATH_MAX_LEN + 32)
+#define CLIENT_SENDS_PER_EVENT 16
+/**
+ * shorter runs of a chunk are gathered with the head and following chunks
+ * into one `sendmsg` rather than sent with `sendfile`
+ */
+#define CLIENT_SENDFILE_MIN (64 * 1024)
+/**
+ * more ranges in one request are ignored and the whole response is sent
+ */
+#define CLIENT_MAX_RANGES 8
+/**
+ * room for the headers added to a `206` head and the first part head,
+ * longer content types are left out of parts
+ */
+#define RANGE_HEAD_RESERVE 1024
+#define RANGE_TYPE_MAX_LEN 256
+
+typedef enum ClientState {
+  ClientReadingRequest,
+  ClientSendingEntry,
+  ClientSendingReply,
+} ClientStateT;
+
+/**
+ * State of one accepted connection, GET responses are streamed from a
+ * shared `CacheEntryT` filled by `UploadContextT`, other requests,
+ * uncacheable responses and tunnels are handed over to `RelayT` with the
+ * socket.
+ * Requests are served one by one, pipelined ones wait in @code buffer
+ */
+struct ClientContext {
+  EventHandlerT     handler;
+  EventTimerT       timer;
+  CacheEntryWaiterT waiter;
+  ProxyWorkerT *    worker;
+  ClientStateT      state;
+  BufferT *         buffer;
+  /**
+   * bytes of @code buffer taken by the request being served
+   */
+  size_t            requestLen;
+  /**
+   * bytes of @code buffer already scanned for the end of the request head
+   */
+  size_t            scannedLen;
+  int               requestsServed;
+  bool              http11;
+  bool              keepAlive;
+  /**
+   * rewritten response head or whole error reply
+   */
+  BufferT *         reply;
+  size_t            replySent;
+  bool              headPrepared;
+  /**
+   * validators of a conditional GET, slices of @code buffer, `NULL` data
+   * if absent
+   */
+  HttpSliceT        ifNoneMatch;
+  HttpSliceT        ifModifiedSince;
+  /**
+   * `Range` and `If-Range` of a GET, slices of @code buffer, `NULL` data
+   * if absent
+   */
+  HttpSliceT        range;
+  HttpSliceT        ifRange;
+  /**
+   * @code reply is a whole `304` or `416`, the connection may outlive it
+   */
+  bool              replyComplete;
+  /**
+   * ranges of the body being sent resolved once the head is stored, `0`
+   * for the whole response. @code rangeIndex is the part being sent
+   */
+  HttpByteRangeT    ranges[CLIENT_MAX_RANGES];
+  int               rangesQ;
+  int               rangeIndex;
+  size_t            rangeTotal;
+  /**
+   * entry bytes to pass before the part and bytes of the part still to
+   * send, `SIZE_MAX` when the body goes whole
+   */
+  size_t            skipLeft;
+  size_t            partLeft;
+
+  CacheEntryT *                    entry;
+  CacheEntryReaderT                reader;
+  bool                             ownsUpload;
+  bool                             bypassCache;
+  const CacheEntryChunkT *         chunk;
+  /**
+   * entry offset of @code chunk, which is only moved forward
+   */
+  size_t                           chunkStart;
+  size_t                           chunkOffset;
+  size_t                           totalSent;
+};
+
+/**
+ * hop-by-hop headers of the stored origin response
+ */
+static const char *ResponseReplacedHeaders[] = {
+  "Connection", "Keep-Alive", "Proxy-Connection",
+};
 
-int getSocketOfRemote(const char *host, int port);
+/**
+ * headers of the stored response which a `206` sets for the part
+ */
+static const char *RangeReplacedHeaders[] = {
+  "Connection", "Keep-Alive", "Proxy-Connection",
+  "Content-Length", "Content-Range", "Content-Type",
+};
 
-void handleConnection(
-  CacheManagerT *cacheManager, BufferT *buffer, int clientSocket
-);
+/**
+ * `Content-Length: 0` announces no body
+ */
+static bool hasBody(const HttpRequestT *request) {
+  const HttpSliceT *contentLength = HttpRequestT_header(
+    request, "Content-Length"
+  );
+  return HttpRequestT_header(request, "Transfer-Encoding") != NULL
+         || (contentLength != NULL
+             && !HttpSliceT_equals(contentLength, "0"));
+}
 
-static int ableForCashing(const char *mehtod) {
-  if (strcmp(mehtod, "GET") == 0) return 1;
-  return 0;
+/**
+ * a request body would be lost in the cache, such requests are relayed
+ */
+static int ableForCashing(const HttpRequestT *request) {
+  return HttpSliceT_equals(&request->method, "GET") && !hasBody(request);
 }
 
-void *clientConnectionHandler(void *args) {
-  ClientContextArgsT *contextArgs  = args;
-  BufferT *           buffer       = BufferT_new(BUFFER_SIZE);
-  const int           clientSocket = contextArgs->clientSocket;
-  CacheManagerT *     cacheManager = contextArgs->cacheManager;
+static void handleRequest(ClientContextT *ctx, const HttpRequestT *request);
 
-  if (buffer == NULL) {
-    logError("%s:%d failed to allocate buffer",
-             __FILE__, __LINE__, strerror(errno));
-    sendError(clientSocket, InternalErrorStatus, "");
-    goto destroyContext;
-  }
-  handleConnection(cacheManager, buffer, clientSocket);
-destroyContext:
-  logInfo("client with socket : %d finished", clientSocket);
-  BufferT_delete(buffer);
-  close(clientSocket);
-  free(contextArgs);
-  return NULL;
+static void readRequest(ClientContextT *ctx);
+
+static size_t chunkSize(const CacheEntryChunkT *chunk) {
+  return atomic_load_explicit(&chunk->curDataSize, memory_order_acquire);
 }
 
-void waitFirstChunkData(const volatile CacheNodeT *cache) {
-  CacheEntryT *entry = cache->entry;
-  if (entry->status != Failed && entry->dataChunks == NULL) {
-    int ret = pthread_mutex_lock(&entry->dataMutex);
-    CHECK_RET("pthread_mutex_lock", ret);
+static const CacheEntryChunkT *chunkNext(const CacheEntryChunkT *chunk) {
+  return atomic_load_explicit(&chunk->next, memory_order_acquire);
+}
 
-    while (entry->status != Failed && entry->dataChunks == NULL) {
-      ret = pthread_cond_wait(&entry->dataCond, &entry->dataMutex);
-      CHECK_RET("pthread_cond_wait", ret);
-    }
+/**
+ * @code entry is acquired for the context, which reads it from the start
+ */
+static void ClientContextT_setEntry(ClientContextT *ctx, CacheEntryT *entry) {
+  CacheEntryT_attach(entry, &ctx->reader);
+  ctx->entry = entry;
+}
 
-    ret = pthread_mutex_unlock(&entry->dataMutex);
-    CHECK_RET("pthread_mutex_unlock", ret);
+static void ClientContextT_dropEntry(ClientContextT *ctx) {
+  CacheEntryT_unsubscribe(ctx->entry, &ctx->waiter);
+  CacheEntryT_detach(ctx->entry, &ctx->reader);
+  if (CacheEntryT_release(ctx->entry)) {
+    CacheEntryT_delete(ctx->entry);
   }
+  ctx->entry       = NULL;
+  ctx->chunk       = NULL;
+  ctx->chunkStart  = 0;
+  ctx->chunkOffset = 0;
 }
 
-int sendBufferAndForwardData(
-  BufferT * buffer,
-  const int src,
-  const int dest
-) {
-  size_t ret = sendNWithTimeout(
-    dest, buffer->data, buffer->occupancy,SEND_RECV_TIMEOUT
-  );
-  if (errno != 0 || ret != buffer->occupancy) {
-    logError(
-      "%s:%d failed to forward request", __FILE__, __LINE__, strerror(errno)
-    );
-    return ERROR;
+/**
+ * moves to the next chunk, the passed one may be freed then
+ */
+static void ClientContextT_nextChunk(ClientContextT *ctx) {
+  ctx->chunkStart  += chunkSize(ctx->chunk);
+  ctx->chunk        = chunkNext(ctx->chunk);
+  ctx->chunkOffset  = 0;
+  CacheEntryT_advance(ctx->entry, &ctx->reader, ctx->chunkStart);
+}
+
+static void ClientContextT_close(ClientContextT *ctx) {
+  EventLoopT *loop = ctx->worker->loop;
+  logInfo("client with socket : %d finished", ctx->handler.fd);
+
+  EventLoopT_disarmTimer(loop, &ctx->timer);
+  if (ctx->entry != NULL) {
+    ClientContextT_dropEntry(ctx);
   }
-  ret = forwardDataWithTimeout(
-    src, dest, SEND_RECV_TIMEOUT, buffer
-  );
+  EventLoopT_cancelPost(loop, &ctx->handler);
+  EventLoopT_remove(loop, &ctx->handler);
+  close(ctx->handler.fd);
+  BufferPoolT_release(ctx->worker->bufferPool, ctx->buffer);
+  BufferPoolT_release(ctx->worker->bufferPool, ctx->reply);
+  free(ctx);
+}
 
-  if (ret != SUCCESS) {
-    return ERROR;
+/**
+ * frees the context without closing its socket, which goes on to serve
+ * one more pass-through exchange
+ * @return the socket
+ */
+static int ClientContextT_handOver(ClientContextT *ctx) {
+  EventLoopT *loop = ctx->worker->loop;
+  const int   fd   = ctx->handler.fd;
+  EventLoopT_disarmTimer(loop, &ctx->timer);
+  if (ctx->entry != NULL) {
+    ClientContextT_dropEntry(ctx);
   }
-  return SUCCESS;
+  EventLoopT_cancelPost(loop, &ctx->handler);
+  EventLoopT_remove(loop, &ctx->handler);
+  BufferPoolT_release(ctx->worker->bufferPool, ctx->buffer);
+  BufferPoolT_release(ctx->worker->bufferPool, ctx->reply);
+  free(ctx);
+  return fd;
 }
 
 /**
- * receive part to @code buffer
- * of response and check status
- * @param remoteSocket
- * @param buffer
- * @return ERROR if error occurs, else response status
+ * the response is complete, either closes the connection or drops the
+ * served request from @code buffer and goes on with the next one
  */
-static int receiveCheckResponseStatus(const int remoteSocket, BufferT *buffer) {
-  char   protocolBuffer[MAX_RESPONSE_LEN]; // Буфер для данных из сокета
-  int    statusCode;
-  size_t received = recvNWithTimeout(
-    remoteSocket, buffer->data, buffer->occupancy, SEND_RECV_TIMEOUT
+static void ClientContextT_finishResponse(ClientContextT *ctx) {
+  if (!ctx->keepAlive) {
+    ClientContextT_close(ctx);
+    return;
+  }
+  ClientContextT_dropEntry(ctx);
+  ctx->ownsUpload        = false;
+  ctx->bypassCache       = false;
+  ctx->headPrepared      = false;
+  ctx->replyComplete     = false;
+  ctx->rangesQ           = 0;
+  ctx->rangeIndex        = 0;
+  ctx->totalSent         = 0;
+  ctx->replySent         = 0;
+  ctx->reply->occupancy  = 0;
+
+  BufferT *buffer = ctx->buffer;
+  memmove(buffer->data, buffer->data + ctx->requestLen,
+          buffer->occupancy - ctx->requestLen);
+  buffer->occupancy -= ctx->requestLen;
+  buffer->data[buffer->occupancy] = '\0';
+  ctx->requestLen = 0;
+  ctx->scannedLen = 0;
+
+  /*
+   * posted rather than called, so a long pipeline does not recurse and
+   * input which arrived while sending is not lost with edge triggering
+   */
+  ctx->state = ClientReadingRequest;
+  EventLoopT_armTimer(
+    ctx->worker->loop, &ctx->timer, ctx->worker->config->clientKeepAliveTimeout
   );
-  if (errno != 0) {
-    logError(
-      "%s:%d failed to receive response", __FILE__, __LINE__, strerror(errno)
+  EventLoopT_post(ctx->worker->loop, &ctx->handler);
+}
+
+static void flushReply(ClientContextT *ctx) {
+  BufferT *buffer = ctx->reply;
+  while (ctx->replySent < buffer->occupancy) {
+    const ssize_t sent = send(
+      ctx->handler.fd,
+      buffer->data + ctx->replySent,
+      buffer->occupancy - ctx->replySent,
+      MSG_NOSIGNAL
     );
-    return ERROR;
+    if (sent < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        EventLoopT_armTimer(ctx->worker->loop, &ctx->timer, SEND_RECV_TIMEOUT);
+        return;
+      }
+      break;
+    }
+    ctx->replySent += sent;
   }
+  if (ctx->replyComplete && ctx->replySent == buffer->occupancy) {
+    ClientContextT_finishResponse(ctx);
+    return;
+  }
+  ClientContextT_close(ctx);
+}
 
-  buffer->occupancy = received;
+static void replyError(
+  ClientContextT *ctx, const char *status, const char *message
+) {
+  ctx->reply->occupancy = formatError(
+    ctx->reply->data, ctx->reply->maxSize, status, message
+  );
+  ctx->replySent = 0;
+  ctx->state     = ClientSendingReply;
+  flushReply(ctx);
+}
 
-  if (sscanf(buffer->data, "%s %d", protocolBuffer, &statusCode) == 2) {
-    if (strncmp(protocolBuffer, "HTTP/", 5) == 0) {
-      return statusCode; // Возвращаем код состояния
+/**
+ * weak comparison of RFC 9110 against every entity tag of an
+ * `If-None-Match` list, `*` matches any
+ */
+static bool etagListMatches(const HttpSliceT *list, const char *etag) {
+  const char * tag    = strncmp(etag, "W/", 2) == 0 ? etag + 2 : etag;
+  const size_t tagLen = strlen(tag);
+  const char * cur    = list->data;
+  const char * end    = list->data + list->len;
+  while (cur < end) {
+    if (*cur == ' ' || *cur == '\t' || *cur == ',') {
+      ++cur;
+      continue;
+    }
+    if (*cur == '*') return true;
+    const char *start = end - cur >= 2 && strncmp(cur, "W/", 2) == 0
+                          ? cur + 2
+                          : cur;
+    const char *next  = start;
+    if (next < end && *next == '"') {
+      next = memchr(next + 1, '"', end - next - 1);
+      if (next == NULL) return false;
+      ++next;
+    } else {
+      while (next < end && *next != ',') ++next;
     }
+    if ((size_t) (next - start) == tagLen
+        && memcmp(start, tag, tagLen) == 0) {
+      return true;
+    }
+    cur = next;
+  }
+  return false;
+}
+
+/**
+ * `If-None-Match` takes precedence, `If-Modified-Since` is compared with
+ * the stored `Last-Modified` only without it
+ */
+static bool isNotModified(const ClientContextT *ctx, const CacheEntryT *entry) {
+  if (entry->httpStatusCode != 200) return false;
+  if (ctx->ifNoneMatch.data != NULL) {
+    return entry->etag != NULL
+           && etagListMatches(&ctx->ifNoneMatch, entry->etag);
+  }
+  if (ctx->ifModifiedSince.data == NULL || entry->lastModified == NULL) {
+    return false;
+  }
+  const int64_t since    = parseHttpDate(
+    ctx->ifModifiedSince.data, ctx->ifModifiedSince.len
+  );
+  const int64_t modified = parseHttpDate(
+    entry->lastModified, strlen(entry->lastModified)
+  );
+  return since != ERROR && modified != ERROR && modified <= since;
+}
+
+/**
+ * answers a conditional request which the cached response satisfies
+ */
+static void replyNotModified(ClientContextT *ctx, const CacheEntryT *entry) {
+  BufferT *    reply    = ctx->reply;
+  const size_t capacity = reply->maxSize;
+  size_t       len      = snprintf(
+    reply->data, capacity, "HTTP/1.1 304 Not Modified\r\n"
+  );
+  if (entry->etag != NULL) {
+    len += snprintf(reply->data + len, capacity - len, "ETag: %s\r\n",
+                    entry->etag);
+  }
+  if (entry->lastModified != NULL) {
+    len += snprintf(reply->data + len, capacity - len,
+                    "Last-Modified: %s\r\n", entry->lastModified);
   }
+  len += snprintf(reply->data + len, capacity - len, "Connection: %s\r\n\r\n",
+                  ctx->keepAlive ? "keep-alive" : "close");
+  reply->occupancy   = len;
+  ctx->replySent     = 0;
+  ctx->replyComplete = true;
+  ctx->state         = ClientSendingReply;
+  EventLoopT_disarmTimer(ctx->worker->loop, &ctx->timer);
+  flushReply(ctx);
+}
 
-  return ERROR;
+/**
+ * A close-delimited body under a coding other than chunked is stored
+ * transfer-coded. Its length is not the one of the representation, and
+ * a client which sees `Transfer-Encoding` reads it up to the close
+ */
+static bool isTransferCoded(const CacheEntryT *entry, const char *head) {
+  size_t valueLen = 0;
+  return entry->bodyFraming == BodyFramingClose
+         && findHeader(
+              head, entry->headLen, "Transfer-Encoding", &valueLen
+            ) != NULL;
 }
 
 /**
- *
- * @param buffer
- * @param host
- * @param port
- * @param clientSocket
- * @param url
- * @param responseStatus
- * @return
+ * @return `true` if the body length of @code entry is known, it is stored
+ * to @code length
  */
-CacheNodeT *startDataUpload(
-  BufferT *   buffer,
-  const char *host,
-  const int   port,
-  const int   clientSocket,
-  const char *url,
-  int *       responseStatus
+static bool entryBodyLength(
+  const CacheEntryT *entry, const CacheStatusT status, size_t *length
 ) {
-  *responseStatus    = ERROR;
-  CacheNodeT * node  = NULL;
-  CacheEntryT *entry = NULL;
-
-  const int remoteSocket = getSocketOfRemote(host, port);
-  if (remoteSocket < 0) {
-    logError("%s, %d failed getSocketOfRemote of host:port %s:%d",
-             __FILE__, __LINE__, host, port);
-    sendError(clientSocket, BadGatewayStatus, FailedToConnectRemoteServer);
-    return NULL;
+  if (entry->bodyFraming == BodyFramingLength) {
+    *length = entry->expectedSize - entry->headLen;
+    return true;
   }
+  const CacheEntryChunkT *head = atomic_load_explicit(
+    &entry->dataChunks, memory_order_acquire
+  );
+  if (entry->bodyFraming == BodyFramingClose && status == Success
+      && !isTransferCoded(entry, head->data)) {
+    *length = entry->bodyLen;
+    return true;
+  }
+  return false;
+}
 
-  int ret = sendBufferAndForwardData(buffer, clientSocket, remoteSocket);
-  if (ret != SUCCESS) {
-    goto onFailure;
+/**
+ * `If-Range` holds a strong entity tag or the date of `Last-Modified`
+ */
+static bool ifRangeMatches(
+  const ClientContextT *ctx, const CacheEntryT *entry
+) {
+  const HttpSliceT *ifRange = &ctx->ifRange;
+  if (ifRange->data == NULL) return true;
+  if (ifRange->data[0] == '"') {
+    return entry->etag != NULL && HttpSliceT_equals(ifRange, entry->etag);
   }
+  if (entry->lastModified == NULL) return false;
+  const int64_t date     = parseHttpDate(ifRange->data, ifRange->len);
+  const int64_t modified = parseHttpDate(
+    entry->lastModified, strlen(entry->lastModified)
+  );
+  return date != ERROR && date == modified;
+}
 
-  const int status = receiveCheckResponseStatus(remoteSocket, buffer);
-  if (status < 0) {
-    goto onFailure;
+/**
+ * Resolves `Range` of the request against a complete head of a `200`
+ * whose body length is known, the whole response is sent otherwise,
+ * also for a malformed `Range` or ranges out of ascending order, which
+ * RFC 9110 lets ignore. Parts are read forward, so passed chunks of an
+ * uncached entry may be freed
+ * @return `false` if no range is satisfiable
+ */
+static bool resolveRanges(
+  ClientContextT *   ctx,
+  const CacheEntryT *entry,
+  const size_t       available,
+  const CacheStatusT status
+) {
+  size_t length = 0;
+  ctx->rangesQ  = 0;
+  if (ctx->range.data == NULL || entry->httpStatusCode != 200
+      || entry->headLen == 0 || entry->headLen > available
+      || !entryBodyLength(entry, status, &length)
+      || !ifRangeMatches(ctx, entry)) {
+    return true;
   }
-  *responseStatus = status;
-  if (status != SUCCESS_STATUS) {
-    sendBufferAndForwardData(buffer, remoteSocket, clientSocket);
-    goto onFailure;
+  const int rangesQ = parseByteRanges(
+    &ctx->range, length, ctx->ranges, CLIENT_MAX_RANGES
+  );
+  if (rangesQ == ERROR) return true;
+  for (int i = 1; i < rangesQ; ++i) {
+    if (ctx->ranges[i].first <= ctx->ranges[i - 1].last) return true;
   }
+  ctx->rangesQ    = rangesQ;
+  ctx->rangeTotal = length;
+  return rangesQ > 0;
+}
+
+static void replyRangeNotSatisfiable(ClientContextT *ctx, const size_t total) {
+  BufferT *reply   = ctx->reply;
+  reply->occupancy = snprintf(
+    reply->data, reply->maxSize,
+    "HTTP/1.1 416 Range Not Satisfiable\r\n"
+    "Content-Range: bytes */%zu\r\n"
+    "Content-Length: 0\r\n"
+    "Connection: %s\r\n\r\n",
+    total, ctx->keepAlive ? "keep-alive" : "close"
+  );
+  ctx->replySent     = 0;
+  ctx->replyComplete = true;
+  ctx->state         = ClientSendingReply;
+  EventLoopT_disarmTimer(ctx->worker->loop, &ctx->timer);
+  flushReply(ctx);
+}
+
+/**
+ * @return `Content-Type` of the stored head if it fits a part head
+ */
+static const char *rangeContentType(const CacheEntryT *entry, size_t *len) {
+  const CacheEntryChunkT *head = atomic_load_explicit(
+    &entry->dataChunks, memory_order_acquire
+  );
+  const char *type = findHeader(
+    head->data, entry->headLen, "Content-Type", len
+  );
+  return type != NULL && *len <= RANGE_TYPE_MAX_LEN ? type : NULL;
+}
 
-  node  = CacheNodeT_new();
-  entry = CacheEntryT_new();
+/**
+ * formats the delimiter and headers preceding part @code index of a
+ * `multipart/byteranges` body
+ * @return length of the part head, also if it does not fit
+ */
+static size_t formatPartHead(
+  char *dest, const size_t capacity, const ClientContextT *ctx,
+  const int index
+) {
+  const CacheEntryT *   entry = ctx->entry;
+  const HttpByteRangeT *range = &ctx->ranges[index];
+  size_t                typeLen;
+  const char *          type  = rangeContentType(entry, &typeLen);
+  /*
+   * a single call, so measuring with `NULL` dest offsets no pointer
+   */
+  return snprintf(
+    dest, capacity,
+    "\r\n--%016" PRIx64 "\r\n%s%.*s%s"
+    "Content-Range: bytes %zu-%zu/%zu\r\n\r\n",
+    entry->urlHash, type != NULL ? "Content-Type: " : "",
+    type != NULL ? (int) typeLen : 0, type != NULL ? type : "",
+    type != NULL ? "\r\n" : "",
+    range->first, range->last, ctx->rangeTotal
+  );
+}
 
-  if (node == NULL) {
-    logError("%s:%d CacheNodeT_new %s",__FILE__,__LINE__, strerror(errno));
-    goto onFailure;
+static size_t formatClosingDelimiter(
+  char *dest, const size_t capacity, const CacheEntryT *entry
+) {
+  return snprintf(
+    dest, capacity, "\r\n--%016" PRIx64 "--\r\n", entry->urlHash
+  );
+}
+
+/**
+ * moves to part @code index of the body: its head is appended to
+ * @code reply and the entry is read on from the start of the range
+ */
+static void startPart(ClientContextT *ctx, const int index) {
+  const HttpByteRangeT *range = &ctx->ranges[index];
+  BufferT *             reply = ctx->reply;
+  if (ctx->rangesQ > 1) {
+    reply->occupancy += formatPartHead(
+      reply->data + reply->occupancy, reply->maxSize - reply->occupancy,
+      ctx, index
+    );
   }
-  if (entry == NULL) {
-    logError("%s:%d CacheEntryT_new %s",__FILE__,__LINE__, strerror(errno));
-    goto onFailure;
+  const size_t position = ctx->chunk != NULL
+                            ? ctx->chunkStart + ctx->chunkOffset
+                            : 0;
+  ctx->rangeIndex = index;
+  ctx->skipLeft   = ctx->entry->headLen + range->first - position;
+  ctx->partLeft   = range->last - range->first + 1;
+}
+
+/**
+ * the current part is sent, the next one or the closing delimiter of
+ * a multipart body follows
+ */
+static void nextPart(ClientContextT *ctx) {
+  BufferT *reply   = ctx->reply;
+  reply->occupancy = 0;
+  ctx->replySent   = 0;
+  if (ctx->rangeIndex + 1 < ctx->rangesQ) {
+    startPart(ctx, ctx->rangeIndex + 1);
+    return;
   }
-  entry->url = strdup(url);
-  if (entry->url == NULL) {
-    logError("%s:%d strdup %s",__FILE__,__LINE__, strerror(errno));
-    goto onFailure;
+  ctx->rangeIndex = ctx->rangesQ;
+  if (ctx->rangesQ > 1) {
+    reply->occupancy = formatClosingDelimiter(
+      reply->data, reply->maxSize, ctx->entry
+    );
   }
+}
 
-  CacheEntryT_appendData(entry, buffer->data, buffer->occupancy, InProcess);
-  ret = handleFileUpload(entry, buffer, clientSocket, remoteSocket);
-  if (ret != SUCCESS) {
-    logError("%s:%d handleFileUpload %s",__FILE__,__LINE__, strerror(errno));
-    goto onFailure;
+/**
+ * Builds the head sent to the client from the stored origin one: own
+ * `Connection`, and `Content-Length` for a complete close-delimited body
+ * which is not transfer-coded.
+ * The connection is kept only if the client can find the end of the body.
+ * Unrecognized heads are sent as is and the connection is closed
+ */
+static void prepareHead(
+  ClientContextT *   ctx,
+  const char *       data,
+  const size_t       available,
+  const size_t       headLen,
+  const CacheStatusT status
+) {
+  BufferT *reply      = ctx->reply;
+  ctx->headPrepared   = true;
+  ctx->replySent      = 0;
+  ctx->skipLeft       = 0;
+  ctx->partLeft       = SIZE_MAX;
+  reply->occupancy    = 0;
+  if (headLen == 0 || headLen > available) {
+    ctx->keepAlive = false;
+    return;
   }
 
-  node->entry = entry;
-  return node;
+  bool addLength = false;
+  switch (ctx->entry->bodyFraming) {
+    case BodyFramingLength:
+      break;
+    case BodyFramingChunked:
+      ctx->keepAlive = ctx->keepAlive && ctx->http11;
+      break;
+    case BodyFramingClose:
+      addLength      = status == Success
+                       && !isTransferCoded(ctx->entry, data);
+      ctx->keepAlive = ctx->keepAlive && addLength;
+      break;
+  }
 
-onFailure:
-  CacheEntryT_delete(entry);
-  CacheNodeT_delete(node);
-  close(remoteSocket);
-  return NULL;
+  const char * lineEnd    = strstrn(data, headLen, "\r\n", 2);
+  const size_t statusLen  = lineEnd - data + 2;
+  const size_t capacity   = reply->maxSize;
+  size_t       len        = 0;
+  memcpy(reply->data, data, statusLen);
+  len += statusLen;
+  len += copyHeadersExcept(
+    reply->data + len, capacity - len - RESPONSE_HEAD_RESERVE,
+    data, headLen,
+    ResponseReplacedHeaders,
+    sizeof(ResponseReplacedHeaders) / sizeof(*ResponseReplacedHeaders)
+  );
+  if (addLength) {
+    len += snprintf(reply->data + len, capacity - len,
+                    "Content-Length: %zu\r\n", ctx->entry->bodyLen);
+  }
+  len += snprintf(reply->data + len, capacity - len, "Connection: %s\r\n\r\n",
+                  ctx->keepAlive ? "keep-alive" : "close");
+  reply->occupancy = len;
+  ctx->chunkOffset = headLen;
 }
 
-static volatile CacheEntryChunkT *waitFirstChunk(const CacheNodeT *node) {
-  volatile CacheEntryT *     entry    = node->entry;
-  volatile CacheEntryChunkT *curChunk = NULL;
-  while (1) {
-    curChunk            = entry->dataChunks;
-    CacheStatusT status = entry->status;
-    if (status == Failed || curChunk != NULL) {
-      break;
+/**
+ * Builds a `206` head from the stored one: a single range goes with own
+ * `Content-Range`, several as `multipart/byteranges`, then moves to the
+ * first part
+ */
+static void prepareRangeHead(ClientContextT *ctx, const char *data) {
+  const CacheEntryT *entry    = ctx->entry;
+  BufferT *          reply    = ctx->reply;
+  const size_t       capacity = reply->maxSize;
+  ctx->headPrepared           = true;
+  ctx->replySent              = 0;
+
+  size_t len = snprintf(
+    reply->data, capacity, "HTTP/1.1 206 Partial Content\r\n"
+  );
+  len += copyHeadersExcept(
+    reply->data + len, capacity - len - RANGE_HEAD_RESERVE,
+    data, entry->headLen,
+    RangeReplacedHeaders,
+    sizeof(RangeReplacedHeaders) / sizeof(*RangeReplacedHeaders)
+  );
+  if (ctx->rangesQ == 1) {
+    const HttpByteRangeT *range = &ctx->ranges[0];
+    size_t                typeLen;
+    const char *          type  = rangeContentType(entry, &typeLen);
+    if (type != NULL) {
+      len += snprintf(reply->data + len, capacity - len,
+                      "Content-Type: %.*s\r\n", (int) typeLen, type);
     }
+    len += snprintf(reply->data + len, capacity - len,
+                    "Content-Range: bytes %zu-%zu/%zu\r\n"
+                    "Content-Length: %zu\r\n",
+                    range->first, range->last, ctx->rangeTotal,
+                    range->last - range->first + 1);
+  } else {
+    size_t bodyLen = formatClosingDelimiter(NULL, 0, entry);
+    for (int i = 0; i < ctx->rangesQ; ++i) {
+      bodyLen += formatPartHead(NULL, 0, ctx, i)
+                 + ctx->ranges[i].last - ctx->ranges[i].first + 1;
+    }
+    len += snprintf(reply->data + len, capacity - len,
+                    "Content-Type: multipart/byteranges; "
+                    "boundary=%016" PRIx64 "\r\n"
+                    "Content-Length: %zu\r\n",
+                    entry->urlHash, bodyLen);
+  }
+  len += snprintf(reply->data + len, capacity - len, "Connection: %s\r\n\r\n",
+                  ctx->keepAlive ? "keep-alive" : "close");
+  reply->occupancy = len;
+  startPart(ctx, 0);
+}
 
-    int ret = pthread_mutex_lock((pthread_mutex_t *) &entry->dataMutex);
-    CHECK_RET("pthread_mutex_lock", ret);
-    while (1) {
-      curChunk = entry->dataChunks;
-      status   = entry->status;
-      if (status == Failed || curChunk != NULL) {
-        break;
-      }
+/**
+ * Gathers the unsent part of the prepared head and the committed body
+ * starting at @code chunk into @code out. Chunks followed by another one
+ * are complete, so their sizes stay as gathered
+ */
+static void gatherOutput(
+  ClientContextT *        ctx,
+  OutputVectorT *         out,
+  const CacheEntryChunkT *chunk
+) {
+  const BufferT *reply = ctx->reply;
+  OutputVectorT_reset(out);
+  if (ctx->headPrepared) {
+    OutputVectorT_add(
+      out, reply->data + ctx->replySent, reply->occupancy - ctx->replySent
+    );
+  }
+  if (ctx->skipLeft > 0) return;
+  size_t offset = ctx->chunkOffset;
+  size_t left   = ctx->partLeft;
+  for (const CacheEntryChunkT *cur = chunk; cur != NULL; cur = chunkNext(cur)) {
+    const size_t size = chunkSize(cur);
+    if (size <= offset || left == 0) break;
+    const size_t run = size - offset < left ? size - offset : left;
+    if (!OutputVectorT_add(out, cur->data + offset, run)) break;
+    left   -= run;
+    offset  = 0;
+  }
+}
 
-      ret = pthread_cond_wait(
-        (pthread_cond_t *) &entry->dataCond,
-        (pthread_mutex_t *) &entry->dataMutex
-      );
-      CHECK_RET("pthread_cond_wait", ret);
-    }
-    ret = pthread_mutex_unlock((pthread_mutex_t *) &entry->dataMutex);
-    CHECK_RET("pthread_mutex_unlock", ret);
-  }
-  return curChunk;
-}
-
-static size_t readSendIncomingData(
-  const volatile CacheEntryT *     cacheEntry,
-  const volatile CacheEntryChunkT *chunk,
-  const int                        clientSocket,
-  const size_t                     written) {
-  size_t curMaxWritten = written;
-  for (
-    size_t newMaxWritten = chunk->curDataSize;
-    chunk->next == NULL && newMaxWritten == written
-    && cacheEntry->status == InProcess;
-    newMaxWritten = chunk->curDataSize
-  ) {
-    int ret = pthread_mutex_lock((pthread_mutex_t *) &cacheEntry->dataMutex);
-    CHECK_RET("pthread_mutex_lock", ret);
-    for (
-      newMaxWritten = chunk->curDataSize;
-      chunk->next == NULL && newMaxWritten == written
-      && cacheEntry->status == InProcess;
-      newMaxWritten = chunk->curDataSize
-    ) {
-      ret = pthread_cond_wait(
-        (pthread_cond_t *) &cacheEntry->dataCond,
-        (pthread_mutex_t *) &cacheEntry->dataMutex
-      );
-      CHECK_RET("pthread_cond_wait", ret);
+/**
+ * moves head and body positions by @code sent bytes of gathered output
+ */
+static void advanceOutput(ClientContextT *ctx, size_t sent) {
+  ctx->totalSent += sent;
+  if (ctx->headPrepared) {
+    const size_t headLeft = ctx->reply->occupancy - ctx->replySent;
+    const size_t headSent = sent < headLeft ? sent : headLeft;
+    ctx->replySent += headSent;
+    sent           -= headSent;
+  }
+  if (ctx->partLeft != SIZE_MAX) {
+    ctx->partLeft -= sent;
+  }
+  while (sent > 0) {
+    const size_t chunkLeft = chunkSize(ctx->chunk) - ctx->chunkOffset;
+    if (sent < chunkLeft) {
+      ctx->chunkOffset += sent;
+      return;
     }
-    ret = pthread_mutex_unlock((pthread_mutex_t *) &cacheEntry->dataMutex);
-    CHECK_RET("pthread_mutex_unlock", ret);
-
-    errno = 0;
-    sendN(clientSocket, chunk->data + written, newMaxWritten - written);
-    if (errno != 0) {
-      logError("%s:%d sendN %s",__FILE__,__LINE__, strerror(errno));
-      return curMaxWritten;
+    sent -= chunkLeft;
+    ctx->chunkOffset += chunkLeft;
+    if (sent > 0) {
+      ClientContextT_nextChunk(ctx);
     }
-    curMaxWritten = newMaxWritten;
   }
-  return curMaxWritten;
 }
 
-static int readDataFromChunks(
-  const int clientSocket, volatile CacheEntryT *cacheEntry
-) {
-  for (
-    const volatile CacheEntryChunkT *chunk = cacheEntry->dataChunks;
-    chunk != NULL && cacheEntry->status != Failed;
-    chunk = chunk->next
-  ) {
-    size_t maxWritten = 0;
-    while (chunk->next == NULL && cacheEntry->status == InProcess) {
-      const size_t newMaxWritten = readSendIncomingData(
-        cacheEntry, chunk, clientSocket, maxWritten
+/**
+ * sends everything which is already committed to entry and subscribes
+ * for the rest, the data is read without locks. The head and several
+ * chunks go out with one `sendmsg`, long runs of a memfd backed chunk
+ * with `sendfile`
+ */
+static void sendEntry(ClientContextT *ctx) {
+  CacheEntryT *entry = ctx->entry;
+  for (int sends = 0; sends < CLIENT_SENDS_PER_EVENT;) {
+    /*
+     * status first: once it is final, all data is visible
+     */
+    const CacheStatusT status = atomic_load_explicit(
+      &entry->status, memory_order_acquire
+    );
+    const size_t committed = atomic_load_explicit(
+      &entry->downloadedSize, memory_order_acquire
+    );
+    if (ctx->chunk == NULL) {
+      ctx->chunk = atomic_load_explicit(
+        &entry->dataChunks, memory_order_acquire
       );
-      if (errno != 0) {
-        return ERROR;
+    }
+    const CacheEntryChunkT *chunk     = ctx->chunk;
+    const size_t            available = chunk != NULL ? chunkSize(chunk) : 0;
+    if (status != InProcess && atomic_load(&entry->servesStale)) {
+      /*
+       * the stale entry is confirmed or outlives an origin failure, it is
+       * served instead
+       */
+      CacheEntryT *stale = entry->revalidates;
+      CacheEntryT_acquire(stale);
+      ClientContextT_dropEntry(ctx);
+      ClientContextT_setEntry(ctx, stale);
+      entry = stale;
+      continue;
+    }
+    if (atomic_load(&entry->notCacheable) && !ctx->ownsUpload) {
+      logDebug("%s:%d %s is not cacheable, fetching it separately",
+               __FILE__, __LINE__, entry->url);
+      ClientContextT_dropEntry(ctx);
+      ctx->bypassCache = true;
+      /*
+       * the head was valid, parsing it again only restores the slices
+       */
+      HttpRequestT request;
+      size_t       scanned = 0;
+      HttpRequestT_parse(
+        &request, ctx->buffer->data, ctx->requestLen, &scanned
+      );
+      handleRequest(ctx, &request);
+      return;
+    }
+    if (!ctx->headPrepared && available > 0) {
+      if (isNotModified(ctx, entry)) {
+        replyNotModified(ctx, entry);
+        return;
       }
-      maxWritten = newMaxWritten;
+      if (!resolveRanges(ctx, entry, available, status)) {
+        replyRangeNotSatisfiable(ctx, ctx->rangeTotal);
+        return;
+      }
+      /*
+       * the head is immutable once committed
+       */
+      if (ctx->rangesQ > 0) {
+        prepareRangeHead(ctx, chunk->data);
+      } else {
+        prepareHead(ctx, chunk->data, available, entry->headLen, status);
+      }
+      continue;
     }
-
-    if (cacheEntry->status == Failed) return ERROR;
-    if (maxWritten != chunk->curDataSize) {
-      const size_t sent = sendN(
-        clientSocket, chunk->data + maxWritten, chunk->curDataSize - maxWritten
+    if (ctx->skipLeft > 0 && chunk != NULL && ctx->chunkOffset < available) {
+      /*
+       * seeking to the range, only data up to it is waited for
+       */
+      const size_t run     = available - ctx->chunkOffset;
+      const size_t skipped = run < ctx->skipLeft ? run : ctx->skipLeft;
+      ctx->chunkOffset += skipped;
+      ctx->skipLeft    -= skipped;
+      continue;
+    }
+    if (chunk != NULL && ctx->chunkOffset == available
+        && chunkNext(chunk) != NULL) {
+      ClientContextT_nextChunk(ctx);
+      continue;
+    }
+    const bool headPending = ctx->headPrepared
+                             && ctx->replySent < ctx->reply->occupancy;
+    if (ctx->rangesQ > 0 && ctx->partLeft == 0 && !headPending) {
+      /*
+       * a range is over regardless of the download
+       */
+      if (ctx->rangeIndex == ctx->rangesQ) {
+        ClientContextT_finishResponse(ctx);
+        return;
+      }
+      nextPart(ctx);
+      continue;
+    }
+    if (!headPending && (chunk == NULL || ctx->chunkOffset == available)) {
+      if (status == InProcess) {
+        if (!CacheEntryT_subscribe(entry, &ctx->waiter, committed, status)) {
+          continue;
+        }
+        return;
+      }
+      logInfo(
+        "client %d receive data with status %d", ctx->handler.fd, status
       );
-      if (errno != 0) {
-        logError("%s:%d sendN %s",__FILE__,__LINE__, strerror(errno));
-        return ERROR;
+      if (status == Failed && ctx->totalSent == 0) {
+        replyError(ctx, BadGatewayStatus, FailedToConnectRemoteServer);
+        return;
       }
-      if (sent == 0) {
-        return SUCCESS;
+      if (status == Failed) {
+        ClientContextT_close(ctx);
+        return;
       }
+      ClientContextT_finishResponse(ctx);
+      return;
     }
-  }
 
-  logInfo(
-    "client %d receive data with status %d",
-    clientSocket, cacheEntry->status
-  );
+    OutputVectorT out;
+    const size_t  run         = available - ctx->chunkOffset < ctx->partLeft
+                                  ? available - ctx->chunkOffset
+                                  : ctx->partLeft;
+    const bool    useSendfile = !headPending
+                                && chunk->fd >= 0
+                                && run >= CLIENT_SENDFILE_MIN;
+    if (!useSendfile) {
+      gatherOutput(ctx, &out, chunk);
+    }
 
-  if (cacheEntry->status == Failed) {
-    return ERROR;
+    const ssize_t sent = useSendfile
+                           ? CacheEntryChunkT_send(
+                             chunk,
+                             ctx->handler.fd,
+                             ctx->chunkOffset,
+                             run
+                           )
+                           : OutputVectorT_send(&out, ctx->handler.fd);
+    if (sent < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        EventLoopT_armTimer(
+          ctx->worker->loop, &ctx->timer, CLIENT_IDLE_TIMEOUT
+        );
+        return;
+      }
+      logError("%s:%d send %s", __FILE__, __LINE__, strerror(errno));
+      ClientContextT_close(ctx);
+      return;
+    }
+    EventLoopT_disarmTimer(ctx->worker->loop, &ctx->timer);
+    advanceOutput(ctx, sent);
+    ++sends;
   }
-  return SUCCESS;
+  EventLoopT_post(ctx->worker->loop, &ctx->handler);
+}
+
+static void onEntryUpdated(CacheEntryWaiterT *waiter) {
+  ClientContextT *ctx = CONTAINER_OF(waiter, ClientContextT, waiter);
+  EventLoopT_post(ctx->worker->loop, &ctx->handler);
 }
 
-int readAndSendFromCache(const int clientSocket, CacheNodeT *node) {
-  waitFirstChunkData(node);
-  int                              retVal     = SUCCESS;
-  const volatile CacheEntryChunkT *firstChunk = waitFirstChunk(node);
-  if (firstChunk != NULL) {
-    retVal = readDataFromChunks(clientSocket, node->entry);
+static void sendWithCachingIfNecessary(
+  ClientContextT *ctx,
+  const char *    host,
+  const int       port,
+  const char *    path,
+  const char *    url
+) {
+  CacheManagerT *cacheManager = ctx->worker->cacheManager;
+  bool           created      = false;
+  CacheEntryT *  refresh      = NULL;
+  CacheEntryT *  entry        = CacheManagerT_getOrCreate_CacheEntryT(
+    cacheManager, url, &created, &refresh
+  );
+  if (entry == NULL) {
+    replyError(ctx, InternalErrorStatus, "");
+    return;
   }
-  if (retVal == ERROR) {
-    logError("xyi");
+  if (refresh != NULL) {
+    /*
+     * the stale entry is served now, the upload refreshes it in background
+     */
+    UploadContextT_start(ctx->worker, refresh, host, port, path, ctx->buffer);
+    if (CacheEntryT_release(refresh)) {
+      CacheEntryT_delete(refresh);
+    }
   }
-  logInfo("client with socket : %d finished", clientSocket);
-  return retVal;
+
+  ClientContextT_setEntry(ctx, entry);
+  ctx->ownsUpload = created;
+  ctx->state      = ClientSendingEntry;
+  if (created) {
+    UploadContextT_start(ctx->worker, entry, host, port, path, ctx->buffer);
+  }
+  EventLoopT_disarmTimer(ctx->worker->loop, &ctx->timer);
+  sendEntry(ctx);
 }
 
-int sendWithCachingIfNecessary(
-  CacheManagerT *cacheManager,
-  BufferT *      buffer,
-  const char *   host,
-  const int      port,
-  const int      clientSocket,
-  const char *   url
+/**
+ * Cache key of the origin resource: scheme, lower case host, port only if
+ * it is not the default one
+ */
+static void formatUrl(
+  char *url, const char *host, const int port, const char *path
 ) {
-  int ret = pthread_mutex_lock(&cacheManager->entriesMutex);
-  CHECK_RET("pthread_mutex_lock", ret);
+  if (port == DEF_HTTP_PORT) {
+    snprintf(url, URL_MAX_LEN, "http://%s/%s", host, path);
+  } else {
+    snprintf(url, URL_MAX_LEN, "http://%s:%d/%s", host, port, path);
+  }
+}
+
+/**
+ * the socket leaves the context for a tunnel, what the client sent after
+ * the head goes to origin
+ */
+static void startTunnel(ClientContextT *ctx, const HttpRequestT *request) {
+  char host[HOST_MAX_LEN];
+  int  port;
+  if (HttpRequestT_tunnelTarget(request, host, &port) != SUCCESS) {
+    logError("%s, %d bad tunnel target %.*s", __FILE__, __LINE__,
+             (int) request->target.len, request->target.data);
+    ctx->keepAlive = false;
+    replyError(ctx, BadRequestStatus, InvalidRequestMessage);
+    return;
+  }
+  ProxyWorkerT *worker = ctx->worker;
+  BufferT *     buffer = ctx->buffer;
+  const size_t  head   = ctx->requestLen;
+  ctx->buffer          = NULL;
+  const int fd         = ClientContextT_handOver(ctx);
+  UploadContextT_startTunnel(
+    worker, fd, host, port, buffer->data + head, buffer->occupancy - head
+  );
+  BufferPoolT_release(worker->bufferPool, buffer);
+}
 
-  CacheNodeT *node = CacheManagerT_get_CacheNodeT(cacheManager, url);
+/**
+ * parse results live on the stack, serving a cached response allocates
+ * nothing
+ */
+static void handleRequest(ClientContextT *ctx, const HttpRequestT *request) {
+  char url[URL_MAX_LEN];
+  char host[HOST_MAX_LEN];
+  char path[PATH_MAX_LEN];
 
-  if (node == NULL) {
-    int responseStatus = 0;
+  int port;
+  if (HttpSliceT_equals(&request->method, "CONNECT")) {
+    startTunnel(ctx, request);
+    return;
+  }
+  if (HttpRequestT_route(request, host, &port, path) != SUCCESS) {
+    logError("%s, %d failed to route %.*s", __FILE__, __LINE__,
+             (int) request->target.len, request->target.data);
+    replyError(ctx, BadRequestStatus, InvalidRequestMessage);
+    return;
+  }
 
-    node = startDataUpload(
-      buffer, host, port, clientSocket, url, &responseStatus
+  if (ableForCashing(request) && !ctx->bypassCache) {
+    const HttpSliceT *ifNoneMatch = HttpRequestT_header(
+      request, "If-None-Match"
     );
-    if (node == NULL) {
-      int retval = 0;
-      if (responseStatus < 0) {
-        retval = errno;
-      } else if (responseStatus != SUCCESS_STATUS) {
-        retval = 0;
-      }
+    const HttpSliceT *ifModifiedSince = HttpRequestT_header(
+      request, "If-Modified-Since"
+    );
+    ctx->ifNoneMatch     = ifNoneMatch != NULL ? *ifNoneMatch
+                                               : (HttpSliceT) {NULL, 0};
+    ctx->ifModifiedSince = ifModifiedSince != NULL ? *ifModifiedSince
+                                                   : (HttpSliceT) {NULL, 0};
+    const HttpSliceT *range   = HttpRequestT_header(request, "Range");
+    const HttpSliceT *ifRange = HttpRequestT_header(request, "If-Range");
+    ctx->range   = range != NULL ? *range : (HttpSliceT) {NULL, 0};
+    ctx->ifRange = ifRange != NULL ? *ifRange : (HttpSliceT) {NULL, 0};
+    formatUrl(url, host, port, path);
+    sendWithCachingIfNecessary(ctx, host, port, path, url);
+    return;
+  }
+  /*
+   * the request goes to origin from the buffer, which outlives the context
+   */
+  ProxyWorkerT *worker = ctx->worker;
+  BufferT *     buffer = ctx->buffer;
+  ctx->buffer          = NULL;
+  const int fd         = ClientContextT_handOver(ctx);
+  UploadContextT_startRelay(worker, fd, host, port, path, buffer);
+  BufferPoolT_release(worker->bufferPool, buffer);
+}
 
-      ret = pthread_mutex_unlock(&cacheManager->entriesMutex);
-      CHECK_RET("pthread_mutex_unlock", ret);
-      return retval;
-    }
+/**
+ * decides if the connection outlives @code request
+ */
+static void parsePersistence(
+  ClientContextT *ctx, const HttpRequestT *request
+) {
+  ctx->http11 = request->minorVersion >= 1;
 
-    CacheManagerT_put_CacheNodeT(cacheManager, node);
+  const HttpSliceT *connection = HttpRequestT_header(request, "Connection");
+  if (connection == NULL) {
+    connection = HttpRequestT_header(request, "Proxy-Connection");
+  }
+  bool keepAlive = ctx->http11;
+  if (connection != NULL) {
+    keepAlive = ctx->http11
+                  ? !findHeaderDirective(
+                    connection->data, connection->len, "close", NULL
+                  )
+                  : findHeaderDirective(
+                    connection->data, connection->len, "keep-alive", NULL
+                  );
   }
+  /*
+   * the stream after a request body is not parsed, such requests are
+   * relayed and the connection ends with them
+   */
+  if (hasBody(request)) {
+    keepAlive = false;
+  }
+  ++ctx->requestsServed;
+  ctx->keepAlive = keepAlive
+                   && ctx->requestsServed
+                      < ctx->worker->config->clientMaxRequests;
+}
 
-  CacheEntryT_acquire(node->entry);
-  ret = pthread_mutex_unlock(&cacheManager->entriesMutex);
-  CHECK_RET("pthread_mutex_lock", ret);
+static void readRequest(ClientContextT *ctx) {
+  BufferT *buffer = ctx->buffer;
+  while (1) {
+    HttpRequestT  request;
+    const ssize_t headLen = HttpRequestT_parse(
+      &request, buffer->data, buffer->occupancy, &ctx->scannedLen
+    );
+    if (headLen == ERROR) {
+      logError("%s:%d malformed request head", __FILE__, __LINE__);
+      ctx->keepAlive = false;
+      replyError(ctx, BadRequestStatus, InvalidRequestMessage);
+      return;
+    }
+    if (headLen > 0) {
+      ctx->requestLen = headLen;
+      parsePersistence(ctx, &request);
+      handleRequest(ctx, &request);
+      return;
+    }
+    if (buffer->occupancy >= buffer->maxSize - 1) {
+      logError("%s:%d request headers are too large", __FILE__, __LINE__);
+      ctx->keepAlive = false;
+      replyError(ctx, BadRequestStatus, InvalidRequestMessage);
+      return;
+    }
+    const ssize_t readed = recv(
+      ctx->handler.fd,
+      buffer->data + buffer->occupancy,
+      buffer->maxSize - buffer->occupancy - 1,
+      0
+    );
+    if (readed < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+      logError("%s:%d failed to read request %s",
+               __FILE__, __LINE__, strerror(errno));
+      ClientContextT_close(ctx);
+      return;
+    }
+    if (readed == 0) {
+      ClientContextT_close(ctx);
+      return;
+    }
+    logDebug("%s:%d recv bytesRead = %zd", __FILE__, __LINE__, readed);
 
-  const int retValue = readAndSendFromCache(clientSocket, node);
-  CacheEntryT_release(node->entry);
-  return retValue;
+    buffer->occupancy += readed;
+    buffer->data[buffer->occupancy] = '\0';
+  }
 }
 
-void handleConnection(CacheManagerT *cacheManager,
-                      BufferT *      buffer,
-                      const int      clientSocket
+static void onClientEvent(
+  EventLoopT *loop, EventHandlerT *handler, const uint32_t events
 ) {
-  char      protocol[PROTOCOL_MAX_LEN];
-  char      method[METHOD_MAX_LEN];
-  char *    url       = NULL;
-  char *    host      = NULL;
-  char *    path      = NULL;
-  const int bytesRead = recvNWithTimeout(
-    clientSocket, buffer->data, buffer->maxSize - 1, SEND_RECV_TIMEOUT
-  );
-  if (bytesRead <= 0) {
-    logError("%s:%d failed to read request %s",
-             __FILE__, __LINE__, strerror(errno));
-    goto notifyInternalError;
-  }
-  logDebug("%s:%d recvN bytesRead = %d", __FILE__, __LINE__, bytesRead);
-  buffer->occupancy       = bytesRead;
-  buffer->data[bytesRead] = '\0';
-  url                     = malloc(URL_MAX_LEN * sizeof(*url));
-  host                    = malloc(URL_MAX_LEN * sizeof(*host));
-  path                    = malloc(URL_MAX_LEN * sizeof(*path));
-  if (url == NULL || host == NULL || path == NULL) {
-    logError("%s:%d failed to allocate memory",
+  (void) loop;
+  ClientContextT *ctx = CONTAINER_OF(handler, ClientContextT, handler);
+  if (events & (EPOLLERR | EPOLLHUP)) {
+    ClientContextT_close(ctx);
+    return;
+  }
+
+  switch (ctx->state) {
+    case ClientReadingRequest:
+      if (events & (EPOLLIN | EPOLLRDHUP | EVENT_LOOP_POSTED)) {
+        readRequest(ctx);
+      }
+      break;
+    case ClientSendingEntry:
+      if (events & (EPOLLOUT | EVENT_LOOP_POSTED)) {
+        sendEntry(ctx);
+      }
+      break;
+    case ClientSendingReply:
+      if (events & EPOLLOUT) {
+        flushReply(ctx);
+      }
+      break;
+  }
+}
+
+static void onClientTimeout(EventLoopT *loop, EventTimerT *timer) {
+  (void) loop;
+  ClientContextT *ctx = CONTAINER_OF(timer, ClientContextT, timer);
+  logInfo("client with socket : %d timed out", ctx->handler.fd);
+  ClientContextT_close(ctx);
+}
+
+void ClientContextT_start(ProxyWorkerT *worker, const int clientSocket) {
+  ClientContextT *ctx = malloc(sizeof(*ctx));
+  if (ctx == NULL) {
+    logError("%s:%d ClientContextT malloc error: %s",
              __FILE__, __LINE__, strerror(errno));
-    goto notifyInternalError;
+    sendError(clientSocket, InternalErrorStatus, "");
+    close(clientSocket);
+    return;
   }
+  memset(ctx, 0, sizeof(*ctx));
+  ctx->worker          = worker;
+  ctx->state           = ClientReadingRequest;
+  ctx->handler.fd      = clientSocket;
+  ctx->handler.onEvent = onClientEvent;
+  ctx->waiter.notify   = onEntryUpdated;
+  EventTimerT_init(&ctx->timer, onClientTimeout);
 
-  int port;
-  sscanf(buffer->data, "%s %s %s", method, url, protocol);
-  const int ret = parseURL(url, host, path, &port);
-  if (ret != SUCCESS) {
-    logError("%s, %d failed to parse URL %s",__FILE__, __LINE__, url);
-    sendError(clientSocket, BadRequestStatus, InvalidRequestMessage);
+  ctx->buffer = BufferPoolT_acquire(worker->bufferPool, BUFFER_SIZE);
+  ctx->reply  = BufferPoolT_acquire(
+    worker->bufferPool, BUFFER_SIZE + RESPONSE_HEAD_RESERVE
+  );
+  if (ctx->buffer == NULL || ctx->reply == NULL) {
+    logError("%s:%d failed to allocate buffer %s",
+             __FILE__, __LINE__, strerror(errno));
+    sendError(clientSocket, InternalErrorStatus, "");
     goto destroyContext;
   }
 
-  if (ableForCashing(method)) {
-    sendWithCachingIfNecessary(cacheManager, buffer, host, port, clientSocket,
-                               url);
-  } else {
-    // todo
+  const int ret = EventLoopT_add(
+    worker->loop, &ctx->handler, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET
+  );
+  if (ret != SUCCESS) {
+    logError("%s:%d EventLoopT_add %s", __FILE__, __LINE__, strerror(errno));
+    goto destroyContext;
   }
+  EventLoopT_armTimer(worker->loop, &ctx->timer, CLIENT_IDLE_TIMEOUT);
+  return;
 
-notifyInternalError:
-  sendError(clientSocket, InternalErrorStatus, "");
 destroyContext:
-  free(url);
-  free(host);
-  free(path);
+  BufferPoolT_release(ctx->worker->bufferPool, ctx->buffer);
+  BufferPoolT_release(ctx->worker->bufferPool, ctx->reply);
+  close(clientSocket);
+  free(ctx);
 }
 
 BufferT *BufferT_new(const size_t maxOccupancy) {
@@ -435,7 +1216,9 @@ BufferT *BufferT_new(const size_t maxOccupancy) {
     free(buffer);
     return NULL;
   }
-  buffer->maxSize = maxOccupancy;
+  buffer->occupancy = 0;
+  buffer->maxSize   = maxOccupancy;
+  buffer->capacity  = maxOccupancy;
   return buffer;
 }
 
@@ -0,0 +1,342 @@
+#include "event_loop.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "proxy.h"
+#include "../utils/log.h"
+
+#define TIMERS_INITIAL_CAPACITY 64
+#define MAX_WAIT_MS 1000
+
+uint64_t EventLoopT_nowMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+EventLoopT *EventLoopT_new() {
+  EventLoopT *loop = malloc(sizeof(*loop));
+  if (loop == NULL) {
+    return NULL;
+  }
+  memset(loop, 0, sizeof(*loop));
+
+  loop->epollFd = epoll_create1(EPOLL_CLOEXEC);
+  if (loop->epollFd < 0) {
+    logError("%s:%d epoll_create1 %s", __FILE__, __LINE__, strerror(errno));
+    goto destroyAtMalloc;
+  }
+  loop->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (loop->wakeFd < 0) {
+    logError("%s:%d eventfd %s", __FILE__, __LINE__, strerror(errno));
+    goto destroyAtEpoll;
+  }
+
+  struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+  if (epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, loop->wakeFd, &event) < 0) {
+    logError("%s:%d epoll_ctl %s", __FILE__, __LINE__, strerror(errno));
+    goto destroyAtEventFd;
+  }
+
+  loop->timers = malloc(TIMERS_INITIAL_CAPACITY * sizeof(*loop->timers));
+  if (loop->timers == NULL) {
+    goto destroyAtEventFd;
+  }
+  loop->timersCapacity = TIMERS_INITIAL_CAPACITY;
+
+  const int ret = pthread_mutex_init(&loop->postMutex, NULL);
+  CHECK_RET("pthread_mutex_init", ret);
+  return loop;
+
+destroyAtEventFd:
+  close(loop->wakeFd);
+destroyAtEpoll:
+  close(loop->epollFd);
+destroyAtMalloc:
+  free(loop->timers);
+  free(loop);
+  return NULL;
+}
+
+void EventLoopT_delete(EventLoopT *loop) {
+  if (loop == NULL) return;
+  close(loop->wakeFd);
+  close(loop->epollFd);
+  pthread_mutex_destroy(&loop->postMutex);
+  free(loop->timers);
+  free(loop);
+}
+
+int EventLoopT_add(
+  EventLoopT *loop, EventHandlerT *handler, const uint32_t events
+) {
+  struct epoll_event event = {.events = events, .data.ptr = handler};
+  if (epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, handler->fd, &event) < 0) {
+    return ERROR;
+  }
+  return SUCCESS;
+}
+
+int EventLoopT_modify(
+  EventLoopT *loop, EventHandlerT *handler, const uint32_t events
+) {
+  struct epoll_event event = {.events = events, .data.ptr = handler};
+  if (epoll_ctl(loop->epollFd, EPOLL_CTL_MOD, handler->fd, &event) < 0) {
+    return ERROR;
+  }
+  return SUCCESS;
+}
+
+void EventLoopT_remove(EventLoopT *loop, EventHandlerT *handler) {
+  epoll_ctl(loop->epollFd, EPOLL_CTL_DEL, handler->fd, NULL);
+  for (int i = loop->dispatchedIndex + 1; i < loop->dispatchedQ; ++i) {
+    if (loop->dispatched[i].data.ptr == handler) {
+      loop->dispatched[i].data.ptr = NULL;
+      loop->dispatched[i].events   = 0;
+    }
+  }
+}
+
+void EventLoopT_post(EventLoopT *loop, EventHandlerT *handler) {
+  int ret = pthread_mutex_lock(&loop->postMutex);
+  CHECK_RET("pthread_mutex_lock", ret);
+
+  const bool wasEmpty = loop->postedHead == NULL;
+  if (!handler->posted) {
+    handler->posted     = true;
+    handler->nextPosted = NULL;
+    if (loop->postedTail == NULL) {
+      loop->postedHead = handler;
+    } else {
+      loop->postedTail->nextPosted = handler;
+    }
+    loop->postedTail = handler;
+  }
+
+  ret = pthread_mutex_unlock(&loop->postMutex);
+  CHECK_RET("pthread_mutex_unlock", ret);
+
+  if (wasEmpty) {
+    const uint64_t one = 1;
+    if (write(loop->wakeFd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+      logError("%s:%d eventfd write %s", __FILE__, __LINE__, strerror(errno));
+    }
+  }
+}
+
+void EventLoopT_cancelPost(EventLoopT *loop, EventHandlerT *handler) {
+  int ret = pthread_mutex_lock(&loop->postMutex);
+  CHECK_RET("pthread_mutex_lock", ret);
+
+  if (handler->posted) {
+    EventHandlerT *prev = NULL;
+    for (EventHandlerT *cur = loop->postedHead; cur != NULL;
+         cur                = cur->nextPosted) {
+      if (cur != handler) {
+        prev = cur;
+        continue;
+      }
+      if (prev == NULL) {
+        loop->postedHead = cur->nextPosted;
+      } else {
+        prev->nextPosted = cur->nextPosted;
+      }
+      if (loop->postedTail == cur) {
+        loop->postedTail = prev;
+      }
+      break;
+    }
+    handler->posted = false;
+  }
+
+  ret = pthread_mutex_unlock(&loop->postMutex);
+  CHECK_RET("pthread_mutex_unlock", ret);
+}
+
+/**
+ * delivers at most the number of handlers queued at the moment of the call,
+ * so a handler re-posting itself cannot starve sockets
+ */
+static void runPosted(EventLoopT *loop) {
+  uint64_t counter;
+  while (read(loop->wakeFd, &counter, sizeof(counter)) > 0) {}
+
+  int ret = pthread_mutex_lock(&loop->postMutex);
+  CHECK_RET("pthread_mutex_lock", ret);
+  size_t pending = 0;
+  for (EventHandlerT *cur = loop->postedHead; cur != NULL;
+       cur                = cur->nextPosted) {
+    ++pending;
+  }
+  ret = pthread_mutex_unlock(&loop->postMutex);
+  CHECK_RET("pthread_mutex_unlock", ret);
+
+  for (; pending > 0; --pending) {
+    ret = pthread_mutex_lock(&loop->postMutex);
+    CHECK_RET("pthread_mutex_lock", ret);
+    EventHandlerT *handler = loop->postedHead;
+    if (handler != NULL) {
+      loop->postedHead = handler->nextPosted;
+      if (loop->postedHead == NULL) {
+        loop->postedTail = NULL;
+      }
+      handler->posted = false;
+    }
+    ret = pthread_mutex_unlock(&loop->postMutex);
+    CHECK_RET("pthread_mutex_unlock", ret);
+
+    if (handler == NULL) break;
+    handler->onEvent(loop, handler, EVENT_LOOP_POSTED);
+  }
+
+  ret = pthread_mutex_lock(&loop->postMutex);
+  CHECK_RET("pthread_mutex_lock", ret);
+  const bool hasMore = loop->postedHead != NULL;
+  ret = pthread_mutex_unlock(&loop->postMutex);
+  CHECK_RET("pthread_mutex_unlock", ret);
+  if (hasMore) {
+    const uint64_t one = 1;
+    write(loop->wakeFd, &one, sizeof(one));
+  }
+}
+
+static void timersSwap(EventLoopT *loop, const size_t a, const size_t b) {
+  EventTimerT *tmp = loop->timers[a];
+  loop->timers[a]  = loop->timers[b];
+  loop->timers[b]  = tmp;
+  loop->timers[a]->heapIndex = a;
+  loop->timers[b]->heapIndex = b;
+}
+
+static void timersSiftUp(EventLoopT *loop, size_t index) {
+  while (index > 0) {
+    const size_t parent = (index - 1) / 2;
+    if (loop->timers[parent]->deadline <= loop->timers[index]->deadline) {
+      break;
+    }
+    timersSwap(loop, parent, index);
+    index = parent;
+  }
+}
+
+static void timersSiftDown(EventLoopT *loop, size_t index) {
+  while (1) {
+    const size_t left     = index * 2 + 1;
+    const size_t right    = left + 1;
+    size_t       smallest = index;
+    if (left < loop->timersSize
+        && loop->timers[left]->deadline < loop->timers[smallest]->deadline) {
+      smallest = left;
+    }
+    if (right < loop->timersSize
+        && loop->timers[right]->deadline < loop->timers[smallest]->deadline) {
+      smallest = right;
+    }
+    if (smallest == index) break;
+    timersSwap(loop, index, smallest);
+    index = smallest;
+  }
+}
+
+void EventTimerT_init(EventTimerT *timer, const TimerCallbackT onTimeout) {
+  timer->deadline  = 0;
+  timer->heapIndex = EVENT_TIMER_DISARMED;
+  timer->onTimeout = onTimeout;
+}
+
+void EventLoopT_disarmTimer(EventLoopT *loop, EventTimerT *timer) {
+  const size_t index = timer->heapIndex;
+  if (index == EVENT_TIMER_DISARMED) return;
+
+  timer->heapIndex = EVENT_TIMER_DISARMED;
+  --loop->timersSize;
+  if (index == loop->timersSize) return;
+
+  loop->timers[index]            = loop->timers[loop->timersSize];
+  loop->timers[index]->heapIndex = index;
+  timersSiftUp(loop, index);
+  timersSiftDown(loop, loop->timers[index]->heapIndex);
+}
+
+void EventLoopT_armTimer(
+  EventLoopT *loop, EventTimerT *timer, const long timeoutMs
+) {
+  EventLoopT_disarmTimer(loop, timer);
+  if (loop->timersSize == loop->timersCapacity) {
+    const size_t  newCapacity = loop->timersCapacity * 2;
+    EventTimerT **tmp         = realloc(
+      loop->timers, newCapacity * sizeof(*loop->timers)
+    );
+    if (tmp == NULL) {
+      logFatal("%s:%d timers realloc %s", __FILE__, __LINE__, strerror(errno));
+      abort();
+    }
+    loop->timers         = tmp;
+    loop->timersCapacity = newCapacity;
+  }
+  timer->deadline                 = EventLoopT_nowMs() + timeoutMs;
+  timer->heapIndex                = loop->timersSize;
+  loop->timers[loop->timersSize++] = timer;
+  timersSiftUp(loop, timer->heapIndex);
+}
+
+static int nextTimeout(const EventLoopT *loop) {
+  if (loop->timersSize == 0) return MAX_WAIT_MS;
+  const uint64_t now      = EventLoopT_nowMs();
+  const uint64_t deadline = loop->timers[0]->deadline;
+  if (deadline <= now) return 0;
+  return deadline - now < MAX_WAIT_MS ? (int) (deadline - now) : MAX_WAIT_MS;
+}
+
+static void runTimers(EventLoopT *loop) {
+  const uint64_t now = EventLoopT_nowMs();
+  while (loop->timersSize > 0 && loop->timers[0]->deadline <= now) {
+    EventTimerT *timer = loop->timers[0];
+    EventLoopT_disarmTimer(loop, timer);
+    timer->onTimeout(loop, timer);
+  }
+}
+
+void EventLoopT_run(EventLoopT *loop) {
+  struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+  while (!loop->stopped) {
+    const int ready = epoll_wait(
+      loop->epollFd, events, EVENT_LOOP_MAX_EVENTS, nextTimeout(loop)
+    );
+    if (ready < 0) {
+      if (errno == EINTR) continue;
+      logFatal("%s:%d epoll_wait %s", __FILE__, __LINE__, strerror(errno));
+      abort();
+    }
+
+    bool wake = false;
+    loop->dispatched  = events;
+    loop->dispatchedQ = ready;
+    for (int i = 0; i < ready; ++i) {
+      loop->dispatchedIndex  = i;
+      EventHandlerT *handler = events[i].data.ptr;
+      if (handler == NULL) {
+        wake = wake || events[i].events != 0;
+        continue;
+      }
+      handler->onEvent(loop, handler, events[i].events);
+    }
+    loop->dispatchedQ = 0;
+    if (wake) {
+      runPosted(loop);
+    }
+    runTimers(loop);
+  }
+}
+
+void EventLoopT_stop(EventLoopT *loop) {
+  loop->stopped = true;
+  const uint64_t one = 1;
+  write(loop->wakeFd, &one, sizeof(one));
+}
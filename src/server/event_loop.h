@@ -0,0 +1,114 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+
+/**
+ * Extra event bit delivered to @code EventHandlerT.onEvent when the handler
+ * was scheduled through @code EventLoopT_post. Does not overlap EPOLL* bits.
+ */
+#define EVENT_LOOP_POSTED   (1u << 26)
+#define EVENT_LOOP_MAX_EVENTS 256
+#define EVENT_TIMER_DISARMED SIZE_MAX
+
+typedef struct EventLoop    EventLoopT;
+typedef struct EventHandler EventHandlerT;
+typedef struct EventTimer   EventTimerT;
+
+typedef void (*EventCallbackT)(
+  EventLoopT *loop, EventHandlerT *handler, uint32_t events
+);
+
+typedef void (*TimerCallbackT)(EventLoopT *loop, EventTimerT *timer);
+
+/**
+ * Embedded as the first member of every object registered in the loop,
+ * `epoll_event.data.ptr` points to it
+ */
+struct EventHandler {
+  int            fd;
+  EventCallbackT onEvent;
+  EventHandlerT *nextPosted;
+  bool           posted;
+};
+
+struct EventTimer {
+  uint64_t       deadline;
+  size_t         heapIndex;
+  TimerCallbackT onTimeout;
+};
+
+struct EventLoop {
+  int epollFd;
+  int wakeFd;
+
+  pthread_mutex_t postMutex;
+  EventHandlerT * postedHead;
+  EventHandlerT * postedTail;
+
+  EventTimerT **timers;
+  size_t        timersSize;
+  size_t        timersCapacity;
+
+  /**
+   * batch being dispatched, removed handlers are dropped from its tail
+   */
+  struct epoll_event *dispatched;
+  int                 dispatchedIndex;
+  int                 dispatchedQ;
+
+  volatile bool stopped;
+};
+
+EventLoopT *EventLoopT_new();
+
+void EventLoopT_delete(EventLoopT *loop);
+
+/**
+ * @return `SUCCESS` or `ERROR` with errno set
+ */
+int EventLoopT_add(EventLoopT *loop, EventHandlerT *handler, uint32_t events);
+
+int EventLoopT_modify(
+  EventLoopT *loop, EventHandlerT *handler, uint32_t events
+);
+
+/**
+ * also drops events of @code handler still pending in the current batch,
+ * so it may be freed right after
+ */
+void EventLoopT_remove(EventLoopT *loop, EventHandlerT *handler);
+
+/**
+ * Thread safe. Schedules @code handler->onEvent with @code EVENT_LOOP_POSTED
+ * on the loop thread, repeated posts before delivery are merged
+ */
+void EventLoopT_post(EventLoopT *loop, EventHandlerT *handler);
+
+/**
+ * Must be called from the loop thread before @code handler is freed
+ */
+void EventLoopT_cancelPost(EventLoopT *loop, EventHandlerT *handler);
+
+void EventTimerT_init(EventTimerT *timer, TimerCallbackT onTimeout);
+
+/**
+ * (re)arms @code timer to fire after @code timeoutMs, loop thread only
+ */
+void EventLoopT_armTimer(EventLoopT *loop, EventTimerT *timer, long timeoutMs);
+
+void EventLoopT_disarmTimer(EventLoopT *loop, EventTimerT *timer);
+
+uint64_t EventLoopT_nowMs();
+
+/**
+ * runs until @code EventLoopT_stop
+ */
+void EventLoopT_run(EventLoopT *loop);
+
+void EventLoopT_stop(EventLoopT *loop);
+
+#endif //EVENT_LOOP_H
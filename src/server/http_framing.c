@@ -0,0 +1,164 @@
+#include "proxy.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define HTTP_STATUS_NO_CONTENT   204
+#define HTTP_STATUS_NOT_MODIFIED 304
+
+void BodyFramingT_init(
+  BodyFramingT *framing,
+  const char *  head,
+  const size_t  headLen,
+  const int     statusCode
+) {
+  memset(framing, 0, sizeof(*framing));
+  size_t valueLen = 0;
+
+  if (statusCode < 200
+      || statusCode == HTTP_STATUS_NO_CONTENT
+      || statusCode == HTTP_STATUS_NOT_MODIFIED) {
+    framing->kind = BodyFramingLength;
+    framing->done = true;
+    return;
+  }
+
+  const char *transferEncoding = findHeader(
+    head, headLen, "Transfer-Encoding", &valueLen
+  );
+  if (transferEncoding != NULL) {
+    /*
+     * chunked has to be the last coding, otherwise the body ends on close
+     */
+    const size_t chunkedLen = sizeof("chunked") - 1;
+    framing->kind = valueLen >= chunkedLen
+                    && strncasecmp(transferEncoding + valueLen - chunkedLen,
+                                   "chunked", chunkedLen) == 0
+                      ? BodyFramingChunked
+                      : BodyFramingClose;
+    framing->chunkedState = ChunkedSize;
+    return;
+  }
+
+  const char *contentLength = findHeader(
+    head, headLen, "Content-Length", &valueLen
+  );
+  if (contentLength != NULL) {
+    char *     end    = NULL;
+    const long length = strtol(contentLength, &end, 10);
+    if (end != contentLength && length >= 0) {
+      framing->kind      = BodyFramingLength;
+      framing->remaining = (size_t) length;
+      framing->done      = length == 0;
+      return;
+    }
+  }
+  framing->kind = BodyFramingClose;
+}
+
+static int hexDigit(const char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return ERROR;
+}
+
+/**
+ * walks chunk size lines byte by byte and skips chunk data in bulk
+ */
+static ssize_t consumeChunked(
+  BodyFramingT *framing, const char *data, const size_t size
+) {
+  size_t pos = 0;
+  while (pos < size && !framing->done) {
+    const char c = data[pos];
+    switch (framing->chunkedState) {
+      case ChunkedSize: {
+        const int digit = hexDigit(c);
+        if (digit != ERROR) {
+          if (framing->remaining > (SIZE_MAX >> 4)) return ERROR;
+          framing->remaining = (framing->remaining << 4) | digit;
+          framing->sizeDigits++;
+        } else if (framing->sizeDigits == 0) {
+          return ERROR;
+        } else if (c == '\r') {
+          framing->chunkedState = ChunkedSizeLf;
+        } else if (c == ';' || c == ' ' || c == '\t') {
+          framing->chunkedState = ChunkedExtension;
+        } else {
+          return ERROR;
+        }
+        ++pos;
+        break;
+      }
+      case ChunkedExtension:
+        if (c == '\r') framing->chunkedState = ChunkedSizeLf;
+        ++pos;
+        break;
+      case ChunkedSizeLf:
+        if (c != '\n') return ERROR;
+        framing->sizeDigits   = 0;
+        framing->chunkedState = framing->remaining == 0
+                                  ? ChunkedTrailerStart
+                                  : ChunkedData;
+        ++pos;
+        break;
+      case ChunkedData: {
+        const size_t available = size - pos;
+        const size_t skip      = available < framing->remaining
+                                   ? available
+                                   : framing->remaining;
+        framing->remaining -= skip;
+        pos += skip;
+        if (framing->remaining == 0) {
+          framing->chunkedState = ChunkedDataCr;
+        }
+        break;
+      }
+      case ChunkedDataCr:
+        if (c != '\r') return ERROR;
+        framing->chunkedState = ChunkedDataLf;
+        ++pos;
+        break;
+      case ChunkedDataLf:
+        if (c != '\n') return ERROR;
+        framing->chunkedState = ChunkedSize;
+        ++pos;
+        break;
+      case ChunkedTrailerStart:
+        framing->chunkedState = c == '\r' ? ChunkedFinalLf : ChunkedTrailer;
+        ++pos;
+        break;
+      case ChunkedTrailer:
+        if (c == '\n') framing->chunkedState = ChunkedTrailerStart;
+        ++pos;
+        break;
+      case ChunkedFinalLf:
+        if (c != '\n') return ERROR;
+        framing->done = true;
+        ++pos;
+        break;
+    }
+  }
+  return (ssize_t) pos;
+}
+
+ssize_t BodyFramingT_consume(
+  BodyFramingT *framing, const char *data, const size_t size
+) {
+  if (framing->done) return 0;
+
+  switch (framing->kind) {
+    case BodyFramingLength: {
+      const size_t taken = size < framing->remaining ? size : framing->remaining;
+      framing->remaining -= taken;
+      framing->done = framing->remaining == 0;
+      return (ssize_t) taken;
+    }
+    case BodyFramingChunked:
+      return consumeChunked(framing, data, size);
+    case BodyFramingClose:
+    default:
+      return (ssize_t) size;
+  }
+}
@@ -0,0 +1,301 @@
+#include "proxy.h"
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define HTTP_SCHEME "http://"
+#define BYTES_UNIT "bytes="
+
+static const char *skipSpaces(const char *cur, const char *end) {
+  while (cur < end && (*cur == ' ' || *cur == '\t')) ++cur;
+  return cur;
+}
+
+static bool startsWithCrlf(const char *cur, const char *end) {
+  return end - cur >= 2 && cur[0] == '\r' && cur[1] == '\n';
+}
+
+/**
+ * @return position after the request line or `NULL` if it is malformed
+ */
+static const char *parseRequestLine(
+  HttpRequestT *request, const char *cur, const char *end
+) {
+  const char *methodEnd = skipTokenChars(cur, end);
+  if (methodEnd == cur || methodEnd == end || *methodEnd != ' ') {
+    return NULL;
+  }
+  request->method = (HttpSliceT) {cur, methodEnd - cur};
+
+  cur = methodEnd + 1;
+  const char *targetEnd = skipTargetChars(cur, end);
+  if (targetEnd == cur || targetEnd == end || *targetEnd != ' ') {
+    return NULL;
+  }
+  request->target = (HttpSliceT) {cur, targetEnd - cur};
+
+  cur = targetEnd + 1;
+  const size_t versionLen = sizeof("HTTP/1.x") - 1;
+  if (end - cur < (ptrdiff_t) versionLen
+      || strncmp(cur, "HTTP/1.", versionLen - 1) != 0
+      || !isdigit((unsigned char) cur[versionLen - 1])) {
+    return NULL;
+  }
+  request->minorVersion = cur[versionLen - 1] - '0';
+  cur += versionLen;
+  return startsWithCrlf(cur, end) ? cur + 2 : NULL;
+}
+
+/**
+ * @return position after the empty line or `NULL` if a header is
+ * malformed or there are more than `HTTP_MAX_HEADERS`
+ */
+static const char *parseHeaders(
+  HttpRequestT *request, const char *cur, const char *end
+) {
+  request->headersQ = 0;
+  while (!startsWithCrlf(cur, end)) {
+    /*
+     * obs-fold is rejected like RFC 9112 allows
+     */
+    const char *nameEnd = skipTokenChars(cur, end);
+    if (nameEnd == cur || nameEnd == end || *nameEnd != ':'
+        || request->headersQ == HTTP_MAX_HEADERS) {
+      return NULL;
+    }
+    const char *value    = skipSpaces(nameEnd + 1, end);
+    const char *valueEnd = skipValueChars(value, end);
+    if (!startsWithCrlf(valueEnd, end)) {
+      return NULL;
+    }
+    const char *lineEnd = valueEnd;
+    while (valueEnd > value && (valueEnd[-1] == ' ' || valueEnd[-1] == '\t')) {
+      --valueEnd;
+    }
+
+    HttpHeaderT *header = &request->headers[request->headersQ++];
+    header->name  = (HttpSliceT) {cur, nameEnd - cur};
+    header->value = (HttpSliceT) {value, valueEnd - value};
+    cur           = lineEnd + 2;
+  }
+  return cur + 2;
+}
+
+ssize_t HttpRequestT_parse(
+  HttpRequestT *request, const char *data, const size_t size, size_t *scanned
+) {
+  /*
+   * the end of the head may straddle the previous scan
+   */
+  const size_t from    = *scanned > 3 ? *scanned - 3 : 0;
+  const char * headEnd = from < size
+                           ? findHeadEnd(data + from, size - from)
+                           : NULL;
+  if (headEnd == NULL) {
+    *scanned = size;
+    return HTTP_PARSE_INCOMPLETE;
+  }
+  const char *end = headEnd + 4;
+  *scanned        = end - data;
+
+  const char *cur = parseRequestLine(request, data, end);
+  if (cur == NULL || parseHeaders(request, cur, end) != end) {
+    return ERROR;
+  }
+  return end - data;
+}
+
+bool HttpSliceT_equals(const HttpSliceT *slice, const char *literal) {
+  const size_t len = strlen(literal);
+  return slice->len == len && memcmp(slice->data, literal, len) == 0;
+}
+
+const HttpSliceT *HttpRequestT_header(
+  const HttpRequestT *request, const char *name
+) {
+  const size_t nameLen = strlen(name);
+  for (size_t i = 0; i < request->headersQ; ++i) {
+    const HttpHeaderT *header = &request->headers[i];
+    if (header->name.len == nameLen
+        && strncasecmp(header->name.data, name, nameLen) == 0) {
+      return &header->value;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * splits `host[:port]` into lower case @code host and @code port. An IPv6
+ * literal keeps its brackets, urls and `Host` need them and the resolver
+ * drops them
+ */
+static int parseAuthority(
+  const char *authority, const size_t len, char *host, int *port
+) {
+  const char *end     = authority + len;
+  const char *hostEnd = NULL;
+  if (len > 0 && authority[0] == '[') {
+    const char *bracket = memchr(authority, ']', len);
+    if (bracket == NULL || bracket == authority + 1) return ERROR;
+    for (const char *cur = authority + 1; cur < bracket; ++cur) {
+      if (!isxdigit((unsigned char) *cur) && *cur != ':' && *cur != '.') {
+        return ERROR;
+      }
+    }
+    hostEnd = bracket + 1;
+    if (hostEnd < end && *hostEnd != ':') return ERROR;
+  } else {
+    hostEnd = memchr(authority, ':', len);
+    if (hostEnd == NULL) hostEnd = end;
+  }
+  const size_t hostLen = hostEnd - authority;
+  if (hostLen == 0 || hostLen >= HOST_MAX_LEN
+      || memchr(authority, '@', len) != NULL) {
+    return ERROR;
+  }
+  for (size_t i = 0; i < hostLen; ++i) {
+    host[i] = (char) tolower((unsigned char) authority[i]);
+  }
+  host[hostLen] = '\0';
+
+  *port = DEF_HTTP_PORT;
+  if (hostEnd == end || hostEnd + 1 == end) {
+    return SUCCESS;
+  }
+  long value = 0;
+  for (const char *cur = hostEnd + 1; cur < end; ++cur) {
+    if (!isdigit((unsigned char) *cur)) return ERROR;
+    value = value * 10 + (*cur - '0');
+    if (value > 65535) return ERROR;
+  }
+  if (value == 0) return ERROR;
+  *port = (int) value;
+  return SUCCESS;
+}
+
+int HttpRequestT_route(
+  const HttpRequestT *request, char *host, int *port, char *path
+) {
+  const HttpSliceT *target       = &request->target;
+  const char *      end          = target->data + target->len;
+  const char *      authority    = NULL;
+  size_t            authorityLen = 0;
+  const char *      rest         = NULL;
+
+  const size_t schemeLen = sizeof(HTTP_SCHEME) - 1;
+  if (target->data[0] == '/') {
+    const HttpSliceT *hostHeader = HttpRequestT_header(request, "Host");
+    if (hostHeader == NULL) return ERROR;
+    authority    = hostHeader->data;
+    authorityLen = hostHeader->len;
+    rest         = target->data + 1;
+  } else if (target->len > schemeLen
+             && strncasecmp(target->data, HTTP_SCHEME, schemeLen) == 0) {
+    authority = target->data + schemeLen;
+    rest      = authority;
+    while (rest < end && *rest != '/' && *rest != '?') ++rest;
+    authorityLen = rest - authority;
+    if (rest < end && *rest == '/') ++rest;
+  } else {
+    return ERROR;
+  }
+
+  const size_t pathLen = end - rest;
+  if (pathLen >= PATH_MAX_LEN
+      || parseAuthority(authority, authorityLen, host, port) != SUCCESS) {
+    return ERROR;
+  }
+  memcpy(path, rest, pathLen);
+  path[pathLen] = '\0';
+  return SUCCESS;
+}
+
+int HttpRequestT_tunnelTarget(
+  const HttpRequestT *request, char *host, int *port
+) {
+  const HttpSliceT *target  = &request->target;
+  const char *      colon   = memrchr(target->data, ':', target->len);
+  const char *      bracket = memrchr(target->data, ']', target->len);
+  if (colon == NULL || (bracket != NULL && colon < bracket)
+      || memchr(target->data, '/', target->len) != NULL
+      || target->data[target->len - 1] == ':') {
+    return ERROR;
+  }
+  return parseAuthority(target->data, target->len, host, port);
+}
+
+/**
+ * @return position after the decimal number at @code cur, which is stored
+ * to @code value, or `NULL` if there are no digits or it overflows
+ */
+static const char *parseSize(const char *cur, const char *end, size_t *value) {
+  const char *start  = cur;
+  size_t      result = 0;
+  for (; cur < end && isdigit((unsigned char) *cur); ++cur) {
+    if (result > (SIZE_MAX - 9) / 10) return NULL;
+    result = result * 10 + (*cur - '0');
+  }
+  if (cur == start) return NULL;
+  *value = result;
+  return cur;
+}
+
+int parseByteRanges(
+  const HttpSliceT *value,
+  const size_t      length,
+  HttpByteRangeT *  ranges,
+  const int         maxRanges
+) {
+  const size_t unitLen = sizeof(BYTES_UNIT) - 1;
+  const char * end     = value->data + value->len;
+  if (value->len <= unitLen
+      || strncasecmp(value->data, BYTES_UNIT, unitLen) != 0) {
+    return ERROR;
+  }
+  int specsQ  = 0;
+  int rangesQ = 0;
+  for (const char *cur = value->data + unitLen; cur < end;) {
+    cur = skipSpaces(cur, end);
+    if (cur < end && *cur == ',') {
+      ++cur;
+      continue;
+    }
+    if (cur == end) break;
+    if (++specsQ > maxRanges) return ERROR;
+
+    /*
+     * `first-last`, `first-` or a suffix `-length`
+     */
+    size_t     first  = 0;
+    size_t     last   = SIZE_MAX;
+    const bool suffix = *cur == '-';
+    if (!suffix) {
+      cur = parseSize(cur, end, &first);
+      if (cur == NULL || cur == end || *cur != '-') return ERROR;
+    }
+    ++cur;
+    if (cur < end && isdigit((unsigned char) *cur)) {
+      cur = parseSize(cur, end, &last);
+      if (cur == NULL) return ERROR;
+    } else if (suffix) {
+      return ERROR;
+    }
+    cur = skipSpaces(cur, end);
+    if (cur < end && *cur != ',') return ERROR;
+
+    if (suffix) {
+      if (last == 0 || length == 0) continue;
+      first = last < length ? length - last : 0;
+      last  = length - 1;
+    } else {
+      if (last < first) return ERROR;
+      if (first >= length) continue;
+      if (last >= length) last = length - 1;
+    }
+    ranges[rangesQ++] = (HttpByteRangeT) {first, last};
+  }
+  return specsQ > 0 ? rangesQ : ERROR;
+}
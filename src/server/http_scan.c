@@ -0,0 +1,313 @@
+#include "proxy.h"
+
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define HTTP_SCAN_X86
+#endif
+
+/**
+ * Byte scanners of message heads. On x86-64 they compare 16 bytes at a
+ * time with SSE2, which is always there, or 32 with AVX2 when the cpu
+ * has it. Tails shorter than a vector and other architectures go
+ * through the scalar loops
+ */
+
+static const char HeadEnd[] = "\r\n\r\n";
+
+static bool isValueByte(const unsigned char c) {
+  return c == '\t' || (c >= ' ' && c != 0x7f);
+}
+
+static bool isTargetByte(const unsigned char c) {
+  return c > ' ' && c != 0x7f;
+}
+
+/**
+ * RFC 9110 tchar: visible ASCII except delimiters
+ */
+static bool isTokenByte(const unsigned char c) {
+  if (c <= ' ' || c >= 0x7f) return false;
+  switch (c) {
+    case '"': case '(': case ')': case ',': case '/': case ':': case ';':
+    case '<': case '=': case '>': case '?': case '@': case '[': case '\\':
+    case ']': case '{': case '}':
+      return false;
+    default:
+      return true;
+  }
+}
+
+static const char *findHeadEndScalar(const char *cur, const char *end) {
+  while (end - cur >= 4) {
+    cur = memchr(cur, '\r', end - cur - 3);
+    if (cur == NULL) return NULL;
+    if (memcmp(cur, HeadEnd, 4) == 0) return cur;
+    ++cur;
+  }
+  return NULL;
+}
+
+static const char *skipValueScalar(const char *cur, const char *end) {
+  while (cur < end && isValueByte(*cur)) ++cur;
+  return cur;
+}
+
+static const char *skipTargetScalar(const char *cur, const char *end) {
+  while (cur < end && isTargetByte(*cur)) ++cur;
+  return cur;
+}
+
+static const char *skipTokenScalar(const char *cur, const char *end) {
+  while (cur < end && isTokenByte(*cur)) ++cur;
+  return cur;
+}
+
+#ifdef HTTP_SCAN_X86
+
+/**
+ * four shifted loads compared to the four bytes of `\r\n\r\n`, so a set
+ * bit is a whole match
+ */
+static const char *findHeadEndSse2(const char *cur, const char *end) {
+  const __m128i cr = _mm_set1_epi8('\r');
+  const __m128i lf = _mm_set1_epi8('\n');
+  for (; end - cur >= 16 + 3; cur += 16) {
+    __m128i match = _mm_cmpeq_epi8(
+      _mm_loadu_si128((const __m128i *) cur), cr
+    );
+    match = _mm_and_si128(match, _mm_cmpeq_epi8(
+      _mm_loadu_si128((const __m128i *) (cur + 1)), lf
+    ));
+    match = _mm_and_si128(match, _mm_cmpeq_epi8(
+      _mm_loadu_si128((const __m128i *) (cur + 2)), cr
+    ));
+    match = _mm_and_si128(match, _mm_cmpeq_epi8(
+      _mm_loadu_si128((const __m128i *) (cur + 3)), lf
+    ));
+    const int mask = _mm_movemask_epi8(match);
+    if (mask != 0) return cur + __builtin_ctz(mask);
+  }
+  return findHeadEndScalar(cur, end);
+}
+
+__attribute__((target("avx2")))
+static const char *findHeadEndAvx2(const char *cur, const char *end) {
+  const __m256i cr = _mm256_set1_epi8('\r');
+  const __m256i lf = _mm256_set1_epi8('\n');
+  for (; end - cur >= 32 + 3; cur += 32) {
+    __m256i match = _mm256_cmpeq_epi8(
+      _mm256_loadu_si256((const __m256i *) cur), cr
+    );
+    match = _mm256_and_si256(match, _mm256_cmpeq_epi8(
+      _mm256_loadu_si256((const __m256i *) (cur + 1)), lf
+    ));
+    match = _mm256_and_si256(match, _mm256_cmpeq_epi8(
+      _mm256_loadu_si256((const __m256i *) (cur + 2)), cr
+    ));
+    match = _mm256_and_si256(match, _mm256_cmpeq_epi8(
+      _mm256_loadu_si256((const __m256i *) (cur + 3)), lf
+    ));
+    const unsigned mask = (unsigned) _mm256_movemask_epi8(match);
+    if (mask != 0) return cur + __builtin_ctz(mask);
+  }
+  return findHeadEndSse2(cur, end);
+}
+
+/**
+ * @return mask of bytes which are not above @code max, unsigned, and are
+ * not @code allowed, or are DEL
+ */
+static int stopMaskSse2(
+  const __m128i bytes, const __m128i max, const __m128i allowed
+) {
+  const __m128i del  = _mm_set1_epi8(0x7f);
+  __m128i       stop = _mm_cmpeq_epi8(_mm_min_epu8(bytes, max), bytes);
+  stop = _mm_andnot_si128(_mm_cmpeq_epi8(bytes, allowed), stop);
+  stop = _mm_or_si128(stop, _mm_cmpeq_epi8(bytes, del));
+  return _mm_movemask_epi8(stop);
+}
+
+__attribute__((target("avx2")))
+static unsigned stopMaskAvx2(
+  const __m256i bytes, const __m256i max, const __m256i allowed
+) {
+  const __m256i del  = _mm256_set1_epi8(0x7f);
+  __m256i       stop = _mm256_cmpeq_epi8(_mm256_min_epu8(bytes, max), bytes);
+  stop = _mm256_andnot_si256(_mm256_cmpeq_epi8(bytes, allowed), stop);
+  stop = _mm256_or_si256(stop, _mm256_cmpeq_epi8(bytes, del));
+  return (unsigned) _mm256_movemask_epi8(stop);
+}
+
+/**
+ * skips bytes above @code max except DEL, and @code allowed ones, a tail
+ * shorter than a vector is left to the caller
+ */
+static const char *skipSse2(
+  const char *cur, const char *end, const char max, const char allowed
+) {
+  const __m128i maxes    = _mm_set1_epi8(max);
+  const __m128i alloweds = _mm_set1_epi8(allowed);
+  for (; end - cur >= 16; cur += 16) {
+    const int mask = stopMaskSse2(
+      _mm_loadu_si128((const __m128i *) cur), maxes, alloweds
+    );
+    if (mask != 0) return cur + __builtin_ctz(mask);
+  }
+  return cur;
+}
+
+__attribute__((target("avx2")))
+static const char *skipAvx2(
+  const char *cur, const char *end, const char max, const char allowed
+) {
+  const __m256i maxes    = _mm256_set1_epi8(max);
+  const __m256i alloweds = _mm256_set1_epi8(allowed);
+  for (; end - cur >= 32; cur += 32) {
+    const unsigned mask = stopMaskAvx2(
+      _mm256_loadu_si256((const __m256i *) cur), maxes, alloweds
+    );
+    if (mask != 0) return cur + __builtin_ctz(mask);
+  }
+  return skipSse2(cur, end, max, allowed);
+}
+
+/**
+ * Token bytes are 0x21-0x7e without the delimiters, which form three
+ * ranges and five single bytes. Signed compares also reject bytes above
+ * 0x7f
+ * @return mask of bytes which are not token ones
+ */
+static int tokenStopMaskSse2(const __m128i bytes) {
+#define IN_RANGE_SSE2(low, high) \
+  _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8((low) - 1)), \
+                _mm_cmplt_epi8(bytes, _mm_set1_epi8((high) + 1)))
+#define EQUALS_SSE2(c) _mm_cmpeq_epi8(bytes, _mm_set1_epi8(c))
+  __m128i delimiter = _mm_or_si128(
+    IN_RANGE_SSE2(':', '@'),
+    _mm_or_si128(IN_RANGE_SSE2('[', ']'), IN_RANGE_SSE2('(', ')'))
+  );
+  delimiter = _mm_or_si128(delimiter, _mm_or_si128(
+    _mm_or_si128(EQUALS_SSE2('"'), EQUALS_SSE2(',')),
+    _mm_or_si128(EQUALS_SSE2('/'),
+                 _mm_or_si128(EQUALS_SSE2('{'), EQUALS_SSE2('}')))
+  ));
+  const __m128i token = _mm_andnot_si128(
+    delimiter, IN_RANGE_SSE2(0x21, 0x7e)
+  );
+#undef EQUALS_SSE2
+#undef IN_RANGE_SSE2
+  return _mm_movemask_epi8(token) ^ 0xffff;
+}
+
+__attribute__((target("avx2")))
+static unsigned tokenStopMaskAvx2(const __m256i bytes) {
+#define IN_RANGE_AVX2(low, high) \
+  _mm256_and_si256(_mm256_cmpgt_epi8(bytes, _mm256_set1_epi8((low) - 1)), \
+                   _mm256_cmpgt_epi8(_mm256_set1_epi8((high) + 1), bytes))
+#define EQUALS_AVX2(c) _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(c))
+  __m256i delimiter = _mm256_or_si256(
+    IN_RANGE_AVX2(':', '@'),
+    _mm256_or_si256(IN_RANGE_AVX2('[', ']'), IN_RANGE_AVX2('(', ')'))
+  );
+  delimiter = _mm256_or_si256(delimiter, _mm256_or_si256(
+    _mm256_or_si256(EQUALS_AVX2('"'), EQUALS_AVX2(',')),
+    _mm256_or_si256(EQUALS_AVX2('/'),
+                    _mm256_or_si256(EQUALS_AVX2('{'), EQUALS_AVX2('}')))
+  ));
+  const __m256i token = _mm256_andnot_si256(
+    delimiter, IN_RANGE_AVX2(0x21, 0x7e)
+  );
+#undef EQUALS_AVX2
+#undef IN_RANGE_AVX2
+  return ~(unsigned) _mm256_movemask_epi8(token);
+}
+
+static const char *skipTokenSse2(const char *cur, const char *end) {
+  for (; end - cur >= 16; cur += 16) {
+    const int mask = tokenStopMaskSse2(
+      _mm_loadu_si128((const __m128i *) cur)
+    );
+    if (mask != 0) return cur + __builtin_ctz(mask);
+  }
+  return cur;
+}
+
+__attribute__((target("avx2")))
+static const char *skipTokenAvx2(const char *cur, const char *end) {
+  for (; end - cur >= 32; cur += 32) {
+    const unsigned mask = tokenStopMaskAvx2(
+      _mm256_loadu_si256((const __m256i *) cur)
+    );
+    if (mask != 0) return cur + __builtin_ctz(mask);
+  }
+  return skipTokenSse2(cur, end);
+}
+
+static bool hasAvx2() {
+  return __builtin_cpu_supports("avx2");
+}
+
+#endif
+
+const char *findHeadEnd(const char *data, const size_t size) {
+#ifdef HTTP_SCAN_X86
+  if (hasAvx2()) return findHeadEndAvx2(data, data + size);
+  return findHeadEndSse2(data, data + size);
+#else
+  return findHeadEndScalar(data, data + size);
+#endif
+}
+
+const char *skipValueChars(const char *cur, const char *end) {
+#ifdef HTTP_SCAN_X86
+  /*
+   * control characters are at most 0x1f, HTAB is the allowed one
+   */
+  cur = hasAvx2()
+          ? skipAvx2(cur, end, 0x1f, '\t')
+          : skipSse2(cur, end, 0x1f, '\t');
+#endif
+  return skipValueScalar(cur, end);
+}
+
+const char *skipTargetChars(const char *cur, const char *end) {
+#ifdef HTTP_SCAN_X86
+  /*
+   * space ends the target, DEL as the allowed byte allows nothing below
+   */
+  cur = hasAvx2()
+          ? skipAvx2(cur, end, ' ', 0x7f)
+          : skipSse2(cur, end, ' ', 0x7f);
+#endif
+  return skipTargetScalar(cur, end);
+}
+
+const char *skipTokenChars(const char *cur, const char *end) {
+#ifdef HTTP_SCAN_X86
+  cur = hasAvx2() ? skipTokenAvx2(cur, end) : skipTokenSse2(cur, end);
+#endif
+  return skipTokenScalar(cur, end);
+}
+
+char *strstrn(const char * haystack,
+              const size_t haystackLen,
+              const char * needle,
+              const size_t needleLen) {
+  if (needleLen == 0) {
+    return (char *) haystack;
+  }
+  if (needleLen == 4 && memcmp(needle, HeadEnd, 4) == 0) {
+    return (char *) findHeadEnd(haystack, haystackLen);
+  }
+  const char *cur = haystack;
+  const char *end = haystack + haystackLen;
+  while ((size_t) (end - cur) >= needleLen) {
+    cur = memchr(cur, needle[0], end - cur - needleLen + 1);
+    if (cur == NULL) return NULL;
+    if (memcmp(cur, needle, needleLen) == 0) return (char *) cur;
+    ++cur;
+  }
+  return NULL;
+}
@@ -0,0 +1,147 @@
+#include "proxy.h"
+#include "../utils/log.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define ORIGIN_BACKOFF_BUCKETS 256
+
+/**
+ * Consecutive connect failures of one host:port, removed on success
+ */
+typedef struct OriginFailure {
+  struct OriginFailure *next;
+  uint64_t              retryAt;
+  long                  delay;
+  int                   port;
+  char                  host[];
+} OriginFailureT;
+
+struct OriginBackoff {
+  pthread_mutex_t mutex;
+  long            initialDelay;
+  long            maxDelay;
+  OriginFailureT *buckets[ORIGIN_BACKOFF_BUCKETS];
+};
+
+OriginBackoffT *OriginBackoffT_new(
+  const long initialDelay, const long maxDelay
+) {
+  OriginBackoffT *backoff = malloc(sizeof(*backoff));
+  if (backoff == NULL) {
+    return NULL;
+  }
+  memset(backoff, 0, sizeof(*backoff));
+  backoff->initialDelay = initialDelay;
+  backoff->maxDelay     = maxDelay;
+  const int ret = pthread_mutex_init(&backoff->mutex, NULL);
+  CHECK_RET("pthread_mutex_init", ret);
+  return backoff;
+}
+
+static OriginFailureT **bucketOf(
+  OriginBackoffT *backoff, const char *host, const int port
+) {
+  const uint64_t hash = CacheT_hashUrl(host) ^ (uint64_t) port;
+  return &backoff->buckets[hash % ORIGIN_BACKOFF_BUCKETS];
+}
+
+/**
+ * @return link pointing to the record of @code host:port or to the end of
+ * its bucket. Records which are long past their retry time are freed on
+ * the way. Use under `OriginBackoffT->mutex`
+ */
+static OriginFailureT **findFailure(
+  OriginBackoffT *backoff, const char *host, const int port,
+  const uint64_t  now
+) {
+  OriginFailureT **current = bucketOf(backoff, host, port);
+  while (*current != NULL) {
+    OriginFailureT *failure = *current;
+    if (failure->port == port && strcmp(failure->host, host) == 0) {
+      break;
+    }
+    if (failure->retryAt + backoff->maxDelay < now) {
+      *current = failure->next;
+      free(failure);
+      continue;
+    }
+    current = &failure->next;
+  }
+  return current;
+}
+
+bool OriginBackoffT_isBlocked(
+  OriginBackoffT *backoff, const char *host, const int port
+) {
+  const uint64_t now = EventLoopT_nowMs();
+  int            ret = pthread_mutex_lock(&backoff->mutex);
+  CHECK_RET("pthread_mutex_lock", ret);
+
+  const OriginFailureT *failure = *findFailure(backoff, host, port, now);
+  const bool            blocked = failure != NULL && failure->retryAt > now;
+
+  ret = pthread_mutex_unlock(&backoff->mutex);
+  CHECK_RET("pthread_mutex_unlock", ret);
+  return blocked;
+}
+
+void OriginBackoffT_onFailure(
+  OriginBackoffT *backoff, const char *host, const int port
+) {
+  const uint64_t now = EventLoopT_nowMs();
+  int            ret = pthread_mutex_lock(&backoff->mutex);
+  CHECK_RET("pthread_mutex_lock", ret);
+
+  OriginFailureT **link    = findFailure(backoff, host, port, now);
+  OriginFailureT * failure = *link;
+  bool             renewed = false;
+  if (failure == NULL) {
+    const size_t hostLen = strlen(host);
+    failure = malloc(sizeof(*failure) + hostLen + 1);
+    if (failure != NULL) {
+      memcpy(failure->host, host, hostLen + 1);
+      failure->port    = port;
+      failure->delay   = backoff->initialDelay;
+      failure->retryAt = now + failure->delay;
+      failure->next    = NULL;
+      *link            = failure;
+      renewed          = true;
+    }
+  } else if (failure->retryAt <= now) {
+    /*
+     * failures of concurrent attempts made before the retry time neither
+     * prolong the delay nor move the retry time
+     */
+    failure->delay   = failure->delay * 2 < backoff->maxDelay
+                         ? failure->delay * 2
+                         : backoff->maxDelay;
+    failure->retryAt = now + failure->delay;
+    renewed          = true;
+  }
+  if (renewed) {
+    logWarning("%s:%d origin %s:%d is backed off for %ld ms",
+               __FILE__, __LINE__, host, port, failure->delay);
+  }
+
+  ret = pthread_mutex_unlock(&backoff->mutex);
+  CHECK_RET("pthread_mutex_unlock", ret);
+}
+
+void OriginBackoffT_onSuccess(
+  OriginBackoffT *backoff, const char *host, const int port
+) {
+  const uint64_t now = EventLoopT_nowMs();
+  int            ret = pthread_mutex_lock(&backoff->mutex);
+  CHECK_RET("pthread_mutex_lock", ret);
+
+  OriginFailureT **link    = findFailure(backoff, host, port, now);
+  OriginFailureT * failure = *link;
+  if (failure != NULL) {
+    *link = failure->next;
+    free(failure);
+  }
+
+  ret = pthread_mutex_unlock(&backoff->mutex);
+  CHECK_RET("pthread_mutex_unlock", ret);
+}
@@ -0,0 +1,40 @@
+#include "proxy.h"
+
+#include <string.h>
+#include <sys/socket.h>
+
+void OutputVectorT_reset(OutputVectorT *out) {
+  out->iovQ  = 0;
+  out->first = 0;
+}
+
+bool OutputVectorT_add(
+  OutputVectorT *out, const void *data, const size_t size
+) {
+  if (size == 0) return true;
+  if (out->iovQ == OUTPUT_VECTOR_MAX) return false;
+  out->iov[out->iovQ].iov_base = (void *) data;
+  out->iov[out->iovQ].iov_len  = size;
+  ++out->iovQ;
+  return true;
+}
+
+ssize_t OutputVectorT_send(const OutputVectorT *out, const int fd) {
+  struct msghdr message = {0};
+  message.msg_iov    = (struct iovec *) out->iov + out->first;
+  message.msg_iovlen = out->iovQ - out->first;
+  return sendmsg(fd, &message, MSG_NOSIGNAL);
+}
+
+bool OutputVectorT_advance(OutputVectorT *out, size_t sent) {
+  while (out->first < out->iovQ && sent >= out->iov[out->first].iov_len) {
+    sent -= out->iov[out->first].iov_len;
+    ++out->first;
+  }
+  if (out->first < out->iovQ) {
+    struct iovec *iov = &out->iov[out->first];
+    iov->iov_base = (char *) iov->iov_base + sent;
+    iov->iov_len -= sent;
+  }
+  return out->first == out->iovQ;
+}
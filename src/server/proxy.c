@@ -6,6 +6,7 @@
 #include "../utils/log.h"
 
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -14,11 +15,12 @@
 #include <arpa/inet.h>
 #include <bits/pthreadtypes.h>
 #include <netinet/in.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 
 #include "../cache/cache.h"
 
-#define SERVER_BACKLOG 10
+#define SERVER_BACKLOG SOMAXCONN
 
 const char *BadRequestStatus =
     "400 Bad Request";
@@ -26,6 +28,8 @@ const char *InternalErrorStatus =
     "500 Internal Server Error";
 const char *BadGatewayStatus =
     "502 Bad Gateway";
+const char *NotImplementedStatus =
+    "501 Not Implemented";
 const char *BadRequestMessage =
     "Failed to read request";
 const char *InvalidRequestMessage =
@@ -74,14 +78,41 @@ int setupServerSocket(struct sockaddr_in *serverAddr, const int port) {
   return serverSocket;
 }
 
-void startServer(const int port) {
-  setupSigPipeIgnore();
+static void onAcceptReady(
+  EventLoopT *loop, EventHandlerT *handler, const uint32_t events
+) {
+  (void) loop;
+  (void) events;
+  ProxyWorkerT *worker = CONTAINER_OF(handler, ProxyWorkerT, acceptHandler);
+
+  while (1) {
+    struct sockaddr_in clientAddr;
+    socklen_t          clientAddrLen = sizeof(clientAddr);
+    const int          clientSocket  = accept4(
+      handler->fd, (struct sockaddr *) &clientAddr, &clientAddrLen,
+      SOCK_NONBLOCK | SOCK_CLOEXEC
+    );
+    if (clientSocket < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      logError("error while accepting connection: %s ", strerror(errno));
+      return;
+    }
+
+    char addrBuf[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &clientAddr.sin_addr, addrBuf, sizeof(addrBuf));
+    logInfo(
+      "server accepted connection: %s:%d", addrBuf, ntohs(clientAddr.sin_port)
+    );
+    ClientContextT_start(worker, clientSocket);
+  }
+}
+
+static int openListener(const int port, const int backlog) {
   struct sockaddr_in serverAddr;
-  struct sockaddr_in clientAddr;
-  socklen_t          clientAddrLen = sizeof(clientAddr);
 
-  int serverSocket = setupServerSocket(&serverAddr, port);
-  int ret = bind(
+  const int serverSocket = setupServerSocket(&serverAddr, port);
+  int       ret          = bind(
     serverSocket, (struct sockaddr *) &serverAddr, sizeof(serverAddr)
   );
   if (ret < 0) {
@@ -90,47 +121,155 @@ void startServer(const int port) {
     abort();
   }
 
-  ret = listen(serverSocket, SERVER_BACKLOG);
+  ret = listen(serverSocket, backlog);
   if (ret < 0) {
     logError("[startServer] %s", strerror(errno));
     abort();
   }
-  CacheManagerT *cacheManager = CacheManagerT_new();
-  logInfo("proxy start on %d port", port);
-  logInfo("wait connections");
+  if (setNonBlocking(serverSocket) != SUCCESS) {
+    logError("[startServer] setNonBlocking %s", strerror(errno));
+    abort();
+  }
+  return serverSocket;
+}
 
-  while (1) {
-    const int clientSocket = accept(
-      serverSocket, (struct sockaddr *) &clientAddr, &clientAddrLen
-    );
-    char addrBuf[sizeof(struct in_addr)];
-    inet_ntop(AF_INET, &clientAddr.sin_addr.s_addr, addrBuf, clientAddrLen);
+static void pinToCpu(const ProxyWorkerT *worker) {
+  const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpus <= 0) return;
 
-    if (clientSocket < 0) {
-      logError("error while accepting connection: %s ", strerror(errno));
-      continue;
-    }
-    logInfo(
-      "server accepted connection: %s:%d", addrBuf, ntohs(clientAddr.sin_port)
-    );
+  cpu_set_t cpuSet;
+  CPU_ZERO(&cpuSet);
+  CPU_SET(worker->id % cpus, &cpuSet);
+  const int ret = pthread_setaffinity_np(
+    pthread_self(), sizeof(cpuSet), &cpuSet
+  );
+  if (ret != 0) {
+    logWarning("%s:%d worker %d pthread_setaffinity_np %s",
+               __FILE__, __LINE__, worker->id, strerror(ret));
+  }
+}
+
+static void *workerRoutine(void *args) {
+  ProxyWorkerT *worker = args;
+  char          name[16];
+  snprintf(name, sizeof(name), "worker-%d", worker->id);
+  pthread_setname_np(pthread_self(), name);
+  if (worker->config->pinCpu) {
+    pinToCpu(worker);
+  }
 
-    ClientContextArgsT *args = malloc(sizeof(*args));
-    if (args == NULL) {
-      logError("ClientThreadRoutineArgs malloc error: %s", strerror(errno));
-      sendError(clientSocket, InternalErrorStatus, "");
-      close(clientSocket);
-      continue;
+  EventLoopT_run(worker->loop);
+  return NULL;
+}
+
+void ProxyConfigT_init(ProxyConfigT *config) {
+  const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+  config->port      = 0;
+  config->workersQ  = cpus > 0 ? (int) cpus : 1;
+  config->backlog   = SERVER_BACKLOG;
+  config->reusePort = false;
+  config->pinCpu    = false;
+
+  config->upstreamMaxIdle     = UPSTREAM_MAX_IDLE_PER_HOST;
+  config->upstreamIdleTimeout = UPSTREAM_IDLE_TIMEOUT;
+
+  config->clientMaxRequests      = CLIENT_MAX_REQUESTS;
+  config->clientKeepAliveTimeout = CLIENT_KEEPALIVE_TIMEOUT;
+
+  config->connectTimeout = CONNECT_TIMEOUT;
+  config->dnsPositiveTtl = DNS_POSITIVE_TTL;
+  config->dnsNegativeTtl = DNS_NEGATIVE_TTL;
+
+  config->cache.sizeLimit       = CACHE_SIZE_LIMIT;
+  config->cache.objectSizeLimit = CACHE_OBJECT_SIZE_LIMIT;
+  config->cache.policy          = CachePolicyLru;
+  config->cache.entryThreshold  = CACHE_ENTRY_THRESHOLD;
+}
+
+void startServer(const ProxyConfigT *config) {
+  setupSigPipeIgnore();
+
+  const int sharedSocket = config->reusePort
+                             ? ERROR
+                             : openListener(config->port, config->backlog);
+  CacheManagerT *cacheManager = CacheManagerT_new(&config->cache);
+  if (cacheManager == NULL) {
+    logFatal("[startServer] CacheManagerT_new failed");
+    abort();
+  }
+  if (CacheManagerT_startJanitor(cacheManager) != 0) {
+    logFatal("[startServer] CacheManagerT_startJanitor failed");
+    abort();
+  }
+  DnsResolverT *resolver = DnsResolverT_new(
+    config->dnsPositiveTtl, config->dnsNegativeTtl
+  );
+  OriginBackoffT *backoff = OriginBackoffT_new(
+    ORIGIN_BACKOFF_INITIAL, ORIGIN_BACKOFF_MAX
+  );
+  if (resolver == NULL || backoff == NULL) {
+    logFatal("[startServer] DnsResolverT_new failed");
+    abort();
+  }
+
+  const int     workersQ = config->workersQ;
+  ProxyWorkerT *workers  = calloc(workersQ, sizeof(*workers));
+  if (workers == NULL) {
+    logFatal("[startServer] workers calloc %s", strerror(errno));
+    abort();
+  }
+
+  for (int i = 0; i < workersQ; ++i) {
+    ProxyWorkerT *worker = &workers[i];
+    worker->id                    = i;
+    worker->config                = config;
+    worker->cacheManager          = cacheManager;
+    worker->resolver              = resolver;
+    worker->backoff               = backoff;
+    worker->loop                  = EventLoopT_new();
+    worker->upstreamPool          = UpstreamPoolT_new(
+      worker->loop, config->upstreamMaxIdle, config->upstreamIdleTimeout
+    );
+    worker->bufferPool            = BufferPoolT_new(
+      BUFFER_SIZE + RESPONSE_HEAD_RESERVE, BUFFER_POOL_MAX_FREE
+    );
+    worker->acceptHandler.fd      = config->reusePort
+                                      ? openListener(config->port,
+                                                     config->backlog)
+                                      : sharedSocket;
+    worker->acceptHandler.onEvent = onAcceptReady;
+    if (worker->loop == NULL || worker->upstreamPool == NULL
+        || worker->bufferPool == NULL) {
+      logFatal("[startServer] EventLoopT_new failed");
+      abort();
     }
-    args->cacheManager = cacheManager;
-    args->clientSocket = clientSocket;
-    pthread_t clientThread;
-    ret = pthread_create(&clientThread, NULL, clientConnectionHandler, args);
-    if (ret < 0) {
-      logError("unable to create client thread: %s", strerror(errno));
-      sendError(clientSocket, InternalErrorStatus, "");
-      free(args);
-      continue;
+    const uint32_t events = config->reusePort
+                              ? EPOLLIN
+                              : EPOLLIN | EPOLLEXCLUSIVE;
+    const int ret = EventLoopT_add(
+      worker->loop, &worker->acceptHandler, events
+    );
+    if (ret != SUCCESS) {
+      logFatal("[startServer] EventLoopT_add %s", strerror(errno));
+      abort();
     }
-    pthread_detach(clientThread);
+  }
+
+  logInfo(
+    "proxy start on %d port with %d workers, %s listener, backlog %d",
+    config->port, workersQ,
+    config->reusePort ? "per-worker" : "shared", config->backlog
+  );
+  logInfo("wait connections");
+
+  for (int i = 0; i < workersQ; ++i) {
+    const int ret = pthread_create(
+      &workers[i].thread, NULL, workerRoutine, &workers[i]
+    );
+    CHECK_RET("pthread_create", ret);
+  }
+  for (int i = 0; i < workersQ; ++i) {
+    pthread_join(workers[i].thread, NULL);
   }
 }
@@ -2,11 +2,17 @@
 #define PROXY_H
 
 #include <pthread.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <sys/uio.h>
 
+#include "event_loop.h"
 #include "../cache/cache.h"
+#include "../dns/resolver.h"
 
-#define CACHE_SIZE_LIMIT 1048576 //1Mb
+#define CACHE_SIZE_LIMIT        (256 * 1048576) //256Mb
+#define CACHE_OBJECT_SIZE_LIMIT (32 * 1048576)  //32Mb
+#define CACHE_ENTRY_THRESHOLD   (60 * 60 * 1000) //1h
 
 /**
  *Should be >= 16kB to fully fit HTTP headers in single buffer
@@ -18,41 +24,216 @@
 #define HOST_MAX_LEN 1024
 #define PATH_MAX_LEN 2048
 #define SEND_RECV_TIMEOUT 1000
+#define CLIENT_IDLE_TIMEOUT 30000
+#define CLIENT_KEEPALIVE_TIMEOUT 5000
+#define CLIENT_MAX_REQUESTS 100
+#define CONNECT_TIMEOUT 10000
+/**
+ * origin silence after which a response being received is failed
+ */
+#define UPSTREAM_READ_TIMEOUT 30000
+/**
+ * RFC 8305 connection attempt delay before racing the next address
+ */
+#define CONNECT_ATTEMPT_DELAY 250
+#define ORIGIN_BACKOFF_INITIAL 1000
+#define ORIGIN_BACKOFF_MAX 60000
+#define DEF_HTTP_PORT 80
+#define HTTP_MAX_HEADERS 64
+#define HTTP_PARSE_INCOMPLETE (-2)
+#define UPSTREAM_IDLE_TIMEOUT 10000
+#define UPSTREAM_MAX_IDLE_PER_HOST 8
+/**
+ * room for `Content-Length` and `Connection` added to a stored head
+ */
+#define RESPONSE_HEAD_RESERVE 128
+/**
+ * free buffers kept by every worker, each fits `BUFFER_SIZE` plus
+ * `RESPONSE_HEAD_RESERVE`
+ */
+#define BUFFER_POOL_MAX_FREE 256
+/**
+ * finished upload contexts kept by every worker along with their request
+ * buffers
+ */
+#define UPLOAD_POOL_MAX_FREE 64
 
-#define CHECK_ERROR(description, ret) \
-  do { \
-    if (ret != 0) { \
-      logFatal( "%s:%d %s : %s", __FILE__, __LINE__, description, strerror(ret) ); \
-      abort(); \
-    } \
-  } while (0)
+#define CONTAINER_OF(ptr, type, member) \
+  ((type *) ((char *) (ptr) - offsetof(type, member)))
 
 static constexpr size_t kDefCacheChunkSize = 1024 * 1024;
 
-typedef struct ClientArgs {
-  int clientSocket;
-} ClientArgsT;
-
 typedef struct Buffer {
   char * data;
   size_t occupancy;
   size_t maxSize;
+  /**
+   * allocated size of @code data, `maxSize` may be less for pooled ones
+   */
+  size_t capacity;
 } BufferT;
 
-typedef struct ClientContextArgs {
+/**
+ * upper bound of buffers gathered into one `sendmsg`
+ */
+#define OUTPUT_VECTOR_MAX 16
+
+/**
+ * Buffers sent with one vectored syscall, partially sent ones are resumed
+ * from @code first after `OutputVectorT_advance`
+ */
+typedef struct OutputVector {
+  struct iovec iov[OUTPUT_VECTOR_MAX];
+  int          iovQ;
+  int          first;
+} OutputVectorT;
+
+typedef struct ProxyConfig {
+  int  port;
+  int  workersQ;
+  int  backlog;
+  /**
+   * every worker binds own `SO_REUSEPORT` listener instead of sharing one
+   */
+  bool reusePort;
+  bool pinCpu;
+  /**
+   * idle keep-alive origin connections kept by every worker per host:port,
+   * `0` disables pooling
+   */
+  int  upstreamMaxIdle;
+  long upstreamIdleTimeout;
+  /**
+   * requests served over one client connection before it is closed,
+   * `1` disables keep-alive
+   */
+  int  clientMaxRequests;
+  long clientKeepAliveTimeout;
+  long connectTimeout;
+  /**
+   * how long successful and failed host lookups are cached
+   */
+  long dnsPositiveTtl;
+  long dnsNegativeTtl;
+
+  CacheConfigT cache;
+} ProxyConfigT;
+
+/**
+ * Part of a receive buffer, not terminated
+ */
+typedef struct HttpSlice {
+  const char *data;
+  size_t      len;
+} HttpSliceT;
+
+/**
+ * Inclusive byte positions of a `Range` request resolved against the
+ * representation length
+ */
+typedef struct HttpByteRange {
+  size_t first;
+  size_t last;
+} HttpByteRangeT;
+
+typedef struct HttpHeader {
+  HttpSliceT name;
+  HttpSliceT value;
+} HttpHeaderT;
+
+/**
+ * Parsed request head, every slice points into the parsed buffer and is
+ * valid while it is not changed
+ */
+typedef struct HttpRequest {
+  HttpSliceT  method;
+  HttpSliceT  target;
+  int         minorVersion;
+  HttpHeaderT headers[HTTP_MAX_HEADERS];
+  size_t      headersQ;
+} HttpRequestT;
+
+typedef enum ChunkedState {
+  ChunkedSize,
+  ChunkedExtension,
+  ChunkedSizeLf,
+  ChunkedData,
+  ChunkedDataCr,
+  ChunkedDataLf,
+  ChunkedTrailerStart,
+  ChunkedTrailer,
+  ChunkedFinalLf,
+} ChunkedStateT;
+
+/**
+ * Tracks where a response body ends without decoding it
+ */
+typedef struct BodyFraming {
+  BodyFramingKindT kind;
+  ChunkedStateT    chunkedState;
+  /**
+   * bytes left of the body or of the current chunk
+   */
+  size_t           remaining;
+  int              sizeDigits;
+  bool             done;
+} BodyFramingT;
+
+typedef struct UpstreamConnection UpstreamConnectionT;
+typedef struct OriginBackoff      OriginBackoffT;
+
+/**
+ * Per-worker idle origin connections, used from the worker loop only
+ */
+typedef struct UpstreamPool {
+  EventLoopT *         loop;
+  UpstreamConnectionT *idle;
+  UpstreamConnectionT *released;
+  size_t               idleQ;
+  size_t               maxIdlePerHost;
+  long                 idleTimeout;
+} UpstreamPoolT;
+
+/**
+ * Per-worker free list of equally sized buffers, used from the worker
+ * loop only
+ */
+typedef struct BufferPool {
+  BufferT **free;
+  size_t    freeQ;
+  size_t    maxFree;
+  size_t    capacity;
+} BufferPoolT;
+
+/**
+ * One event loop thread, owns every connection it accepted
+ */
+typedef struct ProxyWorker {
+  int                 id;
+  const ProxyConfigT *config;
+  pthread_t      thread;
+  EventLoopT *   loop;
   CacheManagerT *cacheManager;
-  int            clientSocket;
-} ClientContextArgsT;
+  DnsResolverT * resolver;
+  OriginBackoffT *backoff;
+  UpstreamPoolT *upstreamPool;
+  BufferPoolT *  bufferPool;
+  /**
+   * free list of `UploadContextT`, used from the worker loop only
+   */
+  struct UploadContext *freeUploads;
+  size_t         freeUploadsQ;
+  EventHandlerT  acceptHandler;
+} ProxyWorkerT;
 
-typedef struct FileUploadContextArgs {
-  CacheEntryT *cacheEntry;
-  int          clientSocket;
-  int          port;
-} FileUploadContextArgsT;
+typedef struct ClientContext ClientContextT;
+typedef struct UploadContext UploadContextT;
+typedef struct Relay         RelayT;
 
 extern const char *BadRequestStatus;
 extern const char *InternalErrorStatus;
 extern const char *BadGatewayStatus;
+extern const char *NotImplementedStatus;
 extern const char *BadRequestMessage;
 extern const char *InvalidRequestMessage;
 extern const char *FailedToConnectRemoteServer;
@@ -61,14 +242,114 @@ BufferT *BufferT_new(size_t maxOccupancy);
 
 void BufferT_delete(BufferT *buffer);
 
-ClientContextArgsT *ClientContextArgsT_create();
+BufferPoolT *BufferPoolT_new(size_t capacity, size_t maxFree);
 
-void ContextArgsT_delete(ClientContextArgsT *clientContextArgs);
+/**
+ * @return empty buffer limited to @code maxSize, a pooled one if it fits
+ * the pool capacity, or `NULL`
+ */
+BufferT *BufferPoolT_acquire(BufferPoolT *pool, size_t maxSize);
 
-ssize_t readHttpHeaders(int client_socket, char *buffer, size_t buffer_size);
+/**
+ * keeps @code buffer for reuse or frees it when the pool is full
+ */
+void BufferPoolT_release(BufferPoolT *pool, BufferT *buffer);
 
 void sendError(int sock, const char *status, const char *message);
 
+void OutputVectorT_reset(OutputVectorT *out);
+
+/**
+ * @return `false` if the vector is full, empty buffers are skipped
+ */
+bool OutputVectorT_add(OutputVectorT *out, const void *data, size_t size);
+
+/**
+ * one non-blocking `sendmsg` of buffers which are not sent yet
+ * @return result of `sendmsg`
+ */
+ssize_t OutputVectorT_send(const OutputVectorT *out, int fd);
+
+/**
+ * drops @code sent bytes from the front of the vector
+ * @return `true` if everything is sent
+ */
+bool OutputVectorT_advance(OutputVectorT *out, size_t sent);
+
+/**
+ * @return length of the formatted response, it is truncated to `size`
+ */
+size_t formatError(
+  char *dest, size_t size, const char *status, const char *message
+);
+
+char *strstrn(const char *haystack, size_t haystackLen,
+              const char *needle, size_t needleLen);
+
+/**
+ * @return the first `\r\n\r\n` of @code data or `NULL`, vectorized
+ * where the cpu allows
+ */
+const char *findHeadEnd(const char *data, size_t size);
+
+/**
+ * @return the first byte from @code cur which can not be in a header
+ * value, a control character other than HTAB, or @code end
+ */
+const char *skipValueChars(const char *cur, const char *end);
+
+/**
+ * @return the first byte from @code cur which can not be in a request
+ * target, space or a control character, or @code end
+ */
+const char *skipTargetChars(const char *cur, const char *end);
+
+/**
+ * @return the first byte from @code cur which is not an RFC 9110 token
+ * character, or @code end
+ */
+const char *skipTokenChars(const char *cur, const char *end);
+
+/**
+ * Case insensitive lookup of header @code name in a message head which
+ * starts with the request or status line
+ * @return value without surrounding spaces, its length is stored to
+ * @code valueLen, or `NULL`
+ */
+const char *findHeader(
+  const char *head, size_t headLen, const char *name, size_t *valueLen
+);
+
+/**
+ * copies header lines of @code head, without its first line, skipping
+ * headers named in @code excluded and lines which do not fit
+ * @return number of bytes written to @code dest
+ */
+size_t copyHeadersExcept(
+  char *       dest,
+  size_t       capacity,
+  const char * head,
+  size_t       headLen,
+  const char **excluded,
+  size_t       excludedQ
+);
+
+/**
+ * looks for @code directive in a comma separated header value like
+ * `Cache-Control`, numeric `directive=N` argument is stored to
+ * @code argument if it is not `NULL`, `-1` if there is none
+ */
+bool findHeaderDirective(
+  const char *value, size_t valueLen, const char *directive, long *argument
+);
+
+/**
+ * @return IMF-fixdate as unix time in ms or `ERROR`
+ */
+int64_t parseHttpDate(const char *value, size_t valueLen);
+
+int setNonBlocking(int socket);
+
 size_t sendN(int socket, const char *buffer, size_t size);
 
 // ssize_t recvN(int socket, void *buffer, size_t size);
@@ -92,24 +373,195 @@ size_t sendNWithTimeout(
   int socket, const char *buffer, size_t size, long mstimeout
 );
 
-int parseURL(const char *url, char *host, char *path, int *port);
+/**
+ * Parses the request head at the start of @code data without copying.
+ * Works on partial input: @code scanned keeps how many bytes are already
+ * known to hold no complete head, so the next call scans only new ones
+ * @return head length, `HTTP_PARSE_INCOMPLETE` or `ERROR` if the head is
+ * malformed
+ */
+ssize_t HttpRequestT_parse(
+  HttpRequestT *request, const char *data, size_t size, size_t *scanned
+);
 
-int getSocketOfRemote(const char *host, int port);
+/**
+ * @return value of the first header named @code name ignoring case or
+ * `NULL`
+ */
+const HttpSliceT *HttpRequestT_header(
+  const HttpRequestT *request, const char *name
+);
+
+/**
+ * Resolves the origin of an absolute-form `http://` target, or of an
+ * origin-form one with the `Host` header. @code host is lower cased and
+ * @code path goes without the leading slash. Buffers are `HOST_MAX_LEN`
+ * and `PATH_MAX_LEN` bytes
+ * @return `SUCCESS` or `ERROR` if the target is not routable
+ */
+int HttpRequestT_route(
+  const HttpRequestT *request, char *host, int *port, char *path
+);
+
+/**
+ * Resolves the authority-form `host:port` target of `CONNECT`, the port
+ * is required. @code host is lower cased, `HOST_MAX_LEN` bytes
+ * @return `SUCCESS` or `ERROR` if the target is malformed
+ */
+int HttpRequestT_tunnelTarget(
+  const HttpRequestT *request, char *host, int *port
+);
+
+bool HttpSliceT_equals(const HttpSliceT *slice, const char *literal);
+
+/**
+ * Resolves a `bytes=` value of `Range` against a representation of
+ * @code length bytes, unsatisfiable ranges are dropped
+ * @return number of ranges stored to @code ranges, `ERROR` if the value is
+ * malformed or has more than @code maxRanges ranges
+ */
+int parseByteRanges(
+  const HttpSliceT *value, size_t length, HttpByteRangeT *ranges,
+  int maxRanges
+);
+
+/**
+ * starts non-blocking connect, completion is reported by `EPOLLOUT`
+ * @param address resolved destination server address
+ * @param port destination server port
+ * @return server socket or `ERROR`
+ */
+int getSocketOfRemote(const DnsAddressT *address, int port);
+
+/**
+ * detects the body framing of a response with @code head
+ */
+void BodyFramingT_init(
+  BodyFramingT *framing, const char *head, size_t headLen, int statusCode
+);
+
+/**
+ * @return how many leading bytes of @code data belong to the body, `ERROR`
+ * on malformed chunked encoding. `done` is set once the body is complete
+ */
+ssize_t BodyFramingT_consume(
+  BodyFramingT *framing, const char *data, size_t size
+);
+
+UpstreamPoolT *UpstreamPoolT_new(
+  EventLoopT *loop, size_t maxIdlePerHost, long idleTimeout
+);
+
+/**
+ * @return live idle connection to @code host:port or `ERROR`, the caller
+ * registers it in the loop itself
+ */
+int UpstreamPoolT_checkout(UpstreamPoolT *pool, const char *host, int port);
+
+/**
+ * parks @code fd, already removed from the loop, or closes it when the
+ * per-host limit is reached
+ */
+void UpstreamPoolT_checkin(
+  UpstreamPoolT *pool, int fd, const char *host, int port
+);
+
+/**
+ * Thread safe registry of origins which failed to accept connections,
+ * each consecutive failure doubles the delay before the next attempt
+ */
+OriginBackoffT *OriginBackoffT_new(long initialDelay, long maxDelay);
+
+/**
+ * @return `true` if connecting to @code host:port should fail fast
+ */
+bool OriginBackoffT_isBlocked(OriginBackoffT *backoff, const char *host,
+                              int port);
+
+void OriginBackoffT_onFailure(OriginBackoffT *backoff, const char *host,
+                              int port);
+
+void OriginBackoffT_onSuccess(OriginBackoffT *backoff, const char *host,
+                              int port);
 
 int forwardDataWithTimeout(
   int clientSocket, int remoteSocket, long timeout, BufferT *buffer
 );
 
-int handleFileUpload(
+/**
+ * takes ownership of accepted non-blocking @code clientSocket
+ */
+void ClientContextT_start(ProxyWorkerT *worker, int clientSocket);
+
+/**
+ * Starts fetching @code entry url from origin over a pooled keep-alive
+ * connection when there is one. Headers of @code request are forwarded
+ * without hop-by-hop ones. Holds own reference to @code entry,
+ * on failure marks it `Failed` and removes it from the cache
+ * @return `SUCCESS` or `ERROR` if upload could not be started
+ */
+int UploadContextT_start(
+  ProxyWorkerT * worker,
   CacheEntryT *  entry,
-  const BufferT *buffer,
-  int            clientSocket, int remoteSocket
+  const char *   host,
+  int            port,
+  const char *   path,
+  const BufferT *request
 );
 
-void *downloadData(void *args);
+/**
+ * Sends @code request to origin over a new connection which asks to be
+ * closed, then both sockets go to `RelayT`. Nothing is cached. Takes
+ * ownership of @code clientSocket, on failure answers it with 502
+ * @return `SUCCESS` or `ERROR` if forwarding could not be started
+ */
+int UploadContextT_startRelay(
+  ProxyWorkerT * worker,
+  int            clientSocket,
+  const char *   host,
+  int            port,
+  const char *   path,
+  const BufferT *request
+);
 
-void startServer(int port);
+/**
+ * Opens a connection to @code host : @code port for `CONNECT`, answers
+ * the client `200 Connection Established` and tunnels both ways through
+ * `RelayT`. @code early bytes which the client sent after the request
+ * go to origin first. Takes ownership of @code clientSocket, on failure
+ * answers it with 502
+ * @return `SUCCESS` or `ERROR` if the tunnel could not be started
+ */
+int UploadContextT_startTunnel(
+  ProxyWorkerT *worker,
+  int           clientSocket,
+  const char *  host,
+  int           port,
+  const char *  early,
+  size_t        earlyLen
+);
+
+/**
+ * Moves bytes both ways between @code clientSocket and @code originSocket
+ * with `splice` until the pair is idle, or until origin ends its response.
+ * Only the rest of the request body tracked by @code requestBody goes to
+ * origin, the client is not read past it. A `NULL` @code requestBody
+ * makes a tunnel, which lasts until both sides end their streams. Takes
+ * ownership of both sockets, closes them on failure
+ * @return `SUCCESS` or `ERROR`
+ */
+int RelayT_start(
+  ProxyWorkerT *      worker,
+  int                 clientSocket,
+  int                 originSocket,
+  const BodyFramingT *requestBody
+);
+
+/**
+ * defaults: one worker per online cpu, shared listener
+ */
+void ProxyConfigT_init(ProxyConfigT *config);
 
-void *clientConnectionHandler(void *args);
+void startServer(const ProxyConfigT *config);
 
 #endif //PROXY_H
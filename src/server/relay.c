@@ -0,0 +1,285 @@
+#include "proxy.h"
+#include "../utils/log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#define RELAY_PIPE_SIZE 65536
+#define RELAY_PEEK_SIZE 16384
+
+/**
+ * One way of the relay, bytes move from the source socket to a pipe and
+ * from the pipe to the destination socket without user space copies
+ */
+typedef struct RelayDirection {
+  int          pipe[2];
+  size_t       pending;
+  size_t       delivered;
+  /**
+   * source reached end of stream
+   */
+  bool         eof;
+  /**
+   * everything is delivered and destination is shut down for writing
+   */
+  bool         shut;
+  /**
+   * the source is read up to the end of @code body only
+   */
+  bool         framed;
+  BodyFramingT body;
+} RelayDirectionT;
+
+/**
+ * Pumps bytes between a client and an origin connection until the origin
+ * side is done, or both sides of a tunnel are. Lives on the loop of the
+ * worker which started it
+ */
+struct Relay {
+  EventHandlerT   client;
+  EventHandlerT   origin;
+  EventTimerT     idleTimer;
+  ProxyWorkerT *  worker;
+  RelayDirectionT upstream;
+  RelayDirectionT downstream;
+  bool            tunnel;
+};
+
+static int RelayDirectionT_init(RelayDirectionT *direction) {
+  memset(direction, 0, sizeof(*direction));
+  if (pipe2(direction->pipe, O_NONBLOCK | O_CLOEXEC) != 0) {
+    direction->pipe[0] = ERROR;
+    direction->pipe[1] = ERROR;
+    return ERROR;
+  }
+  return SUCCESS;
+}
+
+static void RelayDirectionT_destroy(RelayDirectionT *direction) {
+  if (direction->pipe[0] >= 0) close(direction->pipe[0]);
+  if (direction->pipe[1] >= 0) close(direction->pipe[1]);
+}
+
+static void RelayT_close(RelayT *relay) {
+  EventLoopT *loop = relay->worker->loop;
+  logInfo("%s:%d relay of client %d finished, %zu bytes up, %zu down",
+          __FILE__, __LINE__, relay->client.fd,
+          relay->upstream.delivered, relay->downstream.delivered);
+  EventLoopT_disarmTimer(loop, &relay->idleTimer);
+  EventLoopT_remove(loop, &relay->client);
+  EventLoopT_remove(loop, &relay->origin);
+  close(relay->client.fd);
+  close(relay->origin.fd);
+  RelayDirectionT_destroy(&relay->upstream);
+  RelayDirectionT_destroy(&relay->downstream);
+  free(relay);
+}
+
+/**
+ * Splices up to @code size bytes of @code from into the pipe, a framed
+ * direction takes the body bytes only. A chunked body is parsed from a
+ * peek at the socket, the bytes are spliced after that
+ * @return bytes read, `0` at end of stream or `ERROR` with `errno` set
+ */
+static ssize_t fill(
+  RelayDirectionT *direction, const int from, const size_t size
+) {
+  const unsigned flags = SPLICE_F_NONBLOCK | SPLICE_F_MOVE;
+  if (!direction->framed) {
+    return splice(from, NULL, direction->pipe[1], NULL, size, flags);
+  }
+  BodyFramingT *body = &direction->body;
+  if (body->kind != BodyFramingChunked) {
+    const size_t  limit  = size < body->remaining ? size : body->remaining;
+    const ssize_t readed = splice(
+      from, NULL, direction->pipe[1], NULL, limit, flags
+    );
+    if (readed > 0) {
+      BodyFramingT_consume(body, NULL, readed);
+    }
+    return readed;
+  }
+
+  char          peeked[RELAY_PEEK_SIZE];
+  const ssize_t peekedLen = recv(
+    from, peeked, size < sizeof(peeked) ? size : sizeof(peeked), MSG_PEEK
+  );
+  if (peekedLen <= 0) {
+    return peekedLen;
+  }
+  const BodyFramingT before  = *body;
+  const ssize_t      bodyLen = BodyFramingT_consume(body, peeked, peekedLen);
+  if (bodyLen == ERROR) {
+    errno = EPROTO;
+    return ERROR;
+  }
+  const ssize_t readed = splice(
+    from, NULL, direction->pipe[1], NULL, bodyLen, flags
+  );
+  if (readed != bodyLen) {
+    /*
+     * the framing follows the bytes which really moved
+     */
+    *body = before;
+    BodyFramingT_consume(body, peeked, readed > 0 ? readed : 0);
+  }
+  return readed;
+}
+
+/**
+ * moves what is available from @code from to @code to
+ * @return bytes moved or `ERROR` on a connection failure
+ */
+static ssize_t pump(RelayDirectionT *direction, const int from, const int to) {
+  const unsigned flags = SPLICE_F_NONBLOCK | SPLICE_F_MOVE;
+  ssize_t        moved = 0;
+  while (1) {
+    bool progress = false;
+    /*
+     * past the end of a framed body the source is left unread
+     */
+    if (!direction->eof && direction->pending < RELAY_PIPE_SIZE
+        && !(direction->framed && direction->body.done)) {
+      const ssize_t readed = fill(
+        direction, from, RELAY_PIPE_SIZE - direction->pending
+      );
+      if (readed > 0) {
+        direction->pending += readed;
+        progress           = true;
+      } else if (readed == 0) {
+        direction->eof = true;
+      } else if (errno != EAGAIN && errno != EINTR) {
+        return ERROR;
+      }
+    }
+    if (direction->pending > 0) {
+      const ssize_t written = splice(
+        direction->pipe[0], NULL, to, NULL, direction->pending, flags
+      );
+      if (written > 0) {
+        direction->pending   -= written;
+        direction->delivered += written;
+        moved                += written;
+        progress             = true;
+      } else if (written < 0 && errno != EAGAIN && errno != EINTR) {
+        return ERROR;
+      }
+    }
+    if (!progress) break;
+  }
+  if (direction->eof && direction->pending == 0 && !direction->shut) {
+    shutdown(to, SHUT_WR);
+    direction->shut = true;
+  }
+  return moved;
+}
+
+static void onRelayEvent(RelayT *relay, const uint32_t events) {
+  if (events & EPOLLERR) {
+    RelayT_close(relay);
+    return;
+  }
+  const ssize_t sent = pump(
+    &relay->upstream, relay->client.fd, relay->origin.fd
+  );
+  const ssize_t received = pump(
+    &relay->downstream, relay->origin.fd, relay->client.fd
+  );
+  /*
+   * the origin has said everything once its side is delivered, a tunnel
+   * waits for the client too
+   */
+  const bool done = relay->downstream.shut
+                    && (!relay->tunnel || relay->upstream.shut);
+  if (sent == ERROR || received == ERROR || done) {
+    RelayT_close(relay);
+    return;
+  }
+  if (sent > 0 || received > 0) {
+    EventLoopT_armTimer(
+      relay->worker->loop, &relay->idleTimer, CLIENT_IDLE_TIMEOUT
+    );
+  }
+}
+
+static void onClientEvent(
+  EventLoopT *loop, EventHandlerT *handler, const uint32_t events
+) {
+  (void) loop;
+  onRelayEvent(CONTAINER_OF(handler, RelayT, client), events);
+}
+
+static void onOriginEvent(
+  EventLoopT *loop, EventHandlerT *handler, const uint32_t events
+) {
+  (void) loop;
+  onRelayEvent(CONTAINER_OF(handler, RelayT, origin), events);
+}
+
+static void onRelayTimeout(EventLoopT *loop, EventTimerT *timer) {
+  (void) loop;
+  RelayT *relay = CONTAINER_OF(timer, RelayT, idleTimer);
+  logInfo("%s:%d relay of client %d is idle, closing",
+          __FILE__, __LINE__, relay->client.fd);
+  RelayT_close(relay);
+}
+
+int RelayT_start(
+  ProxyWorkerT *      worker,
+  const int           clientSocket,
+  const int           originSocket,
+  const BodyFramingT *requestBody
+) {
+  EventLoopT *loop  = worker->loop;
+  RelayT *    relay = malloc(sizeof(*relay));
+  if (relay == NULL) {
+    logError("%s:%d malloc %s", __FILE__, __LINE__, strerror(errno));
+    goto relayFailed;
+  }
+  memset(relay, 0, sizeof(*relay));
+  relay->worker          = worker;
+  relay->tunnel          = requestBody == NULL;
+  relay->client.fd       = clientSocket;
+  relay->client.onEvent  = onClientEvent;
+  relay->origin.fd       = originSocket;
+  relay->origin.onEvent  = onOriginEvent;
+  EventTimerT_init(&relay->idleTimer, onRelayTimeout);
+
+  const bool piped = RelayDirectionT_init(&relay->upstream) == SUCCESS;
+  if (!piped || RelayDirectionT_init(&relay->downstream) != SUCCESS) {
+    logError("%s:%d pipe2 %s", __FILE__, __LINE__, strerror(errno));
+    if (piped) RelayDirectionT_destroy(&relay->upstream);
+    goto relayFailed;
+  }
+  if (requestBody != NULL) {
+    relay->upstream.framed = true;
+    relay->upstream.body   = *requestBody;
+  }
+
+  const uint32_t events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  if (EventLoopT_add(loop, &relay->client, events) != SUCCESS) {
+    logError("%s:%d EventLoopT_add %s", __FILE__, __LINE__, strerror(errno));
+    RelayDirectionT_destroy(&relay->upstream);
+    RelayDirectionT_destroy(&relay->downstream);
+    goto relayFailed;
+  }
+  if (EventLoopT_add(loop, &relay->origin, events) != SUCCESS) {
+    logError("%s:%d EventLoopT_add %s", __FILE__, __LINE__, strerror(errno));
+    EventLoopT_remove(loop, &relay->client);
+    RelayDirectionT_destroy(&relay->upstream);
+    RelayDirectionT_destroy(&relay->downstream);
+    goto relayFailed;
+  }
+  EventLoopT_armTimer(loop, &relay->idleTimer, CLIENT_IDLE_TIMEOUT);
+  return SUCCESS;
+
+relayFailed:
+  free(relay);
+  close(clientSocket);
+  close(originSocket);
+  return ERROR;
+}
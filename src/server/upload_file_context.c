@@ -1,116 +1,1220 @@
 #include "proxy.h"
 #include "../utils/log.h"
 
+#include <ctype.h>
 #include <errno.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
 
-typedef struct UploadArgs {
-  CacheEntryT *entry;
-  BufferT *    buffer;
-  int          remoteSocket;
-  int          clientSocket;
-} UploadArgsT;
+#define SUCCESS_STATUS 200
+#define NOT_MODIFIED_STATUS 304
+#define UPLOAD_READS_PER_EVENT 16
+#define REQUEST_LINE_RESERVE 64
 
-char *strstrn(const char * haystack,
-              const size_t haystackLen,
-              const char * needle,
-              const size_t needleLen) {
-  if (needleLen == 0) {
-    return (char *) haystack;
+typedef enum UploadState {
+  UploadResolving,
+  UploadConnecting,
+  UploadSendingRequest,
+  UploadReadingResponse,
+} UploadStateT;
+
+/**
+ * One of connects raced by happy eyeballs (RFC 8305), the winner fd is
+ * handed over to `UploadContextT.handler`
+ */
+typedef struct ConnectAttempt {
+  EventHandlerT   handler;
+  UploadContextT *ctx;
+} ConnectAttemptT;
+
+/**
+ * Fills one `CacheEntryT` from origin, lives on the loop of the client
+ * which started it
+ */
+struct UploadContext {
+  EventHandlerT   handler;
+  EventTimerT     timer;
+  DnsWaiterT      dnsWaiter;
+  /**
+   * woken when readers of an entry out of the index catch up
+   */
+  CacheEntryWaiterT producer;
+  DnsAddressesT   addresses;
+  ConnectAttemptT attempts[DNS_MAX_ADDRESSES];
+  int             attemptsActive;
+  int             nextAddress;
+  EventTimerT     attemptTimer;
+  ProxyWorkerT *worker;
+  UploadStateT  state;
+  /**
+   * `NULL` when relaying
+   */
+  CacheEntryT * entry;
+  /**
+   * client socket handed over to `RelayT` once the request is sent,
+   * `ERROR` when filling @code entry
+   */
+  int           relayFd;
+  /**
+   * relaying a `CONNECT` tunnel, @code request holds the bytes which the
+   * client sent after its head
+   */
+  bool          tunnel;
+  BufferT *     buffer;
+  /**
+   * kept with its @code requestCapacity while the context is pooled
+   */
+  char *        request;
+  size_t        requestCapacity;
+  size_t        requestLen;
+  size_t        requestSent;
+  char          host[HOST_MAX_LEN];
+  int           port;
+  int           statusCode;
+  size_t        headLen;
+  BodyFramingT  framing;
+  /**
+   * body of a relayed request left after the part sent with its head
+   */
+  BodyFramingT  requestFraming;
+  /**
+   * connection came from the pool, origin could have closed it meanwhile
+   */
+  bool          reused;
+  bool          keepAlive;
+  UploadContextT *nextFree;
+};
+
+/**
+ * never forwarded from the client, the proxy sets own ones, caches whole
+ * responses and sends cached requests without a body
+ */
+static const char *ReplacedHeaders[] = {
+  "Host", "Connection", "Proxy-Connection", "Keep-Alive", "TE", "Trailer",
+  "Transfer-Encoding", "Content-Length", "Upgrade", "Proxy-Authorization",
+  "If-None-Match", "If-Modified-Since", "Range", "If-Range",
+};
+
+/**
+ * relayed request bodies go as is, so their framing is kept
+ */
+static const char *RelayReplacedHeaders[] = {
+  "Host", "Connection", "Proxy-Connection", "Keep-Alive", "TE", "Upgrade",
+  "Proxy-Authorization",
+};
+
+static const char ConnectionEstablished[] =
+  "HTTP/1.1 200 Connection Established\r\n\r\n";
+
+/**
+ * Parses `HTTP/1.x SP 3DIGIT SP reason CRLF`, the reason is not checked
+ * @return status code, `0` if status line is not complete yet,
+ * `ERROR` if it is malformed
+ */
+static int parseStatusLine(const BufferT *buffer, bool *http11) {
+  const char *data    = buffer->data;
+  const char *lineEnd = strstrn(data, buffer->occupancy, "\r\n", 2);
+  if (lineEnd == NULL) {
+    return 0;
+  }
+  const size_t prefixLen = sizeof("HTTP/1.x 200") - 1;
+  if (lineEnd - data < (ptrdiff_t) prefixLen
+      || strncmp(data, "HTTP/1.", 7) != 0
+      || !isdigit((unsigned char) data[7])
+      || data[8] != ' ') {
+    return ERROR;
+  }
+  int statusCode = 0;
+  for (int i = 9; i < 12; ++i) {
+    if (!isdigit((unsigned char) data[i])) return ERROR;
+    statusCode = statusCode * 10 + (data[i] - '0');
+  }
+  if (statusCode < 100
+      || (lineEnd - data > (ptrdiff_t) prefixLen && data[12] != ' ')) {
+    return ERROR;
+  }
+  *http11 = data[7] >= '1';
+  return statusCode;
+}
+
+static void closeAttempt(
+  UploadContextT *ctx, EventLoopT *loop, ConnectAttemptT *attempt
+) {
+  EventLoopT_remove(loop, &attempt->handler);
+  close(attempt->handler.fd);
+  attempt->handler.fd = ERROR;
+  --ctx->attemptsActive;
+}
+
+static void closeAttempts(UploadContextT *ctx, EventLoopT *loop) {
+  for (int i = 0; i < DNS_MAX_ADDRESSES; ++i) {
+    if (ctx->attempts[i].handler.fd >= 0) {
+      closeAttempt(ctx, loop, &ctx->attempts[i]);
+    }
+  }
+  EventLoopT_disarmTimer(loop, &ctx->attemptTimer);
+}
+
+/**
+ * the origin failed before sending a new response: within its
+ * `stale-if-error` window the revalidated entry goes back to the index
+ * and readers of @code entry move to it
+ * @return `true` if the stale entry is served
+ */
+static bool serveStaleOnError(ProxyWorkerT *worker, CacheEntryT *entry) {
+  CacheEntryT *stale = entry->revalidates;
+  if (stale == NULL || atomic_load(&entry->downloadedSize) > 0
+      || !CacheEntryT_canServeOnError(stale, CacheT_nowMs())) {
+    return false;
+  }
+  logInfo("%s:%d origin failed, serving stale %s",
+          __FILE__, __LINE__, entry->url);
+  CacheManagerT_replace_CacheEntryT(worker->cacheManager, entry, stale);
+  atomic_store(&entry->servesStale, true);
+  return true;
+}
+
+/**
+ * publishes @code status to the entry readers, a relayed client gets an
+ * error reply instead
+ */
+static void completeEntry(UploadContextT *ctx, const CacheStatusT status) {
+  if (ctx->entry == NULL) {
+    sendError(ctx->relayFd, BadGatewayStatus, FailedToConnectRemoteServer);
+    close(ctx->relayFd);
+    return;
+  }
+  CacheEntryT_unthrottle(ctx->entry, &ctx->producer);
+  if (status == Failed && !serveStaleOnError(ctx->worker, ctx->entry)) {
+    CacheManagerT_remove_CacheEntryT(ctx->worker->cacheManager, ctx->entry);
+  }
+  if (status == Success) {
+    CacheEntryT *entry = ctx->entry;
+    entry->bodyLen     = atomic_load(&entry->downloadedSize) - entry->headLen;
+  }
+  CacheEntryT_updateStatus(ctx->entry, status);
+  if (CacheEntryT_release(ctx->entry)) {
+    CacheEntryT_delete(ctx->entry);
+  }
+}
+
+/**
+ * keeps @code ctx for the next upload of the worker unless its free list
+ * is full
+ */
+static void recycleContext(ProxyWorkerT *worker, UploadContextT *ctx) {
+  if (worker->freeUploadsQ == UPLOAD_POOL_MAX_FREE) {
+    free(ctx->request);
+    free(ctx);
+    return;
+  }
+  ctx->nextFree       = worker->freeUploads;
+  worker->freeUploads = ctx;
+  ++worker->freeUploadsQ;
+}
+
+/**
+ * @return `SUCCESS` or `ERROR` if there is no memory for @code capacity
+ * bytes of the request
+ */
+static int reserveRequest(UploadContextT *ctx, const size_t capacity) {
+  if (capacity <= ctx->requestCapacity) {
+    return SUCCESS;
+  }
+  char *request = realloc(ctx->request, capacity);
+  if (request == NULL) {
+    return ERROR;
+  }
+  ctx->request         = request;
+  ctx->requestCapacity = capacity;
+  return SUCCESS;
+}
+
+/**
+ * frees the context, also on success of a relay the sockets go to
+ * `RelayT`
+ */
+static void UploadContextT_destroy(UploadContextT *ctx, EventLoopT *loop) {
+  EventLoopT_disarmTimer(loop, &ctx->timer);
+  /*
+   * the resolver posts under its lock, nothing is posted once cancelled
+   */
+  DnsResolverT_cancel(ctx->worker->resolver, &ctx->dnsWaiter);
+  EventLoopT_cancelPost(loop, &ctx->handler);
+  closeAttempts(ctx, loop);
+  BufferPoolT_release(ctx->worker->bufferPool, ctx->buffer);
+  recycleContext(ctx->worker, ctx);
+}
+
+static void UploadContextT_finish(
+  UploadContextT *ctx, EventLoopT *loop, const CacheStatusT status
+) {
+  completeEntry(ctx, status);
+
+  if (ctx->handler.fd >= 0) {
+    EventLoopT_remove(loop, &ctx->handler);
+  }
+  if (status == Success && ctx->keepAlive && ctx->framing.done) {
+    UpstreamPoolT_checkin(
+      ctx->worker->upstreamPool, ctx->handler.fd, ctx->host, ctx->port
+    );
+  } else if (ctx->handler.fd >= 0) {
+    close(ctx->handler.fd);
+  }
+  UploadContextT_destroy(ctx, loop);
+}
+
+/**
+ * the request is sent, the rest of both streams goes through `RelayT`.
+ * A tunnel is confirmed to the client first, its socket buffer is empty
+ * and takes the reply at once, a client which does not is dropped
+ */
+static void startRelay(UploadContextT *ctx, EventLoopT *loop) {
+  EventLoopT_remove(loop, &ctx->handler);
+  const size_t replyLen = sizeof(ConnectionEstablished) - 1;
+  if (ctx->tunnel
+      && sendN(ctx->relayFd, ConnectionEstablished, replyLen) != replyLen) {
+    logError("%s:%d failed to confirm tunnel to client %d: %s",
+             __FILE__, __LINE__, ctx->relayFd, strerror(errno));
+    close(ctx->relayFd);
+    close(ctx->handler.fd);
+    UploadContextT_destroy(ctx, loop);
+    return;
+  }
+  RelayT_start(
+    ctx->worker, ctx->relayFd, ctx->handler.fd,
+    ctx->tunnel ? NULL : &ctx->requestFraming
+  );
+  UploadContextT_destroy(ctx, loop);
+}
+
+/**
+ * orders addresses as RFC 8305 suggests: families alternate starting with
+ * the one the resolver put first
+ */
+static void interleaveFamilies(DnsAddressesT *addresses) {
+  const DnsAddressT *preferred[DNS_MAX_ADDRESSES];
+  const DnsAddressT *others[DNS_MAX_ADDRESSES];
+  int                preferredQ = 0;
+  int                othersQ    = 0;
+  const sa_family_t  family     = addresses->list[0].addr.ss_family;
+  for (int i = 0; i < addresses->count; ++i) {
+    if (addresses->list[i].addr.ss_family == family) {
+      preferred[preferredQ++] = &addresses->list[i];
+    } else {
+      others[othersQ++] = &addresses->list[i];
+    }
+  }
+
+  DnsAddressesT ordered;
+  ordered.count = 0;
+  for (int i = 0; i < preferredQ || i < othersQ; ++i) {
+    if (i < preferredQ) ordered.list[ordered.count++] = *preferred[i];
+    if (i < othersQ) ordered.list[ordered.count++] = *others[i];
+  }
+  *addresses = ordered;
+}
+
+/**
+ * starts connecting to the next address, ones failing synchronously are
+ * skipped. The address after it is raced in `CONNECT_ATTEMPT_DELAY`
+ * unless some attempt completes earlier
+ * @return `ERROR` if no attempt is in flight
+ */
+static int startAttempt(UploadContextT *ctx, EventLoopT *loop) {
+  while (ctx->nextAddress < ctx->addresses.count) {
+    ConnectAttemptT *  attempt = &ctx->attempts[ctx->nextAddress];
+    const DnsAddressT *address = &ctx->addresses.list[ctx->nextAddress++];
+
+    attempt->handler.fd = getSocketOfRemote(address, ctx->port);
+    if (attempt->handler.fd < 0) {
+      logError("%s, %d failed getSocketOfRemote of host:port %s:%d",
+               __FILE__, __LINE__, ctx->host, ctx->port);
+      continue;
+    }
+    if (EventLoopT_add(loop, &attempt->handler, EPOLLOUT | EPOLLET)
+        != SUCCESS) {
+      logError("%s:%d EventLoopT_add %s", __FILE__, __LINE__, strerror(errno));
+      close(attempt->handler.fd);
+      attempt->handler.fd = ERROR;
+      continue;
+    }
+    ++ctx->attemptsActive;
+    if (ctx->nextAddress < ctx->addresses.count) {
+      EventLoopT_armTimer(loop, &ctx->attemptTimer, CONNECT_ATTEMPT_DELAY);
+    }
+    return SUCCESS;
+  }
+  return ctx->attemptsActive > 0 ? SUCCESS : ERROR;
+}
+
+/**
+ * resolves origin host and starts connecting to it, while the lookup is
+ * pending the context waits for a post from the resolver without fd.
+ * Origins in backoff after recent connect failures are not tried
+ * @return `SUCCESS` if resolving or connecting is in progress
+ */
+static int startConnect(UploadContextT *ctx, EventLoopT *loop) {
+  const long connectTimeout = ctx->worker->config->connectTimeout;
+  if (OriginBackoffT_isBlocked(ctx->worker->backoff, ctx->host, ctx->port)) {
+    logError("%s:%d origin %s:%d is backed off",
+             __FILE__, __LINE__, ctx->host, ctx->port);
+    return ERROR;
+  }
+
+  const int status = DnsResolverT_resolve(
+    ctx->worker->resolver, ctx->host, &ctx->addresses, &ctx->dnsWaiter
+  );
+  if (status == DNS_PENDING) {
+    ctx->state = UploadResolving;
+    EventLoopT_armTimer(loop, &ctx->timer, connectTimeout);
+    return SUCCESS;
+  }
+  if (status == DNS_FAILED) {
+    logError("%s:%d failed to resolve %s", __FILE__, __LINE__, ctx->host);
+    return ERROR;
+  }
+
+  interleaveFamilies(&ctx->addresses);
+  ctx->nextAddress = 0;
+  if (startAttempt(ctx, loop) != SUCCESS) {
+    return ERROR;
+  }
+  ctx->state = UploadConnecting;
+  EventLoopT_armTimer(loop, &ctx->timer, connectTimeout);
+  return SUCCESS;
+}
+
+static void onConnectFailed(UploadContextT *ctx, EventLoopT *loop) {
+  OriginBackoffT_onFailure(ctx->worker->backoff, ctx->host, ctx->port);
+  UploadContextT_finish(ctx, loop, Failed);
+}
+
+/**
+ * pooled connection turned out to be closed by origin before it answered,
+ * the request is idempotent, so it is repeated once on a new connection
+ * @return `SUCCESS` if the new connect is started
+ */
+static int retryOnNewConnection(UploadContextT *ctx, EventLoopT *loop) {
+  if (!ctx->reused || ctx->statusCode != 0 || ctx->buffer->occupancy != 0) {
+    return ERROR;
+  }
+  logInfo("%s:%d pooled connection to %s:%d is stale, reconnecting",
+          __FILE__, __LINE__, ctx->host, ctx->port);
+  EventLoopT_cancelPost(loop, &ctx->handler);
+  EventLoopT_remove(loop, &ctx->handler);
+  close(ctx->handler.fd);
+
+  ctx->handler.fd  = ERROR;
+  ctx->requestSent = 0;
+  ctx->reused      = false;
+  return startConnect(ctx, loop);
+}
+
+static void UploadContextT_fail(UploadContextT *ctx, EventLoopT *loop) {
+  if (retryOnNewConnection(ctx, loop) != SUCCESS) {
+    UploadContextT_finish(ctx, loop, Failed);
+  }
+}
+
+/**
+ * @return `SUCCESS` when whole request is sent, `TIMEOUT_EXPIRED` if socket
+ * is not writable now, `ERROR` otherwise
+ */
+static int sendRequest(UploadContextT *ctx) {
+  while (ctx->requestSent < ctx->requestLen) {
+    const ssize_t sent = send(
+      ctx->handler.fd,
+      ctx->request + ctx->requestSent,
+      ctx->requestLen - ctx->requestSent,
+      MSG_NOSIGNAL
+    );
+    if (sent < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return TIMEOUT_EXPIRED;
+      logError("%s:%d send %s", __FILE__, __LINE__, strerror(errno));
+      return ERROR;
+    }
+    ctx->requestSent += sent;
   }
+  return SUCCESS;
+}
+
+/**
+ * Freshness lifetime by RFC 9111: `s-maxage`, `max-age`, `Expires` minus
+ * `Date`, the configured default otherwise, reduced by `Age`
+ * @return expiration time in wall clock ms or `ERROR` if the response must
+ * not be stored
+ */
+static int64_t responseExpiresAt(
+  const UploadContextT *ctx, const char *head, const size_t headLen
+) {
+  const int64_t now      = CacheT_nowMs();
+  int64_t       ttl      = (int64_t) ctx->worker->config->cache.entryThreshold;
+  bool          hasMaxAge = false;
+  size_t        valueLen = 0;
 
-  for (size_t i = 0; i <= haystackLen - needleLen; i++) {
-    if (strncmp(&haystack[i], needle, needleLen) == 0) {
-      return (char *) &haystack[i];
+  const char *cacheControl = findHeader(
+    head, headLen, "Cache-Control", &valueLen
+  );
+  if (cacheControl != NULL) {
+    long seconds = -1;
+    if (findHeaderDirective(cacheControl, valueLen, "no-store", NULL)
+        || findHeaderDirective(cacheControl, valueLen, "private", NULL)) {
+      return ERROR;
+    }
+    if (findHeaderDirective(cacheControl, valueLen, "no-cache", NULL)) {
+      return now;
+    }
+    if ((findHeaderDirective(cacheControl, valueLen, "s-maxage", &seconds)
+         || findHeaderDirective(cacheControl, valueLen, "max-age", &seconds))
+        && seconds >= 0) {
+      ttl      = (int64_t) seconds * 1000;
+      hasMaxAge = true;
     }
   }
 
-  return NULL; // Подстрока не найдена
+  const char *expires = hasMaxAge
+                          ? NULL
+                          : findHeader(head, headLen, "Expires", &valueLen);
+  if (expires != NULL) {
+    const int64_t expiresMs = parseHttpDate(expires, valueLen);
+    const char *  date      = findHeader(head, headLen, "Date", &valueLen);
+    const int64_t dateMs    = date != NULL ? parseHttpDate(date, valueLen) : now;
+    /*
+     * malformed Expires means already expired
+     */
+    ttl = expiresMs == ERROR || dateMs == ERROR ? 0 : expiresMs - dateMs;
+  }
+
+  const char *age = findHeader(head, headLen, "Age", &valueLen);
+  if (age != NULL) {
+    ttl -= strtol(age, NULL, 10) * 1000;
+  }
+  return ttl > 0 ? now + ttl : now;
+}
+
+/**
+ * stores `stale-while-revalidate` and `stale-if-error` of the response in
+ * @code entry
+ */
+static void storeStaleWindows(
+  CacheEntryT *entry, const char *head, const size_t headLen
+) {
+  size_t      valueLen     = 0;
+  const char *cacheControl = findHeader(
+    head, headLen, "Cache-Control", &valueLen
+  );
+  long seconds = -1;
+  if (cacheControl == NULL) return;
+  if (findHeaderDirective(
+        cacheControl, valueLen, "stale-while-revalidate", &seconds
+      ) && seconds > 0) {
+    entry->staleWhileRevalidate = (int64_t) seconds * 1000;
+  }
+  if (findHeaderDirective(cacheControl, valueLen, "stale-if-error", &seconds)
+      && seconds > 0) {
+    entry->staleIfError = (int64_t) seconds * 1000;
+  }
 }
 
-/*int isStatusCode200(const char *response, ) {
-  return strstrn(response, "HTTP/1.1 200 OK", ) != NULL || strstr(
-           response, "HTTP/1.0 200 OK") != NULL;
-}*/
+/**
+ * @return copy of header @code name value or `NULL` if it is absent or
+ * there is no memory
+ */
+static char *copyHeader(
+  const char *head, const size_t headLen, const char *name
+) {
+  size_t      valueLen = 0;
+  const char *value    = findHeader(head, headLen, name, &valueLen);
+  return value != NULL ? strndup(value, valueLen) : NULL;
+}
 
-void *fileUploaderStartup(void *args) {
-  UploadArgsT *uploadArgs   = args;
-  CacheEntryT *entry        = uploadArgs->entry;
-  BufferT *    buffer       = uploadArgs->buffer;
-  const int    remoteSocket = uploadArgs->remoteSocket;
-  int          uploadStatus = SUCCESS;
-  while (1) {
-    const size_t readed = recvNWithTimeout(
-      remoteSocket, buffer->data, buffer->maxSize, SEND_RECV_TIMEOUT
+/**
+ * origin answered the conditional request with `304`: the stale entry gets
+ * the new lifetime and goes back to the index, unless it is still there
+ * for a background refresh. Readers of the placeholder move to it once it
+ * is finished
+ */
+static void refreshStale(UploadContextT *ctx, const int64_t expiresAt) {
+  CacheEntryT *entry = ctx->entry;
+  CacheEntryT *stale = entry->revalidates;
+  logDebug("%s:%d %s is not modified", __FILE__, __LINE__, entry->url);
+  if (expiresAt == ERROR) {
+    CacheManagerT_remove_CacheEntryT(ctx->worker->cacheManager, entry);
+  } else {
+    const int64_t now = CacheT_nowMs();
+    atomic_store(&stale->expiresAt, expiresAt > now ? expiresAt : now);
+    CacheManagerT_replace_CacheEntryT(
+      ctx->worker->cacheManager, entry, stale
     );
-    if (errno != 0) {
-      logError("%s:%d recv %s",__FILE__, __LINE__, strerror(errno));
-      uploadStatus = ERROR;
-      break;
+  }
+  atomic_store(&entry->servesStale, true);
+}
+
+/**
+ * the origin sent a new response, the stale entry is not needed anymore.
+ * A background refresh takes its place in the index
+ */
+static void dropStale(ProxyWorkerT *worker, CacheEntryT *entry) {
+  CacheEntryT *stale = entry->revalidates;
+  entry->revalidates = NULL;
+  if (!atomic_load(&entry->inCache) && atomic_load(&stale->revalidating)) {
+    CacheManagerT_replace_CacheEntryT(worker->cacheManager, stale, entry);
+    atomic_store(&stale->revalidating, false);
+  }
+  if (CacheEntryT_release(stale)) {
+    CacheEntryT_delete(stale);
+  }
+}
+
+/**
+ * parses the status line and headers once the whole head is received,
+ * headers not fitting the buffer are treated as absent
+ */
+static int storeResponseHead(UploadContextT *ctx) {
+  BufferT *   buffer     = ctx->buffer;
+  bool        http11     = false;
+  const int   statusCode = parseStatusLine(buffer, &http11);
+  const bool  bufferFull = buffer->occupancy >= buffer->maxSize - 1;
+  const char *headEnd    = findHeadEnd(buffer->data, buffer->occupancy);
+  if ((statusCode == 0 || headEnd == NULL) && !bufferFull) {
+    return SUCCESS;
+  }
+  if (statusCode <= 0) {
+    logError("%s:%d malformed response status line", __FILE__, __LINE__);
+    return ERROR;
+  }
+
+  if (statusCode < 200 && statusCode != 101 && headEnd != NULL) {
+    /*
+     * interim responses are dropped, the final one follows
+     */
+    const size_t interimLen = headEnd + 4 - buffer->data;
+    memmove(buffer->data, headEnd + 4, buffer->occupancy - interimLen);
+    buffer->occupancy -= interimLen;
+    buffer->data[buffer->occupancy] = '\0';
+    return storeResponseHead(ctx);
+  }
+
+  const size_t headLen = headEnd != NULL
+                           ? (size_t) (headEnd - buffer->data) + 2
+                           : buffer->occupancy;
+  const int64_t expiresAt = responseExpiresAt(ctx, buffer->data, headLen);
+
+  BodyFramingT_init(&ctx->framing, buffer->data, headLen, statusCode);
+  if (headEnd == NULL) {
+    ctx->framing.kind = BodyFramingClose;
+    ctx->framing.done = false;
+  }
+  size_t      valueLen   = 0;
+  const char *connection = findHeader(
+    buffer->data, headLen, "Connection", &valueLen
+  );
+  bool keepAlive = http11;
+  if (connection != NULL) {
+    keepAlive = http11
+                  ? !findHeaderDirective(connection, valueLen, "close", NULL)
+                  : findHeaderDirective(
+                    connection, valueLen, "keep-alive", NULL
+                  );
+  }
+  ctx->keepAlive  = keepAlive && ctx->framing.kind != BodyFramingClose;
+  ctx->headLen    = headEnd != NULL ? headLen + 2 : headLen;
+  ctx->statusCode = statusCode;
+  CacheEntryT *stale = ctx->entry->revalidates;
+  if (stale != NULL) {
+    if (statusCode == NOT_MODIFIED_STATUS) {
+      refreshStale(ctx, expiresAt);
+      return SUCCESS;
+    }
+    if (statusCode >= 500 && CacheEntryT_canServeOnError(
+                               stale, CacheT_nowMs()
+                             )) {
+      logInfo("%s:%d origin answered %d for %s",
+              __FILE__, __LINE__, statusCode, ctx->entry->url);
+      return ERROR;
+    }
+    dropStale(ctx->worker, ctx->entry);
+  }
+  ctx->entry->headLen     = headEnd != NULL ? ctx->headLen : 0;
+  ctx->entry->bodyFraming = ctx->framing.kind;
+  if (ctx->framing.kind == BodyFramingLength) {
+    ctx->entry->expectedSize = ctx->headLen + ctx->framing.remaining;
+  }
+
+  ctx->entry->httpStatusCode = statusCode;
+  if (statusCode != SUCCESS_STATUS || expiresAt == ERROR) {
+    CacheManagerT_remove_CacheEntryT(ctx->worker->cacheManager, ctx->entry);
+    CacheEntryT_markNotCacheable(ctx->entry);
+    return SUCCESS;
+  }
+  ctx->entry->etag         = copyHeader(buffer->data, headLen, "ETag");
+  ctx->entry->lastModified = copyHeader(
+    buffer->data, headLen, "Last-Modified"
+  );
+  storeStaleWindows(ctx->entry, buffer->data, headLen);
+  const bool validated = ctx->entry->etag != NULL
+                         || ctx->entry->lastModified != NULL;
+  if (expiresAt <= CacheT_nowMs() && !validated) {
+    /*
+     * readers already attached get this response, later ones refetch
+     */
+    CacheManagerT_remove_CacheEntryT(ctx->worker->cacheManager, ctx->entry);
+  } else {
+    /*
+     * an already stale response with validators is revalidated next time
+     */
+    ctx->entry->expiresAt = expiresAt;
+  }
+  return SUCCESS;
+}
+
+/**
+ * runs @code data received into @code dest through the body framing and
+ * publishes the part belonging to the response, the head is already
+ * accounted in @code bodyStart
+ * @return `SUCCESS` or `ERROR` for a malformed body
+ */
+static int storeReceived(
+  UploadContextT *ctx, const char *data, const size_t size,
+  const size_t bodyStart, const bool inStore
+) {
+  const ssize_t bodyLen = BodyFramingT_consume(
+    &ctx->framing, data + bodyStart, size - bodyStart
+  );
+  if (bodyLen == ERROR) {
+    logError("%s:%d malformed chunked body of %s",
+             __FILE__, __LINE__, ctx->entry->url);
+    return ERROR;
+  }
+  const size_t messageLen = bodyStart + bodyLen;
+  if (messageLen < size) {
+    /*
+     * origin sent more than the response, the connection is unusable
+     */
+    ctx->keepAlive = false;
+  }
+
+  if (inStore) {
+    CacheEntryT_commitData(ctx->entry, messageLen, InProcess);
+  } else if (CacheEntryT_appendData(
+               ctx->entry, data, messageLen, InProcess
+             ) == NULL) {
+    logError("%s:%d fillCache %s",__FILE__, __LINE__, strerror(errno));
+    return ERROR;
+  }
+  CacheManagerT_account_CacheEntryT(ctx->worker->cacheManager, ctx->entry);
+  return SUCCESS;
+}
+
+/**
+ * the head is collected in own buffer to be parsed, the body is received
+ * straight into the entry storage
+ */
+static void readResponse(UploadContextT *ctx, EventLoopT *loop) {
+  BufferT *buffer = ctx->buffer;
+  for (int reads = 0; reads < UPLOAD_READS_PER_EVENT; ++reads) {
+    const CacheEntryT *entry = ctx->entry;
+    /*
+     * the index holds a reference while the entry is cached, a background
+     * refresh has no readers until its response replaces the stale entry
+     */
+    if (atomic_load(&entry->usersQ) <= 1 && entry->revalidates == NULL) {
+      logInfo("%s:%d nobody waits for %s", __FILE__, __LINE__, entry->url);
+      UploadContextT_finish(ctx, loop, Failed);
+      return;
+    }
+
+    const bool inStore = ctx->statusCode != 0;
+    if (inStore && CacheEntryT_throttle(ctx->entry, &ctx->producer)) {
+      /*
+       * origin waits in the socket buffers until the readers catch up
+       */
+      CacheEntryT_flush(ctx->entry);
+      EventLoopT_disarmTimer(loop, &ctx->timer);
+      return;
+    }
+    char *     dest    = buffer->data + buffer->occupancy;
+    size_t     space   = buffer->maxSize - buffer->occupancy - 1;
+    if (inStore) {
+      dest = CacheEntryT_reserveData(ctx->entry, &space);
+      if (dest == NULL) {
+        UploadContextT_finish(ctx, loop, Failed);
+        return;
+      }
+    }
+    const ssize_t readed = recv(ctx->handler.fd, dest, space, 0);
+    if (readed < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        /*
+         * readers are woken in batches, the origin pause ends a batch
+         */
+        CacheEntryT_flush(ctx->entry);
+        EventLoopT_armTimer(
+          loop, &ctx->timer,
+          ctx->statusCode > 0 ? UPSTREAM_READ_TIMEOUT : CONNECT_TIMEOUT
+        );
+        return;
+      }
+      logError("%s:%d recv %s", __FILE__, __LINE__, strerror(errno));
+      UploadContextT_fail(ctx, loop);
+      return;
     }
     if (readed == 0) {
-      break;
+      /*
+       * only a close-delimited body may end with the connection
+       */
+      if (ctx->statusCode > 0 && ctx->framing.kind == BodyFramingClose) {
+        UploadContextT_finish(ctx, loop, Success);
+      } else {
+        UploadContextT_fail(ctx, loop);
+      }
+      return;
     }
 
-    buffer->occupancy          = readed;
-    CacheEntryChunkT *curChunk = CacheEntryT_appendData(
-      entry, buffer->data, buffer->occupancy, InProcess
+    EventLoopT_disarmTimer(loop, &ctx->timer);
+    int ret;
+    if (inStore) {
+      ret = storeReceived(ctx, dest, readed, 0, true);
+    } else {
+      buffer->occupancy += readed;
+      buffer->data[buffer->occupancy] = '\0';
+      if (storeResponseHead(ctx) != SUCCESS) {
+        UploadContextT_finish(ctx, loop, Failed);
+        return;
+      }
+      if (ctx->statusCode == 0) continue;
+      if (atomic_load(&ctx->entry->servesStale)) {
+        ctx->keepAlive = ctx->keepAlive
+                         && buffer->occupancy == ctx->headLen;
+        UploadContextT_finish(ctx, loop, Success);
+        return;
+      }
+      ret = storeReceived(
+        ctx, buffer->data, buffer->occupancy, ctx->headLen, false
+      );
+      buffer->occupancy = 0;
+    }
+    if (ret != SUCCESS) {
+      UploadContextT_finish(ctx, loop, Failed);
+      return;
+    }
+    if (ctx->framing.done) {
+      UploadContextT_finish(ctx, loop, Success);
+      return;
+    }
+  }
+  EventLoopT_post(loop, &ctx->handler);
+}
+
+static void onUploadEvent(
+  EventLoopT *loop, EventHandlerT *handler, const uint32_t events
+) {
+  (void) events;
+  UploadContextT *ctx = CONTAINER_OF(handler, UploadContextT, handler);
+
+  if (ctx->state == UploadResolving) {
+    if (startConnect(ctx, loop) != SUCCESS) {
+      UploadContextT_finish(ctx, loop, Failed);
+    }
+    return;
+  }
+  if (ctx->state == UploadConnecting) {
+    /*
+     * connect attempts have own handlers, this one has no fd yet
+     */
+    return;
+  }
+
+  if (ctx->state == UploadSendingRequest) {
+    const int ret = sendRequest(ctx);
+    if (ret == ERROR) {
+      UploadContextT_fail(ctx, loop);
+      return;
+    }
+    if (ret == TIMEOUT_EXPIRED) {
+      EventLoopT_armTimer(loop, &ctx->timer, SEND_RECV_TIMEOUT);
+      return;
+    }
+    ctx->state = UploadReadingResponse;
+    if (ctx->entry == NULL) {
+      startRelay(ctx, loop);
+      return;
+    }
+  }
+
+  readResponse(ctx, loop);
+}
+
+/**
+ * the first attempt to connect wins, the rest are closed and its fd moves
+ * to the context handler
+ */
+static void onAttemptEvent(
+  EventLoopT *loop, EventHandlerT *handler, const uint32_t events
+) {
+  ConnectAttemptT *attempt = CONTAINER_OF(handler, ConnectAttemptT, handler);
+  UploadContextT * ctx     = attempt->ctx;
+  if ((events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) == 0) return;
+
+  int       error    = 0;
+  socklen_t errorLen = sizeof(error);
+  getsockopt(handler->fd, SOL_SOCKET, SO_ERROR, &error, &errorLen);
+  if (error != 0) {
+    logError("%s:%d failed to connect %s:%d : %s",
+             __FILE__, __LINE__, ctx->host, ctx->port, strerror(error));
+    closeAttempt(ctx, loop, attempt);
+    EventLoopT_disarmTimer(loop, &ctx->attemptTimer);
+    if (startAttempt(ctx, loop) != SUCCESS) {
+      onConnectFailed(ctx, loop);
+    }
+    return;
+  }
+
+  const int fd = handler->fd;
+  EventLoopT_remove(loop, handler);
+  handler->fd = ERROR;
+  --ctx->attemptsActive;
+  closeAttempts(ctx, loop);
+  OriginBackoffT_onSuccess(ctx->worker->backoff, ctx->host, ctx->port);
+
+  ctx->handler.fd = fd;
+  if (EventLoopT_add(
+        loop, &ctx->handler, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET
+      ) != SUCCESS) {
+    logError("%s:%d EventLoopT_add %s", __FILE__, __LINE__, strerror(errno));
+    UploadContextT_finish(ctx, loop, Failed);
+    return;
+  }
+  ctx->state = UploadSendingRequest;
+  onUploadEvent(loop, &ctx->handler, EPOLLOUT);
+}
+
+/**
+ * the last started attempt is slow, race the next address along with it
+ */
+static void onAttemptDelay(EventLoopT *loop, EventTimerT *timer) {
+  UploadContextT *ctx = CONTAINER_OF(timer, UploadContextT, attemptTimer);
+  if (startAttempt(ctx, loop) != SUCCESS) {
+    onConnectFailed(ctx, loop);
+  }
+}
+
+/**
+ * silence is never the end of a body, even of a close-delimited one
+ */
+static void onUploadTimeout(EventLoopT *loop, EventTimerT *timer) {
+  UploadContextT *ctx = CONTAINER_OF(timer, UploadContextT, timer);
+  logError("%s:%d upstream timeout for %s:%d",
+           __FILE__, __LINE__, ctx->host, ctx->port);
+  if (ctx->state == UploadConnecting) {
+    onConnectFailed(ctx, loop);
+    return;
+  }
+  UploadContextT_finish(ctx, loop, Failed);
+}
+
+static void onResolved(DnsWaiterT *waiter) {
+  UploadContextT *ctx = CONTAINER_OF(waiter, UploadContextT, dnsWaiter);
+  EventLoopT_post(ctx->worker->loop, &ctx->handler);
+}
+
+static void onReadersAdvanced(CacheEntryWaiterT *waiter) {
+  UploadContextT *ctx = CONTAINER_OF(waiter, UploadContextT, producer);
+  EventLoopT_post(ctx->worker->loop, &ctx->handler);
+}
+
+/**
+ * Rewrites the absolute-form client request into an origin-form keep-alive
+ * one: `METHOD /path HTTP/1.1`, own `Host` and `Connection`, the rest of
+ * client headers as is. Client conditionals do not reach origin on behalf
+ * of the cache, a revalidation sends validators of the stale entry
+ * instead. A relayed request asks to close the connection and is
+ * followed by the part of its body already received from the client,
+ * @code requestFraming tracks the rest for the relay. Bytes past the body
+ * belong to a pipelined request and never reach origin, the relay stops
+ * reading the client with the body and closes it with the response
+ * @return `SUCCESS` or `ERROR` if the request head is incomplete, its
+ * chunked body is malformed or there is no memory
+ */
+static int formatRequest(
+  UploadContextT *ctx,
+  const char *    host,
+  const int       port,
+  const char *    path,
+  const BufferT * request
+) {
+  const char *data    = request->data;
+  const char *headEnd = findHeadEnd(data, request->occupancy);
+  const char *method  = memchr(data, ' ', request->occupancy);
+  if (headEnd == NULL || method == NULL) {
+    return ERROR;
+  }
+
+  const CacheEntryT *stale    = ctx->entry != NULL
+                                 ? ctx->entry->revalidates
+                                 : NULL;
+  size_t             capacity = request->occupancy + strlen(host)
+                                + strlen(path) + REQUEST_LINE_RESERVE;
+  if (stale != NULL) {
+    capacity += (stale->etag != NULL ? strlen(stale->etag) : 0)
+                + (stale->lastModified != NULL ? strlen(stale->lastModified)
+                                               : 0)
+                + REQUEST_LINE_RESERVE;
+  }
+  if (reserveRequest(ctx, capacity) != SUCCESS) {
+    return ERROR;
+  }
+  int len = snprintf(
+    ctx->request, capacity, "%.*s /%s HTTP/1.1\r\nHost: %s",
+    (int) (method - data), data, path, host
+  );
+  if (port != DEF_HTTP_PORT) {
+    len += snprintf(ctx->request + len, capacity - len, ":%d", port);
+  }
+  len += snprintf(ctx->request + len, capacity - len, "\r\n");
+
+  const bool   relayed = ctx->entry == NULL;
+  const size_t headLen = headEnd + 4 - data;
+  if (relayed) {
+    len += copyHeadersExcept(
+      ctx->request + len, capacity - len, data, headLen,
+      RelayReplacedHeaders,
+      sizeof(RelayReplacedHeaders) / sizeof(*RelayReplacedHeaders)
     );
-    if (curChunk == NULL) {
-      logError("%s:%d fillCache %s",__FILE__, __LINE__, strerror(errno));
-      uploadStatus = ERROR;
-      break;
+  } else {
+    len += copyHeadersExcept(
+      ctx->request + len, capacity - len, data, headLen,
+      ReplacedHeaders, sizeof(ReplacedHeaders) / sizeof(*ReplacedHeaders)
+    );
+  }
+  if (stale != NULL && stale->etag != NULL) {
+    len += snprintf(ctx->request + len, capacity - len,
+                    "If-None-Match: %s\r\n", stale->etag);
+  }
+  if (stale != NULL && stale->lastModified != NULL) {
+    len += snprintf(ctx->request + len, capacity - len,
+                    "If-Modified-Since: %s\r\n", stale->lastModified);
+  }
+  len += snprintf(
+    ctx->request + len, capacity - len, "Connection: %s\r\n\r\n",
+    relayed ? "close" : "keep-alive"
+  );
+  if (relayed) {
+    /*
+     * a request without `Content-Length` or chunked encoding has no body
+     */
+    BodyFramingT *framing = &ctx->requestFraming;
+    BodyFramingT_init(framing, data, headLen, SUCCESS_STATUS);
+    ssize_t bodyLen = 0;
+    if (framing->kind == BodyFramingClose) {
+      framing->done = true;
+    } else {
+      bodyLen = BodyFramingT_consume(
+        framing, headEnd + 4, request->occupancy - headLen
+      );
+    }
+    if (bodyLen == ERROR) {
+      return ERROR;
     }
+    memcpy(ctx->request + len, headEnd + 4, bodyLen);
+    len += bodyLen;
   }
+  ctx->requestLen = len;
+  return SUCCESS;
+}
 
-  if (uploadStatus == SUCCESS) {
-    CacheEntryT_updateStatus(entry, Success);
+/**
+ * @return context with @code request formatted, if there is one, or
+ * `NULL`. The response buffer is only taken when the response goes to
+ * @code entry
+ */
+static UploadContextT *UploadContextT_new(
+  ProxyWorkerT * worker,
+  CacheEntryT *  entry,
+  const char *   host,
+  const int      port,
+  const char *   path,
+  const BufferT *request
+) {
+  UploadContextT *ctx            = worker->freeUploads;
+  char *          pooledRequest  = NULL;
+  size_t          pooledCapacity = 0;
+  if (ctx != NULL) {
+    worker->freeUploads = ctx->nextFree;
+    --worker->freeUploadsQ;
+    pooledRequest  = ctx->request;
+    pooledCapacity = ctx->requestCapacity;
   } else {
-    CacheEntryT_updateStatus(entry, Failed);
+    ctx = malloc(sizeof(*ctx));
+  }
+  if (ctx == NULL) {
+    logError("%s, %d malloc", __FILE__, __LINE__);
+    return NULL;
+  }
+  memset(ctx, 0, sizeof(*ctx));
+  ctx->request          = pooledRequest;
+  ctx->requestCapacity  = pooledCapacity;
+  ctx->worker           = worker;
+  ctx->entry            = entry;
+  ctx->relayFd          = ERROR;
+  ctx->port             = port;
+  snprintf(ctx->host, sizeof(ctx->host), "%s", host);
+  ctx->handler.fd       = ERROR;
+  ctx->handler.onEvent  = onUploadEvent;
+  ctx->dnsWaiter.notify = onResolved;
+  ctx->producer.notify  = onReadersAdvanced;
+  EventTimerT_init(&ctx->timer, onUploadTimeout);
+  EventTimerT_init(&ctx->attemptTimer, onAttemptDelay);
+  for (int i = 0; i < DNS_MAX_ADDRESSES; ++i) {
+    ctx->attempts[i].handler.fd      = ERROR;
+    ctx->attempts[i].handler.onEvent = onAttemptEvent;
+    ctx->attempts[i].ctx             = ctx;
   }
 
-  free(uploadArgs);
+  if (entry != NULL) {
+    ctx->buffer = BufferPoolT_acquire(worker->bufferPool, BUFFER_SIZE);
+    if (ctx->buffer == NULL) {
+      logError("%s, %d BufferT_new %s", __FILE__, __LINE__, strerror(errno));
+      goto newFailed;
+    }
+  }
+  if (request != NULL
+      && formatRequest(ctx, host, port, path, request) != SUCCESS) {
+    logError("%s, %d failed to format request to %s:%d",
+             __FILE__, __LINE__, host, port);
+    goto newFailed;
+  }
+  return ctx;
+
+newFailed:
+  BufferPoolT_release(worker->bufferPool, ctx->buffer);
+  recycleContext(worker, ctx);
   return NULL;
 }
 
-int handleFileUpload(CacheEntryT *  entry,
-                     const BufferT *buffer,
-                     const int      clientSocket, const int remoteSocket) {
-  pthread_t    thread;
-  UploadArgsT *args = NULL;
-  args              = malloc(sizeof(*args));
-  if (args == NULL) {
-    logError("%s, %d malloc", __FILE__, __LINE__);
+int UploadContextT_start(
+  ProxyWorkerT * worker,
+  CacheEntryT *  entry,
+  const char *   host,
+  const int      port,
+  const char *   path,
+  const BufferT *request
+) {
+  CacheEntryT_acquire(entry);
+
+  UploadContextT *ctx = UploadContextT_new(
+    worker, entry, host, port, path, request
+  );
+  if (ctx == NULL) {
     goto uploadFailed;
   }
-  BufferT *uploadBuffer = BufferT_new(buffer->maxSize);
-  if (uploadBuffer == NULL) {
-    logError("%s, %d BufferT_new %s", __FILE__, __LINE__, strerror(errno));
+
+  ctx->handler.fd = UpstreamPoolT_checkout(worker->upstreamPool, host, port);
+  ctx->reused     = ctx->handler.fd >= 0;
+  if (!ctx->reused) {
+    if (startConnect(ctx, worker->loop) != SUCCESS) {
+      goto uploadFailed;
+    }
+    return SUCCESS;
+  }
+
+  ctx->state    = UploadSendingRequest;
+  const int ret = EventLoopT_add(
+    worker->loop, &ctx->handler, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET
+  );
+  if (ret != SUCCESS) {
+    logError("%s, %d EventLoopT_add %s", __FILE__, __LINE__, strerror(errno));
+    close(ctx->handler.fd);
     goto uploadFailed;
   }
+  EventLoopT_armTimer(worker->loop, &ctx->timer, CONNECT_TIMEOUT);
+  return SUCCESS;
 
-  args->buffer            = uploadBuffer;
-  args->remoteSocket      = remoteSocket;
-  args->clientSocket      = clientSocket;
-  args->entry             = entry;
+uploadFailed:
+  if (ctx != NULL) {
+    EventLoopT_disarmTimer(worker->loop, &ctx->timer);
+    DnsResolverT_cancel(worker->resolver, &ctx->dnsWaiter);
+    EventLoopT_cancelPost(worker->loop, &ctx->handler);
+    BufferPoolT_release(worker->bufferPool, ctx->buffer);
+    recycleContext(worker, ctx);
+  }
+  if (!serveStaleOnError(worker, entry)) {
+    CacheManagerT_remove_CacheEntryT(worker->cacheManager, entry);
+  }
+  CacheEntryT_updateStatus(entry, Failed);
+  if (CacheEntryT_release(entry)) {
+    CacheEntryT_delete(entry);
+  }
+  return ERROR;
+}
 
-  int ret = pthread_create(&thread,NULL, fileUploaderStartup, args);
-  if (ret != 0) {
-    logError("%s, %d pthread_create", __FILE__, __LINE__);
-    goto uploadFailed;
+int UploadContextT_startRelay(
+  ProxyWorkerT * worker,
+  const int      clientSocket,
+  const char *   host,
+  const int      port,
+  const char *   path,
+  const BufferT *request
+) {
+  UploadContextT *ctx = UploadContextT_new(
+    worker, NULL, host, port, path, request
+  );
+  if (ctx == NULL) {
+    sendError(clientSocket, BadGatewayStatus, FailedToConnectRemoteServer);
+    close(clientSocket);
+    return ERROR;
+  }
+  ctx->relayFd = clientSocket;
+  /*
+   * requests which may be not idempotent never reuse a pooled connection,
+   * a fresh one has nothing to retry
+   */
+  if (startConnect(ctx, worker->loop) != SUCCESS) {
+    UploadContextT_finish(ctx, worker->loop, Failed);
+    return ERROR;
   }
+  return SUCCESS;
+}
 
-  ret = pthread_detach(thread);
-  if (ret < 0) {
-    CHECK_RET("pthread_detach", ret);
+int UploadContextT_startTunnel(
+  ProxyWorkerT *worker,
+  const int     clientSocket,
+  const char *  host,
+  const int     port,
+  const char *  early,
+  const size_t  earlyLen
+) {
+  UploadContextT *ctx = UploadContextT_new(
+    worker, NULL, host, port, NULL, NULL
+  );
+  if (ctx == NULL) {
+    goto tunnelFailed;
+  }
+  if (reserveRequest(ctx, earlyLen + 1) != SUCCESS) {
+    logError("%s, %d malloc", __FILE__, __LINE__);
+    recycleContext(worker, ctx);
+    goto tunnelFailed;
+  }
+  memcpy(ctx->request, early, earlyLen);
+  ctx->requestLen = earlyLen;
+  ctx->relayFd    = clientSocket;
+  ctx->tunnel     = true;
+  if (startConnect(ctx, worker->loop) != SUCCESS) {
+    UploadContextT_finish(ctx, worker->loop, Failed);
+    return ERROR;
   }
   return SUCCESS;
 
-uploadFailed:
-  BufferT_delete(uploadBuffer);
-  sendError(clientSocket, InternalErrorStatus, "");
-  free(args);
+tunnelFailed:
+  sendError(clientSocket, BadGatewayStatus, FailedToConnectRemoteServer);
+  close(clientSocket);
   return ERROR;
 }
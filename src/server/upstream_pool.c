@@ -0,0 +1,185 @@
+#include "proxy.h"
+#include "../utils/log.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+/**
+ * Idle keep-alive connection parked in the pool, stays registered in the
+ * loop to notice the origin closing it. Released ones are recycled rather
+ * than freed: an event of the same `epoll_wait` batch may still point
+ * to them, and a checkin allocates nothing once the pool warmed up
+ */
+struct UpstreamConnection {
+  EventHandlerT        handler;
+  EventTimerT          timer;
+  UpstreamPoolT *      pool;
+  UpstreamConnectionT *prev;
+  UpstreamConnectionT *next;
+  char                 host[HOST_MAX_LEN];
+  int                  port;
+};
+
+UpstreamPoolT *UpstreamPoolT_new(
+  EventLoopT *loop, const size_t maxIdlePerHost, const long idleTimeout
+) {
+  UpstreamPoolT *pool = malloc(sizeof(*pool));
+  if (pool == NULL) {
+    return NULL;
+  }
+  memset(pool, 0, sizeof(*pool));
+  pool->loop           = loop;
+  pool->maxIdlePerHost = maxIdlePerHost;
+  pool->idleTimeout    = idleTimeout;
+  return pool;
+}
+
+static void unlinkConnection(UpstreamConnectionT *conn) {
+  UpstreamPoolT *pool = conn->pool;
+  if (conn->prev != NULL) {
+    conn->prev->next = conn->next;
+  } else {
+    pool->idle = conn->next;
+  }
+  if (conn->next != NULL) {
+    conn->next->prev = conn->prev;
+  }
+  --pool->idleQ;
+  EventLoopT_disarmTimer(pool->loop, &conn->timer);
+  EventLoopT_remove(pool->loop, &conn->handler);
+}
+
+static void onReleasedEvent(
+  EventLoopT *loop, EventHandlerT *handler, const uint32_t events
+) {
+  (void) loop;
+  (void) handler;
+  (void) events;
+}
+
+/**
+ * @return fd of @code conn which is moved to the free list
+ */
+static int releaseConnection(UpstreamConnectionT *conn) {
+  UpstreamPoolT *pool = conn->pool;
+  unlinkConnection(conn);
+  const int fd = conn->handler.fd;
+  conn->handler.fd      = ERROR;
+  conn->handler.onEvent = onReleasedEvent;
+  conn->prev            = NULL;
+  conn->next            = pool->released;
+  pool->released        = conn;
+  return fd;
+}
+
+static void closeConnection(UpstreamConnectionT *conn) {
+  close(releaseConnection(conn));
+}
+
+/**
+ * any readiness of an idle connection is either close or garbage
+ */
+static void onIdleEvent(
+  EventLoopT *loop, EventHandlerT *handler, const uint32_t events
+) {
+  (void) loop;
+  (void) events;
+  closeConnection(CONTAINER_OF(handler, UpstreamConnectionT, handler));
+}
+
+static void onIdleTimeout(EventLoopT *loop, EventTimerT *timer) {
+  (void) loop;
+  closeConnection(CONTAINER_OF(timer, UpstreamConnectionT, timer));
+}
+
+/**
+ * @return `true` if nothing is pending on @code fd and the peer has not
+ * closed it
+ */
+static bool isConnectionAlive(const int fd) {
+  char          probe;
+  const ssize_t ret = recv(fd, &probe, 1, MSG_PEEK | MSG_DONTWAIT);
+  return ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+int UpstreamPoolT_checkout(
+  UpstreamPoolT *pool, const char *host, const int port
+) {
+  UpstreamConnectionT *conn = pool->idle;
+  while (conn != NULL) {
+    UpstreamConnectionT *next = conn->next;
+    if (conn->port != port || strcmp(conn->host, host) != 0) {
+      conn = next;
+      continue;
+    }
+
+    const int fd = releaseConnection(conn);
+    if (isConnectionAlive(fd)) {
+      return fd;
+    }
+    close(fd);
+    conn = next;
+  }
+  return ERROR;
+}
+
+void UpstreamPoolT_checkin(
+  UpstreamPoolT *pool, const int fd, const char *host, const int port
+) {
+  if (pool->maxIdlePerHost == 0) {
+    close(fd);
+    return;
+  }
+  size_t               sameHostQ = 0;
+  UpstreamConnectionT *oldest    = NULL;
+  for (UpstreamConnectionT *cur = pool->idle; cur != NULL; cur = cur->next) {
+    if (cur->port == port && strcmp(cur->host, host) == 0) {
+      ++sameHostQ;
+      oldest = cur;
+    }
+  }
+  if (sameHostQ >= pool->maxIdlePerHost) {
+    closeConnection(oldest);
+  }
+
+  UpstreamConnectionT *conn = pool->released;
+  if (conn != NULL) {
+    pool->released = conn->next;
+  } else {
+    conn = malloc(sizeof(*conn));
+  }
+  if (conn == NULL) {
+    close(fd);
+    return;
+  }
+  memset(conn, 0, sizeof(*conn));
+  conn->pool            = pool;
+  conn->handler.fd      = fd;
+  conn->handler.onEvent = onReleasedEvent;
+  conn->port            = port;
+  snprintf(conn->host, sizeof(conn->host), "%s", host);
+  EventTimerT_init(&conn->timer, onIdleTimeout);
+
+  if (EventLoopT_add(
+        pool->loop, &conn->handler, EPOLLIN | EPOLLRDHUP | EPOLLET
+      ) != SUCCESS) {
+    logError("%s:%d pool checkin %s", __FILE__, __LINE__, strerror(errno));
+    close(fd);
+    conn->next     = pool->released;
+    pool->released = conn;
+    return;
+  }
+  conn->handler.onEvent = onIdleEvent;
+  conn->next = pool->idle;
+  if (pool->idle != NULL) {
+    pool->idle->prev = conn;
+  }
+  pool->idle = conn;
+  ++pool->idleQ;
+  EventLoopT_armTimer(pool->loop, &conn->timer, pool->idleTimeout);
+}
@@ -1,39 +1,19 @@
 #include <errno.h>
-#include <netdb.h>
+#include <fcntl.h>
+#include <netinet/in.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/socket.h>
 
 #include "proxy.h"
 #include "../utils/log.h"
 
-#define DEF_HTTP_PORT 80
-
-int parseURL(const char *url, char *host, char *path, int *port) {
-  *port = DEF_HTTP_PORT;
-  strcpy(path, "");
-  // http://host:port/path
-  if (sscanf(url, "http://%99[^:/]:%d/%1999[^\n]", host, port, path) == 3) {
-    // http://host/path
-  } else if (sscanf(url, "http://%99[^/]/%1999[^\n]", host, path) == 2) {
-    // http://host:port
-  } else if (sscanf(url, "http://%99[^:/]:%d[^\n]", host, port) == 2) {
-    strcpy(path, "");
-    // http://host
-  } else if (sscanf(url, "http://%99[^\n]", host) == 1) {
-    strcpy(path, "");
-  } else {
-    return ERROR;
-  }
-
-  if (strlen(path) == 0) {
-    host[strlen(host) - 1] = '\0';
-  }
-
-  return SUCCESS;
-}
+#define HTTP_DATE_MAX_LENGTH 64
+#define ERROR_HEAD_MAX_LENGTH 256
 
 size_t sendN(const int socket, const char *buffer, const size_t size) {
   size_t totalSent = 0;
@@ -214,62 +194,197 @@ int forwardDataWithTimeout(
   return SUCCESS;
 }
 
-void sendError(const int sock, const char *status, const char *message) {
-  constexpr size_t contentLenReserve = 20;
-  const char *     responseTemplate  = "HTTP/1.1 %s\r\n"
-      "C ontent-Type: text/plain\r\n"
-      "Content-Length: %zu\r\n"
-      "\r\n"
-      "%s";
-  const size_t responseLength = strlen(responseTemplate)
-                                + strlen(message)
-                                + strlen(status)
-                                + contentLenReserve;
-  char *response = malloc(responseLength * sizeof(*response));
-  snprintf(
-    response,
-    responseLength * sizeof(*response),
-    responseTemplate,
+size_t formatError(
+  char *      dest,
+  const size_t size,
+  const char *status,
+  const char *message
+) {
+  const int len = snprintf(
+    dest,
+    size,
+    "HTTP/1.1 %s\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: %zu\r\n"
+    "Connection: close\r\n"
+    "\r\n"
+    "%s",
     status,
     strlen(message),
     message
   );
-  sendN(sock, response, strlen(response));
-  free(response);
+  if (len < 0) return 0;
+  return (size_t) len < size ? (size_t) len : size - 1;
 }
 
-/**
- * @param host destination server host
- * @param port destination server port
- * @return server socket
- */
-int getSocketOfRemote(const char *host, const int port) {
-  const struct hostent *server = gethostbyname(host);
-  if (server == NULL) {
-    logError("%s : %d gethostbyname %s", __FILE__, __LINE__, strerror(errno));
+void sendError(const int sock, const char *status, const char *message) {
+  char      head[ERROR_HEAD_MAX_LENGTH];
+  const int headLen = snprintf(
+    head, sizeof(head),
+    "HTTP/1.1 %s\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: %zu\r\n"
+    "Connection: close\r\n"
+    "\r\n",
+    status,
+    strlen(message)
+  );
+  if (headLen < 0 || (size_t) headLen >= sizeof(head)) return;
+
+  OutputVectorT out;
+  OutputVectorT_reset(&out);
+  OutputVectorT_add(&out, head, headLen);
+  OutputVectorT_add(&out, message, strlen(message));
+  bool done = out.iovQ == 0;
+  while (!done) {
+    const ssize_t sent = OutputVectorT_send(&out, sock);
+    if (sent < 0) {
+      if (errno == EINTR) continue;
+      return;
+    }
+    done = OutputVectorT_advance(&out, sent);
+  }
+}
+
+const char *findHeader(
+  const char *head, const size_t headLen, const char *name, size_t *valueLen
+) {
+  const size_t nameLen = strlen(name);
+  const char * end     = head + headLen;
+  /*
+   * the first line is the request or status line, never a header
+   */
+  const char *line = strstrn(head, headLen, "\r\n", 2);
+  while (line != NULL) {
+    line += 2;
+    const char *lineEnd = strstrn(line, end - line, "\r\n", 2);
+    if (lineEnd == NULL || lineEnd == line) break;
+
+    if ((size_t) (lineEnd - line) > nameLen
+        && line[nameLen] == ':'
+        && strncasecmp(line, name, nameLen) == 0) {
+      const char *value = line + nameLen + 1;
+      while (value < lineEnd && (*value == ' ' || *value == '\t')) ++value;
+      const char *valueEnd = lineEnd;
+      while (valueEnd > value && (valueEnd[-1] == ' ' || valueEnd[-1] == '\t')) {
+        --valueEnd;
+      }
+      *valueLen = valueEnd - value;
+      return value;
+    }
+    line = lineEnd;
+  }
+  return NULL;
+}
+
+size_t copyHeadersExcept(
+  char *       dest,
+  const size_t capacity,
+  const char * head,
+  const size_t headLen,
+  const char **excluded,
+  const size_t excludedQ
+) {
+  const char *end  = head + headLen;
+  const char *line = strstrn(head, headLen, "\r\n", 2);
+  size_t      len  = 0;
+  while (line != NULL) {
+    line += 2;
+    const char *lineEnd = strstrn(line, end - line, "\r\n", 2);
+    if (lineEnd == NULL || lineEnd == line) break;
+
+    const size_t lineLen = lineEnd - line + 2;
+    const char * colon   = memchr(line, ':', lineEnd - line);
+    bool         skip    = colon == NULL;
+    for (size_t i = 0; !skip && i < excludedQ; ++i) {
+      skip = strlen(excluded[i]) == (size_t) (colon - line)
+             && strncasecmp(excluded[i], line, colon - line) == 0;
+    }
+    if (!skip && len + lineLen <= capacity) {
+      memcpy(dest + len, line, lineLen);
+      len += lineLen;
+    }
+    line = lineEnd;
+  }
+  return len;
+}
+
+bool findHeaderDirective(
+  const char *value,
+  const size_t valueLen,
+  const char * directive,
+  long *       argument
+) {
+  const size_t directiveLen = strlen(directive);
+  const char * end          = value + valueLen;
+  const char * cur          = value;
+  while (cur < end) {
+    while (cur < end && (*cur == ' ' || *cur == ',')) ++cur;
+    const char *tokenEnd = cur;
+    while (tokenEnd < end && *tokenEnd != ',') ++tokenEnd;
+
+    const size_t tokenLen = tokenEnd - cur;
+    if (tokenLen >= directiveLen
+        && strncasecmp(cur, directive, directiveLen) == 0
+        && (tokenLen == directiveLen || cur[directiveLen] == '=')) {
+      if (argument != NULL) {
+        *argument = tokenLen > directiveLen
+                      ? strtol(cur + directiveLen + 1, NULL, 10)
+                      : -1;
+      }
+      return true;
+    }
+    cur = tokenEnd;
+  }
+  return false;
+}
+
+int64_t parseHttpDate(const char *value, const size_t valueLen) {
+  char date[HTTP_DATE_MAX_LENGTH];
+  if (valueLen == 0 || valueLen >= sizeof(date)) return ERROR;
+  memcpy(date, value, valueLen);
+  date[valueLen] = '\0';
+
+  struct tm   tm  = {0};
+  const char *end = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  if (end == NULL) return ERROR;
+  return (int64_t) timegm(&tm) * 1000;
+}
+
+int setNonBlocking(const int socket) {
+  const int flags = fcntl(socket, F_GETFL, 0);
+  if (flags < 0 || fcntl(socket, F_SETFL, flags | O_NONBLOCK) < 0) {
     return ERROR;
   }
+  return SUCCESS;
+}
+
+int getSocketOfRemote(const DnsAddressT *address, const int port) {
+  struct sockaddr_storage addr = address->addr;
+  if (addr.ss_family == AF_INET6) {
+    ((struct sockaddr_in6 *) &addr)->sin6_port = htons(port);
+  } else {
+    ((struct sockaddr_in *) &addr)->sin_port = htons(port);
+  }
 
-  int serverSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  int serverSocket = socket(
+    addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP
+  );
   if (serverSocket < 0) {
     logError(
       "%s : %d failed to create server socket %s",
-      __FILE__, __LINE__, strerror(serverSocket)
+      __FILE__, __LINE__, strerror(errno)
     );
     return ERROR;
   }
 
-  struct sockaddr_in server_addr = {0};
-  server_addr.sin_family         = AF_INET;
-  server_addr.sin_port           = htons(port);
-  memcpy(&server_addr.sin_addr.s_addr, server->h_addr, server->h_length);
   const int ret = connect(
-    serverSocket, (struct sockaddr *) &server_addr, sizeof(server_addr)
+    serverSocket, (struct sockaddr *) &addr, address->addrLen
   );
-  if (ret < 0) {
+  if (ret < 0 && errno != EINPROGRESS) {
     logError(
-      "%s : %d failed to connect server : %s port : %d, error %s",
-      __FILE__, __LINE__, host, port, strerror(ret)
+      "%s : %d failed to connect server port : %d, error %s",
+      __FILE__, __LINE__, port, strerror(errno)
     );
     goto destroySocket;
   }
@@ -76,8 +76,13 @@ static void logCommon(const char *log_level_,
   struct timeval tv;
   gettimeofday(&tv, 0);
 
-  time_t     stamp_time = time(NULL);
-  struct tm *tm = localtime(&stamp_time);
+  /*
+   * unlike localtime the reentrant one does not reload the zone, which
+   * allocates, on every call
+   */
+  const time_t stamp_time = tv.tv_sec;
+  struct tm    local;
+  struct tm *  tm = localtime_r(&stamp_time, &local);
 
   char text[MAX_LOG_MESSAGE_LENGTH + 1] = {0};
   vsnprintf(text, MAX_LOG_MESSAGE_LENGTH, format, args);
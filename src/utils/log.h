@@ -21,6 +21,18 @@
 
 #define LOG_LEVEL_DEFAULT LOG_INFO_LEVEL
 
+/**
+ * aborts on a nonzero @code ret of a pthread call, which never fails in a
+ * correct program. Needs `string.h` and `stdlib.h`
+ */
+#define CHECK_RET(description, ret) \
+  do { \
+    if (ret != 0) { \
+      logFatal( "%s:%d %s : %s", __FILE__, __LINE__, description, strerror(ret)); \
+      abort(); \
+    } \
+  } while (0)
+
 void logSetLevel(int log_level);
 
 void logTrace(const char *format, ...);
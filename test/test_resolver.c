@@ -0,0 +1,153 @@
+#include "../src/dns/resolver.h"
+#include "../src/utils/log.h"
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <netinet/in.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * `DnsResolverT` against a stub lookup which counts its calls and holds
+ * them until released: concurrent waiters of one host share a lookup,
+ * failures are cached for the negative ttl and results are looked up
+ * again once they expire. `localhost` goes through `getaddrinfo`
+ */
+
+#define TEST_POSITIVE_TTL 300
+#define TEST_NEGATIVE_TTL 150
+#define TEST_FAILING_HOST "fail.test"
+
+static atomic_int  lookupsQ;
+static atomic_bool released;
+
+static void sleepMs(const long ms) {
+  const struct timespec delay = {ms / 1000, (ms % 1000) * 1000000};
+  nanosleep(&delay, NULL);
+}
+
+static void stubLookup(const char *host, DnsAddressesT *addresses) {
+  atomic_fetch_add(&lookupsQ, 1);
+  while (!atomic_load(&released)) {
+    sleepMs(1);
+  }
+  addresses->count = 0;
+  if (strcmp(host, TEST_FAILING_HOST) == 0) return;
+
+  struct sockaddr_in *addr = (struct sockaddr_in *) &addresses->list[0].addr;
+  memset(addr, 0, sizeof(*addr));
+  addr->sin_family           = AF_INET;
+  addr->sin_addr.s_addr      = htonl(INADDR_LOOPBACK);
+  addresses->list[0].addrLen = sizeof(*addr);
+  addresses->count           = 1;
+}
+
+typedef struct TestWaiter {
+  DnsWaiterT waiter;
+  atomic_int notifiedQ;
+} TestWaiterT;
+
+static void onResolved(DnsWaiterT *waiter) {
+  atomic_fetch_add(&((TestWaiterT *) waiter)->notifiedQ, 1);
+}
+
+static void TestWaiterT_init(TestWaiterT *waiter) {
+  memset(waiter, 0, sizeof(*waiter));
+  waiter->waiter.notify = onResolved;
+}
+
+static void waitNotified(TestWaiterT *waiter) {
+  while (atomic_load(&waiter->notifiedQ) == 0) {
+    sleepMs(1);
+  }
+}
+
+/**
+ * @return status of a resolve of @code host which waited for its lookup
+ */
+static int resolveWaiting(DnsResolverT *resolver, const char *host) {
+  TestWaiterT   waiter;
+  DnsAddressesT result;
+  TestWaiterT_init(&waiter);
+  int status = DnsResolverT_resolve(resolver, host, &result, &waiter.waiter);
+  if (status == DNS_PENDING) {
+    waitNotified(&waiter);
+    status = DnsResolverT_resolve(resolver, host, &result, &waiter.waiter);
+  }
+  return status;
+}
+
+static void testSharedLookup(DnsResolverT *resolver) {
+  TestWaiterT   first;
+  TestWaiterT   second;
+  DnsAddressesT result;
+  TestWaiterT_init(&first);
+  TestWaiterT_init(&second);
+  atomic_store(&released, false);
+  const int before = atomic_load(&lookupsQ);
+
+  assert(DnsResolverT_resolve(resolver, "a.test", &result, &first.waiter)
+         == DNS_PENDING);
+  assert(DnsResolverT_resolve(resolver, "a.test", &result, &second.waiter)
+         == DNS_PENDING);
+  atomic_store(&released, true);
+  waitNotified(&first);
+  waitNotified(&second);
+  assert(atomic_load(&lookupsQ) == before + 1);
+
+  assert(DnsResolverT_resolve(resolver, "a.test", &result, &first.waiter)
+         == DNS_RESOLVED);
+  assert(result.count == 1);
+  assert(atomic_load(&lookupsQ) == before + 1);
+}
+
+static void testNegativeCache(DnsResolverT *resolver) {
+  const int before = atomic_load(&lookupsQ);
+  assert(resolveWaiting(resolver, TEST_FAILING_HOST) == DNS_FAILED);
+  assert(atomic_load(&lookupsQ) == before + 1);
+
+  assert(resolveWaiting(resolver, TEST_FAILING_HOST) == DNS_FAILED);
+  assert(atomic_load(&lookupsQ) == before + 1);
+
+  sleepMs(TEST_NEGATIVE_TTL + 50);
+  assert(resolveWaiting(resolver, TEST_FAILING_HOST) == DNS_FAILED);
+  assert(atomic_load(&lookupsQ) == before + 2);
+}
+
+static void testExpiry(DnsResolverT *resolver) {
+  const int before = atomic_load(&lookupsQ);
+  assert(resolveWaiting(resolver, "b.test") == DNS_RESOLVED);
+  assert(resolveWaiting(resolver, "b.test") == DNS_RESOLVED);
+  assert(atomic_load(&lookupsQ) == before + 1);
+
+  sleepMs(TEST_POSITIVE_TTL + 50);
+  assert(resolveWaiting(resolver, "b.test") == DNS_RESOLVED);
+  assert(atomic_load(&lookupsQ) == before + 2);
+}
+
+static void testHostsFixture(void) {
+  DnsResolverT *resolver = DnsResolverT_new(
+    TEST_POSITIVE_TTL, TEST_NEGATIVE_TTL
+  );
+  assert(resolver != NULL);
+  assert(resolveWaiting(resolver, "localhost") == DNS_RESOLVED);
+}
+
+int main(void) {
+  logSetLevel(LOG_ERROR_LEVEL);
+  DnsResolverT *resolver = DnsResolverT_new(
+    TEST_POSITIVE_TTL, TEST_NEGATIVE_TTL
+  );
+  assert(resolver != NULL);
+  resolver->lookup = stubLookup;
+  atomic_store(&released, true);
+
+  testSharedLookup(resolver);
+  testNegativeCache(resolver);
+  testExpiry(resolver);
+  testHostsFixture();
+  printf("resolver tests passed\n");
+  return 0;
+}